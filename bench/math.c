@@ -0,0 +1,715 @@
+/*
+ * airhockey - math benchmark
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * This times every operation of the math wrapper and compares the results
+ * against a double precision reference implementation. For each operation the
+ * average time per call, the maximal error in ULPs and the maximal absolute
+ * error are reported.
+ * Operations that work in place copy their input before each call so the
+ * timings of these operations include a small copy.
+ */
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "mathw.h"
+
+#define SETS 1024
+#define ROUNDS 2000
+
+struct input {
+	math_m4 a;
+	math_m4 b;
+	float angle;
+	math_v3 axis;
+};
+
+static struct input in[SETS];
+static math_m4 out[SETS];
+static double ref[SETS][16];
+static struct math_stack stack;
+static struct math_trs trs[SETS];
+
+static int64_t now_ns()
+{
+	struct timespec val;
+
+	clock_gettime(CLOCK_MONOTONIC, &val);
+	return val.tv_sec * 1000000000LL + val.tv_nsec;
+}
+
+static float frand(float min, float max)
+{
+	return min + (max - min) * (rand() / (float)RAND_MAX);
+}
+
+/*
+ * Random matrices are built from a rotation, a scale and a translation so they
+ * are always invertible and well conditioned.
+ */
+static void init_input()
+{
+	size_t i, j;
+	math_q4 q;
+	math_m4 m;
+
+	srand(42);
+
+	for (i = 0; i < SETS; ++i) {
+		in[i].angle = frand(-180.0f, 180.0f);
+		for (j = 0; j < 3; ++j)
+			in[i].axis[j] = frand(-1.0f, 1.0f);
+		math_v3_normalize(in[i].axis);
+
+		math_q4_rotate(q, in[i].angle, in[i].axis);
+		math_q4_to_m4(q, in[i].a);
+		for (j = 0; j < 3; ++j)
+			in[i].a[j][j] *= frand(0.5f, 2.0f);
+		for (j = 0; j < 3; ++j)
+			in[i].a[3][j] = frand(-10.0f, 10.0f);
+
+		math_q4_rotate(q, frand(-180.0f, 180.0f), in[i].axis);
+		math_q4_to_m4(q, m);
+		for (j = 0; j < 3; ++j)
+			m[3][j] = frand(-10.0f, 10.0f);
+		math_m4_copy(in[i].b, m);
+
+		/* vector operations use the last row of \b as w component */
+		in[i].b[3][3] = frand(-1.0f, 1.0f);
+	}
+}
+
+/*
+ * Double precision reference helpers. All matrices are stored in column major
+ * order like the math_m4 type.
+ */
+
+static void ref_mult(double *d, const double *a, const double *b)
+{
+	size_t i, j, k;
+	double t[16];
+
+	for (j = 0; j < 4; ++j) {
+		for (i = 0; i < 4; ++i) {
+			t[j * 4 + i] = 0;
+			for (k = 0; k < 4; ++k)
+				t[j * 4 + i] += a[k * 4 + i] * b[j * 4 + k];
+		}
+	}
+
+	memcpy(d, t, sizeof(t));
+}
+
+static void ref_load(double *d, const float *f, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; ++i)
+		d[i] = f[i];
+}
+
+static void ref_invert(double *d, const double *m)
+{
+	double a[4][8], t, f;
+	size_t i, j, k, p;
+
+	for (i = 0; i < 4; ++i) {
+		for (j = 0; j < 4; ++j) {
+			a[i][j] = m[i * 4 + j];
+			a[i][j + 4] = (i == j);
+		}
+	}
+
+	for (j = 0; j < 4; ++j) {
+		p = j;
+		for (i = j + 1; i < 4; ++i)
+			if (fabs(a[i][j]) > fabs(a[p][j]))
+				p = i;
+		for (k = 0; k < 8; ++k) {
+			t = a[j][k];
+			a[j][k] = a[p][k];
+			a[p][k] = t;
+		}
+
+		f = 1.0 / a[j][j];
+		for (k = 0; k < 8; ++k)
+			a[j][k] *= f;
+
+		for (i = 0; i < 4; ++i) {
+			if (i == j)
+				continue;
+			f = a[i][j];
+			for (k = 0; k < 8; ++k)
+				a[i][k] -= f * a[j][k];
+		}
+	}
+
+	for (i = 0; i < 4; ++i)
+		for (j = 0; j < 4; ++j)
+			d[i * 4 + j] = a[i][j + 4];
+}
+
+/* quaternion of \angle degrees around \axis in the plib convention */
+static void ref_q4_rotate(double *q, float angle, const float *axis)
+{
+	double l, s;
+
+	l = sqrt((double)axis[0] * axis[0] + (double)axis[1] * axis[1] +
+						(double)axis[2] * axis[2]);
+	s = -sin(angle * M_PI / 360.0) / l;
+	q[0] = axis[0] * s;
+	q[1] = axis[1] * s;
+	q[2] = axis[2] * s;
+	q[3] = cos(angle * M_PI / 360.0);
+}
+
+static void ref_q4_to_m4(double *m, const double *q)
+{
+	double x = q[0], y = q[1], z = q[2], w = q[3];
+
+	memset(m, 0, sizeof(*m) * 16);
+	m[0] = 1 - 2 * (y * y + z * z);
+	m[1] = 2 * (x * y - w * z);
+	m[2] = 2 * (x * z + w * y);
+	m[4] = 2 * (x * y + w * z);
+	m[5] = 1 - 2 * (x * x + z * z);
+	m[6] = 2 * (y * z - w * x);
+	m[8] = 2 * (x * z - w * y);
+	m[9] = 2 * (y * z + w * x);
+	m[10] = 1 - 2 * (x * x + y * y);
+	m[15] = 1;
+}
+
+static void ref_normalize(double *v, const float *f, size_t num)
+{
+	size_t i;
+	double l = 0;
+
+	for (i = 0; i < num; ++i)
+		l += (double)f[i] * f[i];
+	l = sqrt(l);
+
+	for (i = 0; i < num; ++i)
+		v[i] = f[i] / l;
+}
+
+static void ref_identity(double *m)
+{
+	memset(m, 0, sizeof(*m) * 16);
+	m[0] = m[5] = m[10] = m[15] = 1;
+}
+
+static void ref_trs_matrix(double *m, const struct math_trs *t)
+{
+	double q[4];
+	size_t i, j;
+
+	ref_load(q, t->rotation, 4);
+	ref_q4_to_m4(m, q);
+	for (i = 0; i < 3; ++i)
+		for (j = 0; j < 3; ++j)
+			m[i * 4 + j] *= t->scale[i];
+	for (j = 0; j < 3; ++j)
+		m[12 + j] = t->position[j];
+}
+
+/*
+ * Benchmarked operations
+ * Each operation has a runner that executes the math wrapper on input set \i
+ * and writes the result into out[\i], and a reference that writes the double
+ * precision result into ref[\i].
+ */
+
+#define IN_V(i, row) ((float*)in[(i)].b[(row)])
+
+static void run_v3_copy(size_t i)
+{
+	math_v3_copy(out[i][0], IN_V(i, 0));
+}
+
+static void ref_v3_copy(size_t i)
+{
+	ref_load(ref[i], IN_V(i, 0), 3);
+}
+
+static void run_v3_normalize(size_t i)
+{
+	memcpy(out[i][0], IN_V(i, 3), sizeof(math_v3));
+	math_v3_normalize(out[i][0]);
+}
+
+static void ref_v3_normalize(size_t i)
+{
+	ref_normalize(ref[i], IN_V(i, 3), 3);
+}
+
+static void run_v3_product_dest(size_t i)
+{
+	math_v3_product_dest(out[i][0], IN_V(i, 0), IN_V(i, 3));
+}
+
+static void ref_v3_product_dest(size_t i)
+{
+	double a[3], b[3];
+
+	ref_load(a, IN_V(i, 0), 3);
+	ref_load(b, IN_V(i, 3), 3);
+	ref[i][0] = a[1] * b[2] - a[2] * b[1];
+	ref[i][1] = a[2] * b[0] - a[0] * b[2];
+	ref[i][2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static void run_v3_sub_dest(size_t i)
+{
+	math_v3_sub_dest(out[i][0], IN_V(i, 3), IN_V(i, 1));
+}
+
+static void ref_v3_sub_dest(size_t i)
+{
+	size_t j;
+
+	for (j = 0; j < 3; ++j)
+		ref[i][j] = (double)IN_V(i, 3)[j] - IN_V(i, 1)[j];
+}
+
+static void run_v4_copy(size_t i)
+{
+	math_v4_copy(out[i][0], IN_V(i, 3));
+}
+
+static void ref_v4_copy(size_t i)
+{
+	ref_load(ref[i], IN_V(i, 3), 4);
+}
+
+static void run_v4_add(size_t i)
+{
+	memcpy(out[i][0], IN_V(i, 3), sizeof(math_v4));
+	math_v4_add(out[i][0], IN_V(i, 2));
+}
+
+static void ref_v4_add(size_t i)
+{
+	size_t j;
+
+	for (j = 0; j < 4; ++j)
+		ref[i][j] = (double)IN_V(i, 3)[j] + IN_V(i, 2)[j];
+}
+
+static void run_q4_copy(size_t i)
+{
+	math_q4_copy(out[i][0], IN_V(i, 3));
+}
+
+static void ref_q4_copy(size_t i)
+{
+	ref_load(ref[i], IN_V(i, 3), 4);
+}
+
+static void run_q4_identity(size_t i)
+{
+	math_q4_identity(out[i][0]);
+}
+
+static void ref_q4_identity(size_t i)
+{
+	ref[i][0] = ref[i][1] = ref[i][2] = 0;
+	ref[i][3] = 1;
+}
+
+static void run_q4_normalize(size_t i)
+{
+	memcpy(out[i][0], IN_V(i, 3), sizeof(math_q4));
+	math_q4_normalize(out[i][0]);
+}
+
+static void ref_q4_normalize(size_t i)
+{
+	ref_normalize(ref[i], IN_V(i, 3), 4);
+}
+
+static void run_q4_to_m4(size_t i)
+{
+	math_q4 q;
+
+	math_q4_rotate(q, in[i].angle, in[i].axis);
+	math_q4_to_m4(q, out[i]);
+}
+
+static void ref_q4_to_m4_op(size_t i)
+{
+	double q[4];
+
+	ref_q4_rotate(q, in[i].angle, in[i].axis);
+	ref_q4_to_m4(ref[i], q);
+}
+
+static void run_q4_rotate(size_t i)
+{
+	math_q4_rotate(out[i][0], in[i].angle, in[i].axis);
+}
+
+static void ref_q4_rotate_op(size_t i)
+{
+	ref_q4_rotate(ref[i], in[i].angle, in[i].axis);
+}
+
+static void run_m4_copy(size_t i)
+{
+	math_m4_copy(out[i], in[i].a);
+}
+
+static void ref_m4_copy(size_t i)
+{
+	ref_load(ref[i], (float*)in[i].a, 16);
+}
+
+static void run_m4_identity(size_t i)
+{
+	math_m4_identity(out[i]);
+}
+
+static void ref_m4_identity(size_t i)
+{
+	ref_identity(ref[i]);
+}
+
+static void ref_translate(size_t i, const float *v)
+{
+	double a[16], t[16];
+
+	ref_load(a, (float*)in[i].a, 16);
+	ref_identity(t);
+	t[12] = v[0];
+	t[13] = v[1];
+	t[14] = v[2];
+	ref_mult(ref[i], a, t);
+}
+
+static void run_m4_translate(size_t i)
+{
+	math_m4_copy(out[i], in[i].a);
+	math_m4_translate(out[i], IN_V(i, 3)[0], IN_V(i, 3)[1], IN_V(i, 3)[2]);
+}
+
+static void ref_m4_translate(size_t i)
+{
+	ref_translate(i, IN_V(i, 3));
+}
+
+static void run_m4_translatev(size_t i)
+{
+	math_m4_copy(out[i], in[i].a);
+	math_m4_translatev(out[i], IN_V(i, 3));
+}
+
+static void ref_m4_translatev(size_t i)
+{
+	ref_translate(i, IN_V(i, 3));
+}
+
+static void run_m4_mult_dest(size_t i)
+{
+	math_m4_mult_dest(out[i], in[i].a, in[i].b);
+}
+
+static void ref_m4_mult(size_t i)
+{
+	double a[16], b[16];
+
+	ref_load(a, (float*)in[i].a, 16);
+	ref_load(b, (float*)in[i].b, 16);
+	ref_mult(ref[i], a, b);
+}
+
+static void run_m4_mult(size_t i)
+{
+	math_m4_copy(out[i], in[i].a);
+	math_m4_mult(out[i], in[i].b);
+}
+
+static void run_m4_invert_dest(size_t i)
+{
+	math_m4_invert_dest(out[i], in[i].a);
+}
+
+static void ref_m4_invert(size_t i)
+{
+	double a[16];
+
+	ref_load(a, (float*)in[i].a, 16);
+	ref_invert(ref[i], a);
+}
+
+static void run_m4_invert(size_t i)
+{
+	math_m4_copy(out[i], in[i].a);
+	math_m4_invert(out[i]);
+}
+
+static void init_trs(struct math_trs *t, size_t i)
+{
+	math_v3 s;
+
+	math_trs_identity(t);
+	math_trs_rotate(t, in[i].angle, in[i].axis);
+	math_trs_set_position(t, IN_V(i, 3));
+	s[0] = s[1] = s[2] = fabsf(in[i].a[3][0]) / 10.0f + 0.5f;
+	math_trs_set_scale(t, s);
+}
+
+static void run_trs_update(size_t i)
+{
+	init_trs(&trs[i], i);
+	math_trs_update(&trs[i]);
+	math_m4_copy(out[i], trs[i].matrix);
+}
+
+static void ref_trs_update(size_t i)
+{
+	ref_trs_matrix(ref[i], &trs[i]);
+}
+
+static void run_trs_matrix(size_t i)
+{
+	math_m4_copy(out[i], math_trs_matrix(&trs[i]));
+}
+
+static void run_trs_rotate(size_t i)
+{
+	math_trs_identity(&trs[i]);
+	math_trs_rotate(&trs[i], in[i].angle, in[i].axis);
+	math_m4_copy(out[i], math_trs_matrix(&trs[i]));
+}
+
+static void ref_trs_rotate(size_t i)
+{
+	double q[4];
+
+	ref_q4_rotate(q, in[i].angle, in[i].axis);
+	ref_q4_to_m4(ref[i], q);
+}
+
+static void run_trs_translatev(size_t i)
+{
+	init_trs(&trs[i], i);
+	math_trs_translatev(&trs[i], IN_V(i, 0));
+	math_m4_copy(out[i], math_trs_matrix(&trs[i]));
+}
+
+static void ref_trs_translatev(size_t i)
+{
+	struct math_trs t;
+	double a[16], b[16];
+
+	init_trs(&t, i);
+	ref_trs_matrix(a, &t);
+	ref_identity(b);
+	ref_load(&b[12], IN_V(i, 0), 3);
+	ref_mult(ref[i], a, b);
+}
+
+static void run_trs_compose_dest(size_t i)
+{
+	struct math_trs a, b;
+
+	init_trs(&a, i);
+	init_trs(&b, (i + 1) % SETS);
+	math_trs_compose_dest(&trs[i], &a, &b);
+	math_m4_copy(out[i], math_trs_matrix(&trs[i]));
+}
+
+static void ref_trs_compose(size_t i)
+{
+	struct math_trs a, b;
+	double ma[16], mb[16];
+
+	init_trs(&a, i);
+	init_trs(&b, (i + 1) % SETS);
+	ref_trs_matrix(ma, &a);
+	ref_trs_matrix(mb, &b);
+	ref_mult(ref[i], ma, mb);
+}
+
+static void run_trs_invert_dest(size_t i)
+{
+	struct math_trs a;
+
+	init_trs(&a, i);
+	math_trs_invert_dest(&trs[i], &a);
+	math_m4_copy(out[i], math_trs_matrix(&trs[i]));
+}
+
+static void ref_trs_invert(size_t i)
+{
+	struct math_trs a;
+	double m[16];
+
+	init_trs(&a, i);
+	ref_trs_matrix(m, &a);
+	ref_invert(ref[i], m);
+}
+
+static void run_stack_push(size_t i)
+{
+	math_m4_copy(MATH_TIP(&stack), in[i].a);
+	math_stack_push(&stack);
+	math_m4_copy(MATH_TIP(&stack), in[i].b);
+	math_stack_pop(&stack);
+	math_m4_copy(out[i], MATH_TIP(&stack));
+}
+
+static void run_stack_push_mult(size_t i)
+{
+	math_m4_copy(MATH_TIP(&stack), in[i].a);
+	math_stack_push_mult(&stack, in[i].b);
+	math_m4_copy(out[i], MATH_TIP(&stack));
+	math_stack_pop(&stack);
+}
+
+struct bench {
+	const char *name;
+	void (*run) (size_t i);
+	void (*ref) (size_t i);
+	size_t num;
+};
+
+static const struct bench benches[] = {
+	{ "math_v3_copy", run_v3_copy, ref_v3_copy, 3 },
+	{ "math_v3_normalize", run_v3_normalize, ref_v3_normalize, 3 },
+	{ "math_v3_product_dest", run_v3_product_dest, ref_v3_product_dest,
+									3 },
+	{ "math_v3_sub_dest", run_v3_sub_dest, ref_v3_sub_dest, 3 },
+	{ "math_v4_copy", run_v4_copy, ref_v4_copy, 4 },
+	{ "math_v4_add", run_v4_add, ref_v4_add, 4 },
+	{ "math_q4_copy", run_q4_copy, ref_q4_copy, 4 },
+	{ "math_q4_identity", run_q4_identity, ref_q4_identity, 4 },
+	{ "math_q4_normalize", run_q4_normalize, ref_q4_normalize, 4 },
+	{ "math_q4_rotate", run_q4_rotate, ref_q4_rotate_op, 4 },
+	{ "math_q4_rotate+to_m4", run_q4_to_m4, ref_q4_to_m4_op, 16 },
+	{ "math_m4_copy", run_m4_copy, ref_m4_copy, 16 },
+	{ "math_m4_identity", run_m4_identity, ref_m4_identity, 16 },
+	{ "math_m4_translate", run_m4_translate, ref_m4_translate, 16 },
+	{ "math_m4_translatev", run_m4_translatev, ref_m4_translatev, 16 },
+	{ "math_m4_mult_dest", run_m4_mult_dest, ref_m4_mult, 16 },
+	{ "math_m4_mult", run_m4_mult, ref_m4_mult, 16 },
+	{ "math_m4_invert_dest", run_m4_invert_dest, ref_m4_invert, 16 },
+	{ "math_m4_invert", run_m4_invert, ref_m4_invert, 16 },
+	{ "math_trs_update", run_trs_update, ref_trs_update, 16 },
+	{ "math_trs_matrix", run_trs_matrix, ref_trs_update, 16 },
+	{ "math_trs_rotate", run_trs_rotate, ref_trs_rotate, 16 },
+	{ "math_trs_translatev", run_trs_translatev, ref_trs_translatev, 16 },
+	{ "math_trs_compose_dest", run_trs_compose_dest, ref_trs_compose, 16 },
+	{ "math_trs_invert_dest", run_trs_invert_dest, ref_trs_invert, 16 },
+	{ "math_stack_push+pop", run_stack_push, ref_m4_copy, 16 },
+	{ "math_stack_push_mult", run_stack_push_mult, ref_m4_mult, 16 },
+	{ NULL },
+};
+
+/*
+ * Returns the distance between \f and \d in units of the last place of the
+ * single precision value closest to \scale. Using the largest component of a
+ * result as scale keeps components near zero, which suffer from cancellation,
+ * from dominating the report.
+ */
+static double ulp_error(float f, double d, double scale)
+{
+	float r = scale;
+	double ulp;
+
+	ulp = nextafterf(r, INFINITY) - r;
+	if (ulp < FLT_MIN)
+		ulp = FLT_MIN;
+
+	return fabs(f - d) / ulp;
+}
+
+static void check(const struct bench *b, double *max_ulp, double *max_abs)
+{
+	size_t i, j;
+	double u, a, scale;
+	float *f;
+
+	*max_ulp = 0;
+	*max_abs = 0;
+
+	for (i = 0; i < SETS; ++i) {
+		b->ref(i);
+		f = (float*)out[i];
+
+		scale = 0;
+		for (j = 0; j < b->num; ++j)
+			if (fabs(ref[i][j]) > scale)
+				scale = fabs(ref[i][j]);
+
+		for (j = 0; j < b->num; ++j) {
+			u = ulp_error(f[j], ref[i][j], scale);
+			a = fabs(f[j] - ref[i][j]);
+			if (u > *max_ulp)
+				*max_ulp = u;
+			if (a > *max_abs)
+				*max_abs = a;
+		}
+	}
+}
+
+static double measure(const struct bench *b)
+{
+	size_t i, r;
+	int64_t start;
+
+	/* warm up and fill the output for the accuracy check */
+	for (i = 0; i < SETS; ++i)
+		b->run(i);
+
+	start = now_ns();
+	for (r = 0; r < ROUNDS; ++r)
+		for (i = 0; i < SETS; ++i)
+			b->run(i);
+
+	return (now_ns() - start) / (double)(ROUNDS * SETS);
+}
+
+int main()
+{
+	const struct bench *b;
+	struct ulog_dev *log;
+	double ns, max_ulp, max_abs;
+
+	log = ulog_new("Math: ");
+	if (!log)
+		return ENOMEM;
+
+	math_init(log);
+	ulog_unref(log);
+	math_stack_init(&stack);
+	init_input();
+
+	printf("backend: %s\n", math_backend());
+	printf("%-24s %10s %10s %12s\n", "operation", "ns/op", "max ulp",
+								"max abs");
+
+	for (b = benches; b->name; ++b) {
+		ns = measure(b);
+		check(b, &max_ulp, &max_abs);
+		printf("%-24s %10.2f %10.2f %12.3e\n", b->name, ns, max_ulp,
+								max_abs);
+	}
+
+	math_stack_destroy(&stack);
+	math_destroy();
+
+	return 0;
+}
@@ -8,6 +8,7 @@
 #define E3D_ENGINE3D_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -34,6 +35,8 @@
 /* GL type to type size */
 static const size_t e3d_tsize[] = {
 	[GL_FLOAT] = sizeof(GLfloat),
+	[GL_UNSIGNED_BYTE] = sizeof(GLubyte),
+	[GL_UNSIGNED_SHORT] = sizeof(GLushort),
 	[GL_UNSIGNED_INT] = sizeof(GLuint),
 };
 #endif
@@ -64,6 +67,36 @@ struct e3d_functions {
 	PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
 	PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
 	PFNGLDISABLEVERTEXATTRIBARRAYPROC glDisableVertexAttribArray;
+	PFNGLGENVERTEXARRAYSPROC glGenVertexArrays;
+	PFNGLBINDVERTEXARRAYPROC glBindVertexArray;
+	PFNGLDELETEVERTEXARRAYSPROC glDeleteVertexArrays;
+	PFNGLVERTEXATTRIBDIVISORPROC glVertexAttribDivisor;
+	PFNGLDRAWARRAYSINSTANCEDPROC glDrawArraysInstanced;
+	PFNGLDRAWELEMENTSINSTANCEDPROC glDrawElementsInstanced;
+	void (APIENTRYP glEnable)(GLenum cap);
+	void (APIENTRYP glDisable)(GLenum cap);
+	void (APIENTRYP glPolygonMode)(GLenum face, GLenum mode);
+	void (APIENTRYP glDepthFunc)(GLenum func);
+	void (APIENTRYP glCullFace)(GLenum mode);
+	void (APIENTRYP glLineWidth)(GLfloat width);
+	PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers;
+	PFNGLBINDFRAMEBUFFERPROC glBindFramebuffer;
+	PFNGLDELETEFRAMEBUFFERSPROC glDeleteFramebuffers;
+	PFNGLFRAMEBUFFERTEXTURE2DPROC glFramebufferTexture2D;
+	PFNGLCHECKFRAMEBUFFERSTATUSPROC glCheckFramebufferStatus;
+	PFNGLDRAWBUFFERSPROC glDrawBuffers;
+	PFNGLACTIVETEXTUREPROC glActiveTexture;
+	PFNGLGETPROGRAMBINARYPROC glGetProgramBinary;
+	PFNGLPROGRAMBINARYPROC glProgramBinary;
+	PFNGLPROGRAMPARAMETERIPROC glProgramParameteri;
+	PFNGLMAPBUFFERPROC glMapBuffer;
+	PFNGLUNMAPBUFFERPROC glUnmapBuffer;
+	PFNGLGENQUERIESPROC glGenQueries;
+	PFNGLDELETEQUERIESPROC glDeleteQueries;
+	PFNGLBEGINQUERYPROC glBeginQuery;
+	PFNGLENDQUERYPROC glEndQuery;
+	PFNGLGETQUERYOBJECTIVPROC glGetQueryObjectiv;
+	PFNGLGETQUERYOBJECTUI64VPROC glGetQueryObjectui64v;
 };
 
 extern struct e3d_functions e3d_gl;
@@ -75,6 +108,29 @@ extern void e3d_init(struct ulog_dev *log);
 extern void e3d_destroy();
 extern void e3d_etest();
 
+/*
+ * GL state cache
+ * e3d_init() replaces the state setting functions of the E3D table (programs,
+ * buffer and vertex array bindings, attribute arrays, capabilities, polygon
+ * mode, depth function, cull face and line width) with wrappers that drop
+ * calls which would not change the current GL state. This only works if all
+ * state changes go through the E3D table, so call e3d_state_reset() after
+ * changing state directly or switching contexts.
+ * \issued and \elided count the calls of these functions that were forwarded
+ * to GL and that were dropped since the last e3d_state_stats_reset().
+ */
+
+struct e3d_state_stats {
+	size_t issued;
+	size_t elided;
+};
+
+extern struct e3d_state_stats e3d_state_stats;
+
+extern void e3d_state_init();
+extern void e3d_state_reset();
+extern void e3d_state_stats_reset();
+
 /*
  * OpenGL context and window creation
  * This provides access to window creation, event polling and frame creation.
@@ -224,6 +280,10 @@ extern bool e3d_window_get_key(const struct e3d_window *wnd, unsigned int key);
  * Shader loader
  * This loads special AirHockey shaders and hides the shader compilation/linking
  * behind this API.
+ * The instanced variants read the model matrix and a color of each instance
+ * from per-instance attributes, see e3d_primitive_draw_instanced(). They use
+ * the projection and eye matrix \pe_mat instead of \mpe_mat. Attribute ids are
+ * also used as attribute locations and matrices need one location per column.
  */
 
 struct e3d_shader;
@@ -232,6 +292,9 @@ enum e3d_shader_attribute_ids {
 	E3D_A_VERTEX,
 	E3D_A_COLOR,
 	E3D_A_NORMAL,
+	E3D_A_INST_MAT,
+	E3D_A_INST_MAT_IT = E3D_A_INST_MAT + 4,
+	E3D_A_INST_COLOR = E3D_A_INST_MAT_IT + 4,
 	E3D_A_NUM
 };
 
@@ -239,14 +302,21 @@ enum e3d_shader_uniform_ids {
 	E3D_U_M_MAT,
 	E3D_U_M_MAT_IT,
 	E3D_U_MPE_MAT,
-	E3D_U_CAM_POS,
+	E3D_U_PE_MAT,
 
-	E3D_U_LIGHT0_ENABLED,
 	E3D_U_LIGHT0_COLOR,
+	E3D_U_LIGHT0_CAMERA,
 	E3D_U_LIGHT0_MAT,
-	E3D_U_LIGHT0_MAT_IT,
+	E3D_U_LIGHT0_M_MAT,
+	E3D_U_LIGHT0_M_MAT_IT,
 
 	E3D_U_COLOR,
+	E3D_U_TINT,
+
+	E3D_U_COLOR_MAP,
+	E3D_U_NORMAL_MAP,
+	E3D_U_DEPTH_MAP,
+	E3D_U_OUTLINE,
 
 	E3D_U_NUM
 };
@@ -258,11 +328,32 @@ struct e3d_shader_locations {
 
 enum e3d_shader_type {
 	E3D_SHADER_DEBUG,
-	E3D_SHADER_SIMPLE
+	E3D_SHADER_SIMPLE,
+	E3D_SHADER_DEBUG_INSTANCED,
+	E3D_SHADER_SIMPLE_INSTANCED,
+	E3D_SHADER_OUTLINE
+};
+
+/*
+ * The debug shaders are lit. They are compiled in variants for a fixed number
+ * of lights and a set of features, so a variant does not test at run time
+ * which lights and features are used. e3d_shader_new() returns the variant with
+ * one light and all features. The variant with the normal of each fragment
+ * in the second color buffer (E3D_SHADER_NORMALS) is needed for screen space
+ * outlines. Variants are freed with the shader. Only the uniforms of the first
+ * light are resolved and supplied, so a variant has at most one light.
+ */
+
+#define E3D_SHADER_LIGHTS 1
+
+enum e3d_shader_flags {
+	E3D_SHADER_NORMALS = 0x1,
 };
 
 extern int e3d_shader_new(struct e3d_shader **shader,
 						enum e3d_shader_type type);
+extern int e3d_shader_variant(struct e3d_shader *shader,
+	struct e3d_shader **out, size_t lights, unsigned int flags);
 extern void e3d_shader_free(struct e3d_shader *shader);
 
 extern const struct e3d_shader_locations *e3d_shader_locations(
@@ -291,6 +382,7 @@ enum e3d_vbo_hint {
 	E3D_VBO_DYNAMIC_DRAW = GL_DYNAMIC_DRAW,
 	E3D_VBO_DYNAMIC_READ = GL_DYNAMIC_READ,
 	E3D_VBO_DYNAMIC_COPY = GL_DYNAMIC_COPY,
+	E3D_VBO_STREAM_DRAW = GL_STREAM_DRAW,
 };
 
 extern int e3d_vbo_new(struct e3d_vbo **vbo, unsigned int ele_type,
@@ -298,15 +390,18 @@ extern int e3d_vbo_new(struct e3d_vbo **vbo, unsigned int ele_type,
 extern void e3d_vbo_ref(struct e3d_vbo *vbo);
 extern void e3d_vbo_unref(struct e3d_vbo *vbo);
 extern int e3d_vbo_grab(struct e3d_vbo *vbo, int hint);
+extern int e3d_vbo_grab_range(struct e3d_vbo *vbo, size_t num, int hint);
 extern void e3d_vbo_release(struct e3d_vbo *vbo);
 extern void e3d_vbo_bind(struct e3d_vbo *vbo, GLint attr, size_t off);
+extern void e3d_vbo_bind_packed(struct e3d_vbo *vbo, size_t id, GLint attr,
+								size_t off);
 extern void e3d_vbo_draw(struct e3d_vbo *vbo, GLuint type, size_t num,
 								size_t off);
 extern void e3d_vbo_debug(struct e3d_vbo *vbo);
 
 #define E3D_VBO_AT(vbo, idx) E3D_OFF((vbo)->data, \
 			e3d_tsize[(vbo)->ele_type] * (vbo)->ele_num * (idx))
-#define E3D_VBO_AT_IDX(vbo, idx) *((GLuint*)E3D_VBO_AT(vbo, idx))
+#define E3D_VBO_AT_IDX(vbo, idx) e3d_vbo_get_idx(vbo, idx)
 
 static inline bool e3d_vbo_is_v4(struct e3d_vbo *vbo)
 {
@@ -328,9 +423,17 @@ static inline int e3d_vbo_new_v3(struct e3d_vbo **vbo, size_t num)
 	return e3d_vbo_new(vbo, GL_FLOAT, 3, num);
 }
 
+/*
+ * Index buffers may use 8, 16 or 32 bit indices. e3d_idx_type() returns the
+ * narrowest type that can address \vnum vertices. Use e3d_vbo_get_idx() and
+ * e3d_vbo_set_idx() to access indices of any type.
+ */
+
 static inline bool e3d_vbo_is_idx(struct e3d_vbo *vbo)
 {
-	return vbo->ele_type == GL_UNSIGNED_INT && vbo->ele_num == 1;
+	return (vbo->ele_type == GL_UNSIGNED_INT ||
+		vbo->ele_type == GL_UNSIGNED_SHORT ||
+		vbo->ele_type == GL_UNSIGNED_BYTE) && vbo->ele_num == 1;
 }
 
 static inline int e3d_vbo_new_idx(struct e3d_vbo **vbo, size_t num)
@@ -338,6 +441,144 @@ static inline int e3d_vbo_new_idx(struct e3d_vbo **vbo, size_t num)
 	return e3d_vbo_new(vbo, GL_UNSIGNED_INT, 1, num);
 }
 
+static inline GLenum e3d_idx_type(size_t vnum)
+{
+	if (vnum <= 0x100)
+		return GL_UNSIGNED_BYTE;
+	else if (vnum <= 0x10000)
+		return GL_UNSIGNED_SHORT;
+	else
+		return GL_UNSIGNED_INT;
+}
+
+static inline int e3d_vbo_new_idx_type(struct e3d_vbo **vbo, GLenum type,
+								size_t num)
+{
+	return e3d_vbo_new(vbo, type, 1, num);
+}
+
+static inline size_t e3d_vbo_get_idx(struct e3d_vbo *vbo, size_t idx)
+{
+	switch (vbo->ele_type) {
+		case GL_UNSIGNED_BYTE:
+			return *(GLubyte*)E3D_VBO_AT(vbo, idx);
+		case GL_UNSIGNED_SHORT:
+			return *(GLushort*)E3D_VBO_AT(vbo, idx);
+		default:
+			return *(GLuint*)E3D_VBO_AT(vbo, idx);
+	}
+}
+
+static inline void e3d_vbo_set_idx(struct e3d_vbo *vbo, size_t idx, size_t v)
+{
+	switch (vbo->ele_type) {
+		case GL_UNSIGNED_BYTE:
+			*(GLubyte*)E3D_VBO_AT(vbo, idx) = v;
+			break;
+		case GL_UNSIGNED_SHORT:
+			*(GLushort*)E3D_VBO_AT(vbo, idx) = v;
+			break;
+		default:
+			*(GLuint*)E3D_VBO_AT(vbo, idx) = v;
+			break;
+	}
+}
+
+/*
+ * Packed vertices
+ * Instead of separate float buffers for vertices, colors and normals, a buffer
+ * can contain interleaved packed vertices. Positions are stored as three
+ * floats (w is always 1), colors as normalized RGBA8 and normals as signed
+ * normalized 10:10:10:2 values (w is always 0). This needs 20 bytes per vertex
+ * instead of 48. Such buffers consist of unsigned bytes with one element per
+ * vertex. Packed normals need GL 3.3 or ARB_vertex_type_2_10_10_10_rev.
+ */
+
+struct e3d_vertex {
+	GLfloat position[3];
+	GLubyte color[4];
+	GLuint normal;
+};
+
+extern void e3d_vertex_pack(struct e3d_vertex *v, const float *position,
+				const float *color, const float *normal);
+extern void e3d_vertex_unpack(const struct e3d_vertex *v, float *position,
+						float *color, float *normal);
+
+static inline bool e3d_vbo_is_packed(struct e3d_vbo *vbo)
+{
+	return vbo->ele_type == GL_UNSIGNED_BYTE &&
+				vbo->ele_num == sizeof(struct e3d_vertex);
+}
+
+static inline int e3d_vbo_new_packed(struct e3d_vbo **vbo, size_t num)
+{
+	return e3d_vbo_new(vbo, GL_UNSIGNED_BYTE, sizeof(struct e3d_vertex),
+									num);
+}
+
+/*
+ * Instances
+ * A primitive can be drawn many times with a single draw call. Each instance
+ * has its own model matrix which is applied after the current modelview
+ * matrix, that is, it transforms the shape into world space. The color of an
+ * instance is multiplied with the vertex colors. Instance buffers consist of
+ * floats with one element per instance. Use e3d_instance_set() to fill in an
+ * instance as it also computes the matrix for the normals. Instancing needs
+ * GL 3.3 or ARB_instanced_arrays and ARB_draw_instanced.
+ */
+
+struct e3d_instance {
+	math_m4 model;
+	math_m4 model_it;
+	math_v4 color;
+};
+
+extern void e3d_instance_set(struct e3d_instance *inst, math_m4 model,
+							const math_v4 color);
+
+static inline bool e3d_vbo_is_instances(struct e3d_vbo *vbo)
+{
+	return vbo->ele_type == GL_FLOAT &&
+		vbo->ele_num == sizeof(struct e3d_instance) / sizeof(GLfloat);
+}
+
+static inline int e3d_vbo_new_instances(struct e3d_vbo **vbo, size_t num)
+{
+	return e3d_vbo_new(vbo, GL_FLOAT,
+			sizeof(struct e3d_instance) / sizeof(GLfloat), num);
+}
+
+/*
+ * Bounding volumes and culling
+ * Every primitive, shape and world object keeps a bounding box and a bounding
+ * sphere in its local coordinate system. These are merged up the trees so
+ * whole subtrees can be skipped if they are outside of the view frustum.
+ * An empty bounding volume is never culled.
+ * The frustum is extracted from the combined projection and eye matrix and
+ * therefore its planes are in world space.
+ */
+
+struct e3d_bounds {
+	bool empty;
+	math_v3 min;
+	math_v3 max;
+	math_v3 center;
+	float radius;
+};
+
+struct e3d_frustum {
+	math_v4 planes[6];
+};
+
+extern void e3d_bounds_clear(struct e3d_bounds *bounds);
+extern void e3d_bounds_merge(struct e3d_bounds *dest,
+				const struct e3d_bounds *src, math_m4 m);
+
+extern void e3d_frustum_extract(struct e3d_frustum *frustum, math_m4 m);
+extern bool e3d_frustum_test(const struct e3d_frustum *frustum,
+				const struct e3d_bounds *bounds, math_m4 m);
+
 /*
  * Primitives
  * Primitives can be drawn with one call and thus are very fast. Every other
@@ -351,17 +592,73 @@ static inline int e3d_vbo_new_idx(struct e3d_vbo **vbo, size_t num)
  *	mod: Transforms into world space
  *	proj: Transforms into projection space
  *	eye: Transforms into eye space
+ * If culling is enabled, the transformation also carries the view frustum and
+ * counts the drawn primitives and culled subtrees since the last reset.
+ * e3d_transform_size() returns the radius of a bounding volume on the screen
+ * relative to half the viewport height. If \lod_size is positive, it is used
+ * instead of the computed size to select levels of detail of shapes.
+ * If \light is set, full draws combine the modelview matrix with the world to
+ * light matrices of \light for each object, see e3d_light_supply().
+ * If \color is set, full draws multiply the vertex colors with it.
  */
 
 struct e3d_transform {
 	struct math_stack mod_stack;
 	struct math_stack proj_stack;
 	struct math_stack eye_stack;
+
+	bool cull;
+	struct e3d_frustum frustum;
+	size_t drawn;
+	size_t culled;
+	float lod_size;
+	const struct e3d_light *light;
+	const float *color;
 };
 
 extern void e3d_transform_init(struct e3d_transform *transform);
 extern void e3d_transform_destroy(struct e3d_transform *transform);
 extern void e3d_transform_reset(struct e3d_transform *transform);
+extern void e3d_transform_cull(struct e3d_transform *transform);
+extern float e3d_transform_size(struct e3d_transform *transform,
+					const struct e3d_bounds *bounds);
+
+static inline bool e3d_transform_visible(struct e3d_transform *transform,
+					const struct e3d_bounds *bounds)
+{
+	if (!transform->cull || e3d_frustum_test(&transform->frustum, bounds,
+					MATH_TIP(&transform->mod_stack)))
+		return true;
+
+	++transform->culled;
+	return false;
+}
+
+/*
+ * Vertex array objects of a primitive are cached per attribute layout, that is,
+ * the attribute locations that are used by the drawer and shader. A primitive
+ * is normally drawn with only a few different layouts so a small fixed cache
+ * is used. If it is full, the attributes are set up on every draw call.
+ * Vertex array objects are not shared between GL contexts so primitives must
+ * only be drawn in the context they were first drawn in.
+ */
+#define E3D_PRIMITIVE_VAOS 4
+
+struct e3d_vao {
+	GLint layout[E3D_A_NUM];
+	GLuint id;
+};
+
+/*
+ * Edges of a primitive with the planes of their adjacent triangles, see
+ * e3d_primitive_build_edges(). Both planes are equal for boundary edges.
+ */
+struct e3d_edge {
+	math_v3 a;
+	math_v3 b;
+	math_v4 planes[2];
+	bool boundary;
+};
 
 struct e3d_primitive {
 	size_t ref;
@@ -376,6 +673,19 @@ struct e3d_primitive {
 	struct e3d_vbo *normal;
 	size_t ioff;
 	struct e3d_vbo *index;
+	size_t poff;
+	struct e3d_vbo *packed;
+
+	struct e3d_bounds bounds;
+
+	size_t vao_num;
+	struct e3d_vao vaos[E3D_PRIMITIVE_VAOS];
+
+	size_t edge_num;
+	struct e3d_edge *edges;
+
+	/* lines of the normals drawer, rebuilt after buffers are replaced */
+	struct e3d_vbo *normal_lines;
 };
 
 enum e3d_primitive_drawer {
@@ -384,6 +694,11 @@ enum e3d_primitive_drawer {
 	E3D_DRAW_NORMALS,
 };
 
+enum e3d_normals_flags {
+	E3D_NORMALS_SMOOTH = 0x01,
+	E3D_NORMALS_APPROX = 0x02,
+};
+
 extern int e3d_primitive_new(struct e3d_primitive **prim);
 extern int e3d_primitive_new_idx(struct e3d_primitive **prim, size_t n);
 extern void e3d_primitive_ref(struct e3d_primitive *prim);
@@ -396,9 +711,21 @@ extern void e3d_primitive_set_normal(struct e3d_primitive *prim, size_t off,
 							struct e3d_vbo *vbo);
 extern void e3d_primitive_set_index(struct e3d_primitive *prim, size_t off,
 							struct e3d_vbo *vbo);
+extern void e3d_primitive_set_packed(struct e3d_primitive *prim, size_t off,
+							struct e3d_vbo *vbo);
+extern int e3d_primitive_pack(struct e3d_primitive *prim);
+extern int e3d_primitive_weld(struct e3d_primitive *prim);
+extern int e3d_primitive_optimize(struct e3d_primitive *prim);
+extern int e3d_primitive_build_edges(struct e3d_primitive *prim);
 extern void e3d_primitive_draw(struct e3d_primitive *prim, int how,
 	const struct e3d_shader_locations *loc, struct e3d_transform *trans);
-extern int e3d_primitive_generate_normals(struct e3d_primitive *prim);
+extern void e3d_primitive_draw_instanced(struct e3d_primitive *prim, int how,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans,
+				struct e3d_vbo *inst, size_t first, size_t num);
+extern int e3d_primitive_generate_normals(struct e3d_primitive *prim,
+							unsigned int flags);
+extern void e3d_primitive_update_bounds(struct e3d_primitive *prim);
+extern int e3d_primitive_grab(struct e3d_primitive *prim, int hint);
 extern void e3d_primitive_debug(struct e3d_primitive *prim);
 
 /*
@@ -413,15 +740,37 @@ extern void e3d_primitive_debug(struct e3d_primitive *prim);
  * used multiple times in one scene for the same object.
  * Also rendering order of shapes is random, so a shape should always be a small
  * entity which is considered one static and rigid object.
+ * The bounding volume of a shape covers its primitive and all childs but not
+ * its own \alter transformation. It is not updated automatically, so call
+ * e3d_shape_update_bounds() after modifying a shape tree. This also rebuilds
+ * the \alter matrices, which drawing only reads.
+ *
+ * Level of detail
+ * A shape can have a chain of coarser variants in \lod. Each level is used
+ * while the projected size of the shape (see e3d_transform_size()) is at least
+ * its \lod_min, the last level is used for all smaller sizes. Shapes are
+ * shared between objects, so they keep no state. Instead, each object keeps
+ * the size that selected its levels and passes it as \lod_size of the
+ * transformation. e3d_lod_hysteresis() only replaces that size if the
+ * projected size of the object differs by more than E3D_LOD_HYSTERESIS from it
+ * so objects do not flip between two levels. Shapes that are shared by many
+ * objects should be drawn with a common size, for instance, the size of the
+ * nearest object.
  */
 
+#define E3D_LOD_HYSTERESIS 0.2f
+
 struct e3d_shape {
 	size_t ref;
 	struct e3d_shape *next;
 	struct e3d_shape *childs;
 
-	math_m4 alter;
+	struct math_trs alter;
 	struct e3d_primitive *prim;
+	struct e3d_bounds bounds;
+
+	struct e3d_shape *lod;
+	float lod_min;
 };
 
 extern int e3d_shape_new(struct e3d_shape **shape);
@@ -431,10 +780,197 @@ extern void e3d_shape_unref(struct e3d_shape *shape);
 extern void e3d_shape_link(struct e3d_shape *parent, struct e3d_shape *shape);
 extern void e3d_shape_set_primitive(struct e3d_shape *shape,
 						struct e3d_primitive *prim);
+extern void e3d_shape_add_lod(struct e3d_shape *shape, struct e3d_shape *lod,
+								float min);
+extern const struct e3d_shape *e3d_shape_lod(const struct e3d_shape *shape,
+						struct e3d_transform *trans);
+extern float e3d_lod_hysteresis(float *last, float size);
+extern void e3d_shape_update_bounds(struct e3d_shape *shape);
+extern int e3d_shape_grab(struct e3d_shape *shape, int hint);
+extern int e3d_shape_pack(struct e3d_shape *shape);
+extern int e3d_shape_optimize(struct e3d_shape *shape);
+extern int e3d_shape_build_edges(struct e3d_shape *shape);
 extern void e3d_shape_draw(const struct e3d_shape *shape, int drawer,
 	const struct e3d_shader_locations *loc, struct e3d_transform *trans);
+extern void e3d_shape_draw_instanced(const struct e3d_shape *shape,
+	int drawer, const struct e3d_shader_locations *loc,
+	struct e3d_transform *trans, struct e3d_vbo *inst, size_t first,
+								size_t num);
 extern void e3d_shape_debug(struct e3d_shape *shape);
 
+/*
+ * Static batches
+ * A batch merges many primitives that never move into a single pre-transformed
+ * primitive so they can be drawn with one draw call. All vertices are
+ * transformed into a common coordinate system while shapes are added, hence,
+ * the batch must be rebuilt if any of them moves.
+ * Only triangle primitives (lists, strips and fans) can be batched. They are
+ * converted into one indexed triangle list with packed vertices.
+ */
+
+struct e3d_batch {
+	struct e3d_vertex *vertex;
+	size_t vnum;
+	size_t vsize;
+	GLuint *index;
+	size_t inum;
+	size_t isize;
+};
+
+extern void e3d_batch_init(struct e3d_batch *batch);
+extern void e3d_batch_destroy(struct e3d_batch *batch);
+extern bool e3d_batch_can_add(const struct e3d_shape *shape);
+extern int e3d_batch_add_shape(struct e3d_batch *batch,
+		struct e3d_shape *shape, math_m4 m, const math_v4 color);
+extern int e3d_batch_build(struct e3d_batch *batch,
+					struct e3d_primitive **prim);
+
+/*
+ * Render queues
+ * A render queue is a flat list of primitives together with their final
+ * modelview matrices and the \color of the transformation they were added
+ * with. It is built once per frame by traversing and culling the
+ * scene and is then sorted and drawn by every pass without traversing the
+ * scene again. Items are sorted by their buffers first and then front to back.
+ * The queue does not take references, so the primitives must not be freed
+ * before the queue is reset.
+ */
+
+struct e3d_draw_item {
+	uint64_t key;
+	struct e3d_primitive *prim;
+	math_m4 matrix;
+	math_v4 color;
+};
+
+struct e3d_queue {
+	struct e3d_draw_item *items;
+	size_t num;
+	size_t size;
+};
+
+extern void e3d_queue_init(struct e3d_queue *queue);
+extern void e3d_queue_destroy(struct e3d_queue *queue);
+extern void e3d_queue_reset(struct e3d_queue *queue);
+extern int e3d_queue_add(struct e3d_queue *queue, struct e3d_primitive *prim,
+				math_m4 m, struct e3d_transform *trans);
+extern int e3d_queue_add_shape(struct e3d_queue *queue,
+		const struct e3d_shape *shape, struct e3d_transform *trans);
+extern void e3d_queue_sort(struct e3d_queue *queue);
+extern void e3d_queue_draw(struct e3d_queue *queue, int how,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans);
+
+/*
+ * Silhouettes
+ * Instead of drawing the whole scene a second time as wireframe, outlines can
+ * be drawn from the silhouette edges only. The edge adjacency of each primitive
+ * is computed once with e3d_primitive_build_edges(). Every frame, the
+ * silhouette edges of all visible primitives are collected in world space and
+ * drawn as one batch of one pixel wide lines.
+ * Collecting still visits every edge of every visible primitive. The edges of
+ * one large static primitive, like a static batch, can be added with
+ * e3d_silhouette_add_cached() instead. They are kept at the start of the
+ * buffer and only collected again if the eye or the matrix of the primitive
+ * changes. Call e3d_silhouette_invalidate() if the primitive is modified.
+ */
+
+struct e3d_silhouette {
+	struct e3d_vbo *vbo;
+	size_t num;
+
+	bool cached;
+	size_t cache_num;
+	const struct e3d_primitive *cache_prim;
+	math_m4 cache_m;
+	math_v3 cache_eye;
+};
+
+extern void e3d_silhouette_init(struct e3d_silhouette *sil);
+extern void e3d_silhouette_destroy(struct e3d_silhouette *sil);
+extern void e3d_silhouette_reset(struct e3d_silhouette *sil);
+extern void e3d_silhouette_invalidate(struct e3d_silhouette *sil);
+extern int e3d_silhouette_add(struct e3d_silhouette *sil,
+		struct e3d_primitive *prim, math_m4 m, const math_v3 eye);
+extern int e3d_silhouette_add_cached(struct e3d_silhouette *sil,
+		struct e3d_primitive *prim, math_m4 m, const math_v3 eye);
+extern int e3d_silhouette_add_shape(struct e3d_silhouette *sil,
+			const struct e3d_shape *shape,
+			struct e3d_transform *trans, const math_v3 eye);
+extern void e3d_silhouette_draw(struct e3d_silhouette *sil,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans);
+
+/*
+ * Screen space outlines
+ * Between e3d_outline_begin() and e3d_outline_end() the scene is drawn into an
+ * offscreen framebuffer with color, normal and depth textures. The debug
+ * shader writes the world space normal into the second color buffer.
+ * e3d_outline_end() draws a single full-screen quad with the outline shader
+ * that detects edges in the depth and normal textures, writes black outlines
+ * over the scene color and copies the depth into the window framebuffer, so the
+ * cost of the outlines depends only on the number of pixels.
+ * The textures follow the size of the current viewport.
+ */
+
+struct e3d_outline {
+	GLuint fbo;
+	GLuint color;
+	GLuint normal;
+	GLuint depth;
+	GLint width;
+	GLint height;
+};
+
+extern void e3d_outline_init(struct e3d_outline *outline);
+extern void e3d_outline_destroy(struct e3d_outline *outline);
+extern int e3d_outline_begin(struct e3d_outline *outline);
+extern void e3d_outline_end(struct e3d_outline *outline,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans);
+
+/*
+ * Frame capture
+ * A capture records the window framebuffer into a YUV4MPEG2 (".y4m") or PPM
+ * stream at a fixed rate. Frames are read back asynchronously through pixel
+ * buffer objects and written by a separate thread, so the render loop does not
+ * wait for the GPU or the disk. Frames are dropped if the writer falls behind.
+ */
+
+struct e3d_capture;
+
+extern int e3d_capture_new(struct e3d_capture **capture, const char *path,
+							unsigned int fps);
+extern void e3d_capture_free(struct e3d_capture *capture);
+extern void e3d_capture_frame(struct e3d_capture *capture);
+
+/*
+ * GPU timers
+ * A timer measures the GPU time of the GL commands between e3d_timer_begin()
+ * and e3d_timer_end() with GL_TIME_ELAPSED queries. The results are collected
+ * a few frames later and only if they are available, so the CPU never waits
+ * for the GPU. e3d_timer_ms() returns the average time in milliseconds of the
+ * results that were collected since the last e3d_timer_reset(). \skipped counts
+ * the measurements that were dropped because all queries were still pending.
+ */
+
+#define E3D_TIMER_QUERIES 4
+
+struct e3d_timer {
+	GLuint query[E3D_TIMER_QUERIES];
+	bool pending[E3D_TIMER_QUERIES];
+	size_t cur;
+	bool running;
+
+	uint64_t ns;
+	size_t samples;
+	size_t skipped;
+};
+
+extern void e3d_timer_init(struct e3d_timer *timer);
+extern void e3d_timer_destroy(struct e3d_timer *timer);
+extern void e3d_timer_begin(struct e3d_timer *timer);
+extern void e3d_timer_end(struct e3d_timer *timer);
+extern void e3d_timer_reset(struct e3d_timer *timer);
+extern float e3d_timer_ms(const struct e3d_timer *timer);
+
 /*
  * Eye position
  * The eye position allows to move the whole geometry and position the viewer
@@ -442,9 +978,9 @@ extern void e3d_shape_debug(struct e3d_shape *shape);
  * but to have a more structured API, a separate object is used.
  * This also allows to have the world class only operate in world space and not
  * be confused by eye space.
- * For fast rotations and conversions we keep a transformation matrix with all
- * transformations applied and a separate position and rotation variable.
- * We could get both out of the matrix, but this conversion is expensive.
+ * For fast rotations and conversions we keep the look-at matrix, a separate
+ * position and the accumulated rotation. Rotations are only applied to the
+ * quaternion and the rotation matrix is rebuilt lazily when the eye is applied.
  * Furthermore, there is probably only one eye in the whole application so we
  * do not care for memory consumption here.
  */
@@ -452,6 +988,7 @@ extern void e3d_shape_debug(struct e3d_shape *shape);
 struct e3d_eye {
 	math_v4 position;
 	math_m4 matrix;
+	struct math_trs rotation;
 };
 
 extern void e3d_eye_init(struct e3d_eye *eye);
@@ -460,18 +997,20 @@ extern void e3d_eye_reset(struct e3d_eye *eye);
 extern void e3d_eye_rotate(struct e3d_eye *eye, float angle, math_v3 axis);
 extern void e3d_eye_look_at(struct e3d_eye *eye, math_v3 pos, math_v3 at,
 								math_v3 up);
-extern void e3d_eye_apply(const struct e3d_eye *eye, math_m4 m);
-extern void e3d_eye_supply(const struct e3d_eye *eye,
-					const struct e3d_shader_locations *loc);
+extern void e3d_eye_apply(struct e3d_eye *eye, math_m4 m);
 
 /*
  * Lights
  * Each world can contain several lights. The number of positioned lights is
  * limited and most special lights exist only once in a scene.
+ * e3d_light_supply() sets the uniforms of a light that are the same for all
+ * objects. This includes the camera position of \eye in light coordinates.
+ * The object to light matrices are set when drawing, see e3d_transform.
  */
 
 struct e3d_light {
 	math_m4 matrix;
+	math_m4 matrix_it;
 };
 
 extern void e3d_light_init(struct e3d_light *light);
@@ -483,6 +1022,6 @@ static inline void e3d_light_destroy(struct e3d_light *light)
 extern void e3d_light_look_at(struct e3d_light *light, math_v3 pos, math_v3 at,
 								math_v3 up);
 extern void e3d_light_supply(const struct e3d_light *light, size_t num,
-					const struct e3d_shader_locations *loc);
+	const struct e3d_eye *eye, const struct e3d_shader_locations *loc);
 
 #endif /* E3D_ENGINE3D_H */
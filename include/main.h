@@ -32,10 +32,14 @@ extern int config_load_v34(const struct uconf_entry *e, math_v4 out, float d4);
 
 extern int config_load_shape(struct e3d_shape **shape,
 						const struct uconf_entry *e);
+extern void config_flush_meshes();
 
 struct shaders {
 	struct e3d_shader *debug;
 	struct e3d_shader *simple;
+	struct e3d_shader *debug_inst;
+	struct e3d_shader *simple_inst;
+	struct e3d_shader *outline;
 };
 
 extern int game_run(struct ulog_dev *log, struct e3d_window *wnd,
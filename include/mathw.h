@@ -10,7 +10,9 @@
 extern "C" {
 #endif
 
+#include <assert.h>
 #include <math.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 #include "log.h"
@@ -22,6 +24,7 @@ typedef float math_m4[4][4];
 
 extern void math_init(struct ulog_dev *log);
 extern void math_destroy();
+extern const char *math_backend();
 
 extern void math_v3_copy(math_v3 dest, math_v3 src);
 extern void math_v3_normalize(math_v3 v);
@@ -49,33 +52,89 @@ extern void math_m4_mult(math_m4 dest, math_m4 src);
 extern void math_m4_invert_dest(math_m4 dest, math_m4 src);
 extern void math_m4_invert(math_m4 m);
 
+/*
+ * Transformations
+ * A transformation consists of a position, a rotation and a scale factor. They
+ * are applied in the order scale, rotation and translation. The matrix is only
+ * rebuilt when it is requested and one of the components has changed since the
+ * last rebuild, so objects that do not move never touch their matrix.
+ * Read-only users can use math_trs_matrix_const() instead. It never rebuilds
+ * the matrix, so whoever modifies the transformation must call
+ * math_trs_update() afterwards.
+ * Composition and inversion are done on the components and are exact as long
+ * as the scale is uniform.
+ */
+
+struct math_trs {
+	math_v3 position;
+	math_q4 rotation;
+	math_v3 scale;
+
+	bool dirty;
+	math_m4 matrix;
+};
+
+extern void math_trs_identity(struct math_trs *trs);
+extern void math_trs_set_position(struct math_trs *trs, math_v3 v);
+extern void math_trs_translatev(struct math_trs *trs, math_v3 v);
+extern void math_trs_set_rotation(struct math_trs *trs, math_q4 q);
+extern void math_trs_rotate(struct math_trs *trs, float angle, math_v3 axis);
+extern void math_trs_set_scale(struct math_trs *trs, math_v3 v);
+extern void math_trs_compose_dest(struct math_trs *dest, struct math_trs *a,
+							struct math_trs *b);
+extern void math_trs_invert_dest(struct math_trs *dest, struct math_trs *src);
+extern void math_trs_update(struct math_trs *trs);
+
+static inline void *math_trs_matrix(struct math_trs *trs)
+{
+	if (trs->dirty)
+		math_trs_update(trs);
+	return trs->matrix;
+}
+
+static inline void *math_trs_matrix_const(const struct math_trs *trs)
+{
+	assert(!trs->dirty);
+	return (void*)trs->matrix;
+}
+
 /*
  * Matrix stack
  * The stack is limited to 4 dimensional matrices. It allows to push matrices at
  * the stack, modify them and pop them again.
+ * All entries are kept in one preallocated array so pushing and popping never
+ * allocates memory. The tip is always the entry at \pos. \max tracks the
+ * deepest level that was ever reached, which is useful to tune the capacity.
+ * At most MATH_STACK_SIZE - 1 entries can be pushed on top of the root. If the
+ * stack is full, math_stack_push() and math_stack_push_mult() return -ENOMEM
+ * and leave the stack unchanged, so the caller must not pop in that case.
  */
 
-struct math_entry {
-	struct math_entry *next;
-	math_m4 matrix;
-};
+#define MATH_STACK_SIZE 32
 
 struct math_stack {
-	struct math_entry stack;
-	struct math_entry *cache;
+	size_t pos;
+	size_t max;
+	math_m4 stack[MATH_STACK_SIZE];
 };
 
-#define MATH_TIP(mstack) ((mstack)->stack.matrix)
+#define MATH_TIP(mstack) ((mstack)->stack[(mstack)->pos])
 
 extern void math_stack_init(struct math_stack *stack);
 extern void math_stack_destroy(struct math_stack *stack);
 
 static inline bool math_stack_is_root(struct math_stack *stack)
 {
-	return !stack->stack.next;
+	return !stack->pos;
+}
+
+static inline size_t math_stack_max_depth(struct math_stack *stack)
+{
+	return stack->max;
 }
 
 extern int math_stack_push(struct math_stack *stack);
+extern int math_stack_push_mult(struct math_stack *stack, math_m4 m);
 extern void math_stack_pop(struct math_stack *stack);
 
 #ifdef __cplusplus
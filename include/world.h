@@ -13,6 +13,8 @@
 #include "mathw.h"
 #include "physics.h"
 
+struct world_group;
+
 struct world_obj {
 	size_t ref;
 	struct world *world;
@@ -22,9 +24,74 @@ struct world_obj {
 	struct world_obj *next;
 	struct world_obj *prev;
 
-	math_m4 alter;
+	struct math_trs alter;
 	struct phys_body *body;
 	struct e3d_shape *shape;
+
+	/*
+	 * Static objects never move. Their shapes are merged into the static
+	 * batch of the world when they are linked into it. \batched is set if
+	 * the shape is drawn as part of the batch.
+	 */
+	bool is_static;
+	bool batched;
+
+	/*
+	 * Objects that share their shape with other objects are drawn
+	 * instanced. \group is the instance group of the object or NULL.
+	 * \color tints the vertex colors of the object on every draw path,
+	 * set it with world_obj_set_color().
+	 */
+	struct world_group *group;
+	math_v4 color;
+
+	/* size that selects the levels of detail, see e3d_lod_hysteresis() */
+	float lod_size;
+
+	/* updated once per frame before drawing */
+	math_m4 matrix;
+	struct e3d_bounds bounds;
+};
+
+/*
+ * All visible objects of a group are drawn with one instanced draw call per
+ * primitive. The instances of a group are stored in the instance buffer of
+ * the world starting at \first. \size is the number of objects in the group
+ * and \num the number of visible objects of the current frame. All instances
+ * use the level of detail of the largest projected size \lod_size of the
+ * current frame after the hysteresis against \lod_last is applied.
+ */
+struct world_group {
+	struct e3d_shape *shape;
+	size_t first;
+	size_t size;
+	size_t num;
+	float lod_size;
+	float lod_last;
+};
+
+/*
+ * Outline modes of the silhouette pass. WORLD_OUTLINE_WIREFRAME draws all
+ * objects again as thick back face lines. WORLD_OUTLINE_EDGES draws only the
+ * silhouette edges that are collected while building the render queue.
+ * WORLD_OUTLINE_SCREEN draws the scene offscreen and detects the outlines in
+ * a full-screen pass instead of a silhouette pass.
+ */
+enum world_outline {
+	WORLD_OUTLINE_WIREFRAME,
+	WORLD_OUTLINE_EDGES,
+	WORLD_OUTLINE_SCREEN,
+};
+
+/*
+ * Passes of world_draw() that are timed on the GPU. The silhouette pass also
+ * covers the full-screen pass of screen space outlines.
+ */
+enum world_pass {
+	WORLD_PASS_FULL,
+	WORLD_PASS_SILHOUETTE,
+	WORLD_PASS_NORMALS,
+	WORLD_PASS_NUM
 };
 
 struct world {
@@ -33,11 +100,35 @@ struct world {
 
 	struct e3d_light light0;
 	struct e3d_eye eye;
+
+	/* rebuilt before drawing if static objects were added or removed */
+	bool batch_dirty;
+	struct e3d_primitive *batch;
+
+	/* rebuilt before drawing if objects were added, removed or changed */
+	bool groups_dirty;
+	struct world_group *groups;
+	size_t group_num;
+	struct e3d_vbo *instances;
+
+	/* built once per frame and drawn by all passes */
+	struct e3d_queue queue;
+
+	/* one of enum world_outline; edges are collected with the queue */
+	int outline;
+	struct e3d_silhouette silhouette;
+	struct e3d_outline screen;
+
+	/* GPU time of each enum world_pass */
+	struct e3d_timer timers[WORLD_PASS_NUM];
 };
 
 extern int world_obj_new(struct world_obj **obj);
 extern struct world_obj *world_obj_ref(struct world_obj *obj);
 extern void world_obj_unref(struct world_obj *obj);
+extern void world_obj_set_color(struct world_obj *obj, math_v4 color);
+extern void world_obj_set_shape(struct world_obj *obj,
+						struct e3d_shape *shape);
 
 extern void world_obj_unlink(struct world_obj *obj);
 extern void world_obj_link(struct world_obj *prev, struct world_obj *obj);
@@ -49,6 +140,11 @@ extern void world_free(struct world *world);
 extern void world_draw(struct world *world, struct e3d_transform *trans,
 						struct shaders *shaders);
 
+static inline float world_pass_ms(const struct world *world, int pass)
+{
+	return e3d_timer_ms(&world->timers[pass]);
+}
+
 static inline int world_step_phys(struct world *world, int64_t step)
 {
 	return phys_world_step(world->phys, step);
@@ -2,19 +2,29 @@
 
 /*
  * Shader constants
- * \light_num is the number of lights that are supported. A light is set with a
- * "struct light" datatype. If \light->enabled is false, then the light is
- * skipped in computation.
+ * \light_num is the number of lights. The engine compiles a variant of this
+ * shader for each number of lights by defining E3D_LIGHT_NUM so every light is
+ * used and the loops have a constant trip count. A light is set with a
+ * "struct light" datatype.
+ * E3D_NORMALS is defined by variants that also write the world space normal
+ * for screen space outlines.
  */
 
-const int light_num = 2;
+#ifndef E3D_LIGHT_NUM
+#define E3D_LIGHT_NUM 1
+#endif
+
+const int light_num = E3D_LIGHT_NUM;
 
 struct light {
-	bool enabled;			// light enabled
 	vec3 color;			// light color
+	vec3 camera;			// camera position in light coordinates
 
+	mat4 m_mat;			// object to light coordinate matrix
+	mat4 m_mat_it;			// same but inverse transpose
+#ifdef E3D_INSTANCED
 	mat4 mat;			// world to light coordinate matrix
-	mat4 mat_it;			// same but inverse transpose
+#endif
 };
 
 /*
@@ -27,10 +37,12 @@ uniform light lights[light_num];
 // vertex processing lighting results
 varying vec3 position_l[light_num];	// position in light coordinates
 varying vec3 normal_l[light_num];	// surface normal in light coordinates
-varying vec3 camera_l[light_num];	// camera position in light coordinates
 
 // miscellaneous parameters
 varying vec4 color;		// color of vertex
+#ifdef E3D_NORMALS
+varying vec3 normal_w;		// surface normal in world space
+#endif
 
 /*
  * Super ellipse computation for lighting parameters
@@ -64,7 +76,7 @@ vec3 compute_light_single(int lnum)
 {
 	vec3 N = -normalize(normal_l[lnum]);
 	vec3 L = normalize(position_l[lnum]);
-	vec3 V = normalize(camera_l[lnum] - position_l[lnum]);
+	vec3 V = normalize(lights[lnum].camera - position_l[lnum]);
 	vec3 H = normalize(L + V);
 
 	float NdotL = max(dot(N, L), 0.0);
@@ -93,17 +105,21 @@ vec3 compute_lights(void)
 	int i;
 	vec3 final = vec3(color) * 0.1;
 
-	for (i = 0; i < light_num; ++i) {
-		if (lights[i].enabled) {
-			final += compute_light_single(i);
-		}
-	}
+	for (i = 0; i < light_num; ++i)
+		final += compute_light_single(i);
 
 	return final;
 }
 
+/*
+ * The second color buffer is only bound while drawing for screen space
+ * outlines. It receives the normal scaled into the range of a color.
+ */
 void main(void)
 {
-	gl_FragColor = vec4(compute_lights(), 1.0);
+	gl_FragData[0] = vec4(compute_lights(), 1.0);
+#ifdef E3D_NORMALS
+	gl_FragData[1] = vec4(normalize(normal_w) * 0.5 + 0.5, 1.0);
+#endif
 }
 
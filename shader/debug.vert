@@ -2,19 +2,33 @@
 
 /*
  * Shader constants
- * \light_num is the number of lights that are supported. A light is set with a
- * "struct light" datatype. If \light->enabled is false, then the light is
- * skipped in computation.
+ * \light_num is the number of lights. The engine compiles a variant of this
+ * shader for each number of lights by defining E3D_LIGHT_NUM so every light is
+ * used and the loops have a constant trip count. A light is set with a
+ * "struct light" datatype.
+ * E3D_NORMALS is defined by variants that also write the world space normal
+ * for screen space outlines.
+ * Everything that depends only on uniforms is computed by the engine once per
+ * object. The object to light matrices combine the modelview matrix with the
+ * world to light matrix. Instances apply their model matrix after the modelview
+ * matrix so their positions still need the world to light matrix.
  */
 
-const int light_num = 2;
+#ifndef E3D_LIGHT_NUM
+#define E3D_LIGHT_NUM 1
+#endif
+
+const int light_num = E3D_LIGHT_NUM;
 
 struct light {
-	bool enabled;			// light enabled
 	vec3 color;			// light color
+	vec3 camera;			// camera position in light coordinates
 
+	mat4 m_mat;			// object to light coordinate matrix
+	mat4 m_mat_it;			// same but inverse transpose
+#ifdef E3D_INSTANCED
 	mat4 mat;			// world to light coordinate matrix
-	mat4 mat_it;			// same but inverse transpose
+#endif
 };
 
 /*
@@ -31,21 +45,37 @@ uniform mat4 m_mat;			// modelview matrix
 uniform mat4 m_mat_it;			// modelview matrix inverse transpose
 uniform mat4 mpe_mat;			// modelview, projection and eye matrix
 
-// miscellaneous incoming parameters
-uniform vec4 cam_pos;			// position of camera
-
 // position, color and normal of incoming vertex
 attribute vec4 position_in;
 attribute vec4 color_in;
 attribute vec4 normal_in;
 
+/*
+ * Instancing
+ * The model matrix and color of each instance are read from per-instance
+ * attributes. The instance matrix is applied after \m_mat so \mpe_mat cannot
+ * be used and \pe_mat is used instead. Objects that are drawn one by one get
+ * their color as \tint instead.
+ */
+#ifdef E3D_INSTANCED
+uniform mat4 pe_mat;			// projection and eye matrix
+
+attribute mat4 inst_mat;		// model matrix of instance
+attribute mat4 inst_mat_it;		// same but inverse transpose
+attribute vec4 inst_color;		// color of instance
+#else
+uniform vec4 tint;			// color of object
+#endif
+
 // outgoing light paramaters
 varying vec3 position_l[light_num];	// position in light coordinates
 varying vec3 normal_l[light_num];	// surface normal in light coordinates
-varying vec3 camera_l[light_num];	// camera position in light coordinates
 
 // miscellaneous outgoing parameters
 varying vec4 color;			// color of vertex
+#ifdef E3D_NORMALS
+varying vec3 normal_w;			// surface normal in world space
+#endif
 
 /*
  * Read incoming light arguments and compute the light parameters for the
@@ -53,19 +83,29 @@ varying vec4 color;			// color of vertex
  */
 void compute_lights(void)
 {
-	vec4 w_pos;
-	vec4 w_nor;
+	vec4 pos;
+	vec4 nor;
 	int i;
 
-	w_pos = m_mat * position_in;
-	w_nor = m_mat_it * normal_in;
+#ifdef E3D_INSTANCED
+	pos = inst_mat * (m_mat * position_in);
+	nor = inst_mat_it * normal_in;
+#else
+	pos = position_in;
+	nor = normal_in;
+#endif
+
+#ifdef E3D_NORMALS
+	normal_w = (m_mat_it * nor).xyz;
+#endif
 
 	for (i = 0; i < light_num; ++i) {
-		if (lights[i].enabled) {
-			position_l[i] = (lights[i].mat * w_pos).xyz;
-			normal_l[i] = (lights[i].mat_it * w_nor).xyz;
-			camera_l[i] = (lights[i].mat * cam_pos).xyz;
-		}
+#ifdef E3D_INSTANCED
+		position_l[i] = (lights[i].mat * pos).xyz;
+#else
+		position_l[i] = (lights[i].m_mat * pos).xyz;
+#endif
+		normal_l[i] = (lights[i].m_mat_it * nor).xyz;
 	}
 }
 
@@ -73,6 +113,11 @@ void main(void)
 {
 	compute_lights();
 
-	color = color_in;
+#ifdef E3D_INSTANCED
+	color = color_in * inst_color;
+	gl_Position = pe_mat * (inst_mat * (m_mat * position_in));
+#else
+	color = color_in * tint;
 	gl_Position = mpe_mat * position_in;
+#endif
 }
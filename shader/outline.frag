@@ -0,0 +1,55 @@
+#version 120
+
+/*
+ * Screen space outlines
+ * A pixel is part of an outline if the linear depth or the normal of its
+ * neighbours differ too much from its own. \outline.xy are m[2][2] and m[3][2]
+ * of the projection matrix and \outline.zw the size of one texel.
+ */
+
+uniform sampler2D color_map;		// scene color
+uniform sampler2D normal_map;		// scene normals scaled into [0, 1]
+uniform sampler2D depth_map;		// scene depth
+uniform vec4 outline;			// projection and texel size
+
+varying vec2 tex;			// texture coordinate of the pixel
+
+const float width = 2.0;		// distance of neighbours in texels
+const float depth_limit = 0.05;		// relative depth difference
+const float normal_limit = 0.4;		// 1 - cosine of normal angle
+
+/*
+ * Returns the distance of the pixel at offset \off to the eye.
+ */
+float depth_at(vec2 off)
+{
+	float d = texture2D(depth_map, tex + off * outline.zw).r * 2.0 - 1.0;
+
+	return outline.y / (d + outline.x);
+}
+
+vec3 normal_at(vec2 off)
+{
+	return texture2D(normal_map, tex + off * outline.zw).xyz * 2.0 - 1.0;
+}
+
+void main(void)
+{
+	vec2 x = vec2(width, 0.0);
+	vec2 y = vec2(0.0, width);
+	float d = depth_at(vec2(0.0));
+	vec3 n = normal_at(vec2(0.0));
+	float dd, nd;
+
+	dd = abs(depth_at(x) + depth_at(-x) + depth_at(y) + depth_at(-y) -
+								4.0 * d);
+	nd = max(max(1.0 - dot(n, normal_at(x)), 1.0 - dot(n, normal_at(-x))),
+		max(1.0 - dot(n, normal_at(y)), 1.0 - dot(n, normal_at(-y))));
+
+	if (dd > depth_limit * d || nd > normal_limit)
+		gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);
+	else
+		gl_FragColor = texture2D(color_map, tex);
+
+	gl_FragDepth = texture2D(depth_map, tex).r;
+}
@@ -0,0 +1,10 @@
+#version 120
+
+attribute vec4 position_in;
+
+varying vec2 tex;			// texture coordinate of the pixel
+
+void main(void) {
+	tex = position_in.xy * 0.5 + 0.5;
+	gl_Position = position_in;
+}
@@ -1,10 +1,21 @@
 #version 120
 
+#ifdef E3D_INSTANCED
+uniform mat4 pe_mat;		// projection and eye matrix
+uniform mat4 m_mat;		// modelview matrix
+
+attribute mat4 inst_mat;	// model matrix of instance
+#else
 uniform mat4 mpe_mat;		// modelview, projection and eye matrix
+#endif
 
 attribute vec4 position_in;
 
 void main(void) {
+#ifdef E3D_INSTANCED
+	gl_Position = pe_mat * (inst_mat * (m_mat * position_in));
+#else
 	gl_Position = mpe_mat * position_in;
+#endif
 }
 
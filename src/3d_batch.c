@@ -0,0 +1,320 @@
+/*
+ * airhockey - 3D engine - static batches
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Vertices and indices are collected in growing arrays while shapes are added.
+ * Each primitive is appended with all vertices up to its highest index and its
+ * triangles are appended as plain triangle list with adjusted indices.
+ * Positions are transformed by the accumulated matrix and normals by its
+ * inverse, which is the normal matrix that the shaders get as m_mat_it for
+ * objects drawn one by one, so batching does not change the shading. If the
+ * matrix mirrors the geometry, the winding of all triangles is reversed so
+ * front faces stay front faces.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine3d.h"
+#include "log.h"
+#include "mathw.h"
+
+void e3d_batch_init(struct e3d_batch *batch)
+{
+	memset(batch, 0, sizeof(*batch));
+}
+
+void e3d_batch_destroy(struct e3d_batch *batch)
+{
+	free(batch->index);
+	free(batch->vertex);
+	memset(batch, 0, sizeof(*batch));
+}
+
+static int grow(void **array, size_t *size, size_t num, size_t ele)
+{
+	size_t nsize;
+	void *tmp;
+
+	if (num <= *size)
+		return 0;
+
+	nsize = *size ? *size : 64;
+	while (nsize < num)
+		nsize <<= 1;
+
+	tmp = realloc(*array, nsize * ele);
+	if (!tmp)
+		return -ENOMEM;
+
+	*array = tmp;
+	*size = nsize;
+	return 0;
+}
+
+static bool can_add_prim(const struct e3d_primitive *prim)
+{
+	if (!prim->num)
+		return true;
+
+	if (prim->type != GL_TRIANGLES && prim->type != GL_TRIANGLE_STRIP &&
+					prim->type != GL_TRIANGLE_FAN)
+		return false;
+
+	if (prim->packed)
+		return prim->packed->data;
+
+	return prim->vertex && prim->vertex->data && prim->color &&
+			prim->color->data && prim->normal && prim->normal->data;
+}
+
+/*
+ * Returns true if all primitives of \shape and its childs can be batched, that
+ * is, they are triangles and their client memory is still available.
+ */
+bool e3d_batch_can_add(const struct e3d_shape *shape)
+{
+	const struct e3d_shape *iter;
+
+	if (shape->prim && !can_add_prim(shape->prim))
+		return false;
+
+	for (iter = shape->childs; iter; iter = iter->next)
+		if (!e3d_batch_can_add(iter))
+			return false;
+
+	return true;
+}
+
+static inline size_t corner(struct e3d_primitive *prim, size_t i)
+{
+	if (prim->index)
+		return e3d_vbo_get_idx(prim->index, prim->ioff + i);
+	return i;
+}
+
+static void fetch(struct e3d_primitive *prim, size_t i, math_v4 position,
+						math_v4 color, math_v4 normal)
+{
+	if (prim->packed) {
+		e3d_vertex_unpack(E3D_VBO_AT(prim->packed, prim->poff + i),
+						position, color, normal);
+	} else {
+		math_v4_copy(position,
+				E3D_VBO_AT(prim->vertex, prim->voff + i));
+		math_v4_copy(color, E3D_VBO_AT(prim->color, prim->coff + i));
+		math_v4_copy(normal, E3D_VBO_AT(prim->normal, prim->noff + i));
+	}
+}
+
+/* returns the determinant of the upper 3x3 part of \m */
+static float determinant(math_m4 m)
+{
+	return m[0][0] * (m[1][1] * m[2][2] - m[2][1] * m[1][2]) -
+		m[1][0] * (m[0][1] * m[2][2] - m[2][1] * m[0][2]) +
+		m[2][0] * (m[0][1] * m[1][2] - m[1][1] * m[0][2]);
+}
+
+/* \inv is the inverse of \m and transforms the normal */
+static void add_vertex(struct e3d_vertex *v, math_m4 m, math_m4 inv,
+				math_v4 pos, math_v4 col, math_v4 normal)
+{
+	math_v3 p, n;
+	float len;
+	size_t r;
+
+	/* m is column major so m[c][r] is row r of column c */
+	for (r = 0; r < 3; ++r) {
+		p[r] = m[0][r] * pos[0] + m[1][r] * pos[1] + m[2][r] * pos[2] +
+								m[3][r];
+		n[r] = inv[0][r] * normal[0] + inv[1][r] * normal[1] +
+						inv[2][r] * normal[2];
+	}
+
+	len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	if (len > 0.0f)
+		len = 1.0f / len;
+	for (r = 0; r < 3; ++r)
+		n[r] *= len;
+
+	e3d_vertex_pack(v, p, col, n);
+}
+
+static int add_tri(struct e3d_batch *batch, size_t base, size_t a, size_t b,
+						size_t c, bool mirror)
+{
+	GLuint *t;
+	int ret;
+
+	ret = grow((void**)&batch->index, &batch->isize, batch->inum + 3,
+						sizeof(*batch->index));
+	if (ret)
+		return ret;
+
+	t = &batch->index[batch->inum];
+	batch->inum += 3;
+
+	t[0] = base + a;
+	t[1] = base + (mirror ? c : b);
+	t[2] = base + (mirror ? b : c);
+	return 0;
+}
+
+static int add_prim(struct e3d_batch *batch, struct e3d_primitive *prim,
+					math_m4 m, const float *color)
+{
+	math_m4 inv;
+	math_v4 pos, col, normal;
+	size_t i, vnum, base;
+	bool mirror;
+	int ret;
+
+	if (prim->num < 3)
+		return 0;
+
+	vnum = 0;
+	for (i = 0; i < prim->num; ++i)
+		if (corner(prim, i) >= vnum)
+			vnum = corner(prim, i) + 1;
+
+	ret = grow((void**)&batch->vertex, &batch->vsize, batch->vnum + vnum,
+						sizeof(*batch->vertex));
+	if (ret)
+		return ret;
+
+	math_m4_invert_dest(inv, m);
+	mirror = determinant(m) < 0.0f;
+	base = batch->vnum;
+
+	for (i = 0; i < vnum; ++i) {
+		fetch(prim, i, pos, col, normal);
+		col[0] *= color[0];
+		col[1] *= color[1];
+		col[2] *= color[2];
+		col[3] *= color[3];
+		add_vertex(&batch->vertex[base + i], m, inv, pos, col, normal);
+	}
+	batch->vnum += vnum;
+
+	for (i = 0; i + 2 < prim->num; ) {
+		switch (prim->type) {
+			case GL_TRIANGLES:
+				ret = add_tri(batch, base, corner(prim, i),
+						corner(prim, i + 1),
+						corner(prim, i + 2), mirror);
+				i += 3;
+				break;
+			case GL_TRIANGLE_STRIP:
+				ret = add_tri(batch, base,
+					corner(prim, i + (i & 1)),
+					corner(prim, i + 1 - (i & 1)),
+					corner(prim, i + 2), mirror);
+				i += 1;
+				break;
+			default:
+				ret = add_tri(batch, base, corner(prim, 0),
+						corner(prim, i + 1),
+						corner(prim, i + 2), mirror);
+				i += 1;
+				break;
+		}
+
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Adds all primitives of \shape and its childs to \batch. \m transforms the
+ * shape into the coordinate system of the batch and the vertex colors are
+ * multiplied with \color. The shape must pass e3d_batch_can_add().
+ */
+int e3d_batch_add_shape(struct e3d_batch *batch, struct e3d_shape *shape,
+					math_m4 m, const math_v4 color)
+{
+	struct e3d_shape *iter;
+	math_m4 local;
+	int ret;
+
+	math_m4_mult_dest(local, m, math_trs_matrix(&shape->alter));
+
+	if (shape->prim) {
+		assert(can_add_prim(shape->prim));
+		ret = add_prim(batch, shape->prim, local, color);
+		if (ret)
+			return ret;
+	}
+
+	for (iter = shape->childs; iter; iter = iter->next) {
+		ret = e3d_batch_add_shape(batch, iter, local, color);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Creates a new primitive out of all shapes that were added to \batch and
+ * uploads it into static GL buffer objects. Returns -ENOENT if the batch is
+ * empty. The batch can be destroyed afterwards.
+ */
+int e3d_batch_build(struct e3d_batch *batch, struct e3d_primitive **prim)
+{
+	struct e3d_primitive *p;
+	struct e3d_vbo *vertex, *index;
+	size_t i;
+	int ret;
+
+	if (!batch->inum)
+		return -ENOENT;
+
+	ret = e3d_vbo_new_packed(&vertex, batch->vnum);
+	if (ret)
+		return ret;
+	memcpy(vertex->data, batch->vertex,
+				sizeof(*batch->vertex) * batch->vnum);
+
+	ret = e3d_vbo_new_idx_type(&index, e3d_idx_type(batch->vnum),
+								batch->inum);
+	if (ret)
+		goto err_vertex;
+	for (i = 0; i < batch->inum; ++i)
+		e3d_vbo_set_idx(index, i, batch->index[i]);
+
+	ret = e3d_primitive_new(&p);
+	if (ret)
+		goto err_index;
+
+	p->type = GL_TRIANGLES;
+	p->num = batch->inum;
+	e3d_primitive_set_packed(p, 0, vertex);
+	e3d_primitive_set_index(p, 0, index);
+	e3d_primitive_update_bounds(p);
+
+	ret = e3d_primitive_grab(p, E3D_VBO_STATIC_DRAW);
+	if (ret) {
+		e3d_primitive_unref(p);
+		goto err_index;
+	}
+
+	ulog_flog(e3d_log, ULOG_DEBUG, "Batch: %lu vertices %lu triangles\n",
+					batch->vnum, batch->inum / 3);
+
+	*prim = p;
+
+err_index:
+	e3d_vbo_unref(index);
+err_vertex:
+	e3d_vbo_unref(vertex);
+	return ret;
+}
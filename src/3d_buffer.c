@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -75,18 +76,55 @@ void e3d_vbo_unref(struct e3d_vbo *vbo)
 	free(vbo);
 }
 
+/* index buffers are bound as element arrays, everything else as array */
+static GLenum vbo_target(struct e3d_vbo *vbo)
+{
+	return e3d_vbo_is_idx(vbo) ? GL_ELEMENT_ARRAY_BUFFER : GL_ARRAY_BUFFER;
+}
+
+/*
+ * Uploads the data of \vbo into a GL buffer object. All following bind and
+ * draw calls use the buffer object instead of the client memory. The client
+ * memory is kept until e3d_vbo_release() is called so the buffer may still be
+ * read by the CPU.
+ */
 int e3d_vbo_grab(struct e3d_vbo *vbo, int hint)
 {
-	size_t size = e3d_tsize[vbo->ele_type] * vbo->ele_num * vbo->num;
+	assert(vbo);
+
+	return e3d_vbo_grab_range(vbo, vbo->num, hint);
+}
+
+/*
+ * Like e3d_vbo_grab() but only uploads the first \num elements of \vbo. The
+ * buffer object is reallocated with that size, so streamed buffers with spare
+ * capacity do not transfer unused elements. Only the first \num elements may
+ * be drawn from the buffer object then.
+ */
+int e3d_vbo_grab_range(struct e3d_vbo *vbo, size_t num, int hint)
+{
+	size_t size;
+	GLenum target;
 
 	assert(vbo);
 	assert(vbo->data);
+	assert(num <= vbo->num);
 
-	if (!vbo->id)
+	size = e3d_tsize[vbo->ele_type] * vbo->ele_num * num;
+	target = vbo_target(vbo);
+
+	if (!vbo->id) {
 		E3D(glGenBuffers(1, &vbo->id));
+		if (!vbo->id) {
+			ulog_flog(e3d_log, ULOG_ERROR,
+					"VBO: Cannot create buffer object\n");
+			return -ENOMEM;
+		}
+	}
 
-	E3D(glBindBuffer(GL_ARRAY_BUFFER, vbo->id));
-	E3D(glBufferData(GL_ARRAY_BUFFER, size, vbo->data, hint));
+	E3D(glBindBuffer(target, vbo->id));
+	E3D(glBufferData(target, size, vbo->data, hint));
+	E3D(glBindBuffer(target, 0));
 
 	return 0;
 }
@@ -109,7 +147,9 @@ void e3d_vbo_bind(struct e3d_vbo *vbo, GLint attr, size_t off)
 	offset = vbo->ele_num * e3d_tsize[vbo->ele_type] * off;
 
 	if (vbo->id) {
-		assert(false);
+		E3D(glBindBuffer(GL_ARRAY_BUFFER, vbo->id));
+		E3D(glVertexAttribPointer(attr, vbo->ele_num, vbo->ele_type,
+					GL_FALSE, 0, (void*)offset));
 	} else {
 		assert(vbo->data);
 
@@ -119,6 +159,50 @@ void e3d_vbo_bind(struct e3d_vbo *vbo, GLint attr, size_t off)
 	}
 }
 
+/*
+ * Binds one attribute of the packed vertex buffer \vbo to \attr. \id selects
+ * which attribute of the packed vertices is bound (see e3d_shader_attribute_ids).
+ */
+void e3d_vbo_bind_packed(struct e3d_vbo *vbo, size_t id, GLint attr,
+								size_t off)
+{
+	static const struct {
+		GLint size;
+		GLenum type;
+		GLboolean norm;
+		size_t off;
+	} format[E3D_A_NUM] = {
+		[E3D_A_VERTEX] = { 3, GL_FLOAT, GL_FALSE,
+				offsetof(struct e3d_vertex, position) },
+		[E3D_A_COLOR] = { 4, GL_UNSIGNED_BYTE, GL_TRUE,
+				offsetof(struct e3d_vertex, color) },
+		[E3D_A_NORMAL] = { 4, GL_INT_2_10_10_10_REV, GL_TRUE,
+				offsetof(struct e3d_vertex, normal) },
+	};
+	size_t offset;
+	void *ptr;
+
+	assert(vbo);
+	assert(e3d_vbo_is_packed(vbo));
+	assert(id < E3D_A_NUM);
+	assert(attr >= 0);
+
+	offset = sizeof(struct e3d_vertex) * off + format[id].off;
+
+	if (vbo->id) {
+		E3D(glBindBuffer(GL_ARRAY_BUFFER, vbo->id));
+		ptr = (void*)offset;
+	} else {
+		assert(vbo->data);
+
+		E3D(glBindBuffer(GL_ARRAY_BUFFER, 0));
+		ptr = E3D_OFF(vbo->data, offset);
+	}
+
+	E3D(glVertexAttribPointer(attr, format[id].size, format[id].type,
+			format[id].norm, sizeof(struct e3d_vertex), ptr));
+}
+
 void e3d_vbo_draw(struct e3d_vbo *vbo, GLuint type, size_t num, size_t off)
 {
 	size_t offset;
@@ -129,7 +213,8 @@ void e3d_vbo_draw(struct e3d_vbo *vbo, GLuint type, size_t num, size_t off)
 	offset = vbo->ele_num * e3d_tsize[vbo->ele_type] * off;
 
 	if (vbo->id) {
-		assert(false);
+		E3D(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo->id));
+		glDrawElements(type, num, vbo->ele_type, (void*)offset);
 	} else {
 		assert(vbo->data);
 
@@ -142,8 +227,17 @@ void e3d_vbo_draw(struct e3d_vbo *vbo, GLuint type, size_t num, size_t off)
 static void vbo_debug_at(struct e3d_vbo *vbo, size_t at)
 {
 	float *f = E3D_VBO_AT(vbo, at);
-
-	if (vbo->ele_num == 1)
+	math_v4 p, c, n;
+
+	if (e3d_vbo_is_packed(vbo)) {
+		e3d_vertex_unpack((void*)f, p, c, n);
+		ulog_flog(e3d_log, ULOG_DEBUG, "VBO: %f %f %f / %f %f %f %f / "
+				"%f %f %f\n", p[0], p[1], p[2], c[0], c[1], c[2],
+							c[3], n[0], n[1], n[2]);
+	} else if (e3d_vbo_is_idx(vbo))
+		ulog_flog(e3d_log, ULOG_DEBUG, "VBO: %lu\n",
+						e3d_vbo_get_idx(vbo, at));
+	else if (vbo->ele_num == 1)
 		ulog_flog(e3d_log, ULOG_DEBUG, "VBO: %f\n", f[0]);
 	else if (vbo->ele_num == 3)
 		ulog_flog(e3d_log, ULOG_DEBUG, "VBO: %f %f %f\n",
@@ -170,15 +264,110 @@ void e3d_vbo_debug(struct e3d_vbo *vbo)
 	ulog_flog(e3d_log, ULOG_DEBUG, "End of VBO %p debug\n", vbo);
 }
 
+static inline GLubyte pack_unorm8(float f)
+{
+	if (f <= 0.0f)
+		return 0;
+	if (f >= 1.0f)
+		return 255;
+	return f * 255.0f + 0.5f;
+}
+
+static inline GLuint pack_snorm10(float f)
+{
+	if (f < -1.0f)
+		f = -1.0f;
+	else if (f > 1.0f)
+		f = 1.0f;
+	return ((GLint)lrintf(f * 511.0f)) & 0x3ff;
+}
+
+static inline float unpack_snorm10(GLuint v)
+{
+	GLint i = v & 0x3ff;
+
+	if (i & 0x200)
+		i -= 0x400;
+	return (i < -511) ? -1.0f : i / 511.0f;
+}
+
+/*
+ * Packs the position, color and normal into \v. \position and \normal need
+ * three components, \color needs four.
+ */
+void e3d_vertex_pack(struct e3d_vertex *v, const float *position,
+				const float *color, const float *normal)
+{
+	size_t i;
+
+	for (i = 0; i < 3; ++i)
+		v->position[i] = position[i];
+	for (i = 0; i < 4; ++i)
+		v->color[i] = pack_unorm8(color[i]);
+	v->normal = pack_snorm10(normal[0]) | pack_snorm10(normal[1]) << 10 |
+						pack_snorm10(normal[2]) << 20;
+}
+
+/*
+ * Unpacks \v into four component vectors. Each destination may be NULL if it
+ * is not needed.
+ */
+void e3d_vertex_unpack(const struct e3d_vertex *v, float *position,
+						float *color, float *normal)
+{
+	size_t i;
+
+	if (position) {
+		for (i = 0; i < 3; ++i)
+			position[i] = v->position[i];
+		position[3] = 1.0f;
+	}
+
+	if (color)
+		for (i = 0; i < 4; ++i)
+			color[i] = v->color[i] / 255.0f;
+
+	if (normal) {
+		for (i = 0; i < 3; ++i)
+			normal[i] = unpack_snorm10(v->normal >> (i * 10));
+		normal[3] = 0.0f;
+	}
+}
+
+/*
+ * Sets the model matrix and color of \inst. The normal matrix is computed the
+ * same way as the m_mat_it uniform so instanced and plain draws are lit alike.
+ */
+void e3d_instance_set(struct e3d_instance *inst, math_m4 model,
+							const math_v4 color)
+{
+	math_m4_copy(inst->model, model);
+	math_m4_invert_dest(inst->model_it, model);
+	math_v4_copy(inst->color, (void*)color);
+}
+
 void e3d_transform_init(struct e3d_transform *transform)
 {
 	math_stack_init(&transform->mod_stack);
 	math_stack_init(&transform->proj_stack);
 	math_stack_init(&transform->eye_stack);
+
+	transform->cull = false;
+	transform->drawn = 0;
+	transform->culled = 0;
+	transform->lod_size = 0.0f;
+	transform->light = NULL;
+	transform->color = NULL;
 }
 
 void e3d_transform_destroy(struct e3d_transform *transform)
 {
+	ulog_flog(e3d_log, ULOG_DEBUG, "Transform: max stack depth mod %lu "
+		"proj %lu eye %lu\n",
+		math_stack_max_depth(&transform->mod_stack),
+		math_stack_max_depth(&transform->proj_stack),
+		math_stack_max_depth(&transform->eye_stack));
+
 	math_stack_destroy(&transform->eye_stack);
 	math_stack_destroy(&transform->proj_stack);
 	math_stack_destroy(&transform->mod_stack);
@@ -193,6 +382,27 @@ void e3d_transform_reset(struct e3d_transform *transform)
 	math_m4_identity(MATH_TIP(&transform->mod_stack));
 	math_m4_identity(MATH_TIP(&transform->proj_stack));
 	math_m4_identity(MATH_TIP(&transform->eye_stack));
+
+	transform->cull = false;
+	transform->drawn = 0;
+	transform->culled = 0;
+	transform->lod_size = 0.0f;
+	transform->light = NULL;
+	transform->color = NULL;
+}
+
+/*
+ * Enables culling against the view frustum until the next reset. This must be
+ * called after the projection and eye matrices have been set up.
+ */
+void e3d_transform_cull(struct e3d_transform *transform)
+{
+	math_m4 m;
+
+	math_m4_mult_dest(m, MATH_TIP(&transform->proj_stack),
+					MATH_TIP(&transform->eye_stack));
+	e3d_frustum_extract(&transform->frustum, m);
+	transform->cull = true;
 }
 
 int e3d_primitive_new(struct e3d_primitive **prim)
@@ -205,6 +415,7 @@ int e3d_primitive_new(struct e3d_primitive **prim)
 
 	memset(p, 0, sizeof(*p));
 	p->ref = 1;
+	e3d_bounds_clear(&p->bounds);
 
 	*prim = p;
 	return 0;
@@ -241,6 +452,34 @@ void e3d_primitive_ref(struct e3d_primitive *prim)
 	assert(prim->ref);
 }
 
+/*
+ * Cached vertex array objects reference the buffers of the primitive so they
+ * are dropped whenever a buffer is replaced.
+ */
+static void drop_vaos(struct e3d_primitive *prim)
+{
+	size_t i;
+
+	for (i = 0; i < prim->vao_num; ++i)
+		E3D(glDeleteVertexArrays(1, &prim->vaos[i].id));
+	prim->vao_num = 0;
+}
+
+/* the adjacency of the old buffers is stale after they are replaced */
+static void drop_edges(struct e3d_primitive *prim)
+{
+	free(prim->edges);
+	prim->edges = NULL;
+	prim->edge_num = 0;
+}
+
+/* the normal lines are rebuilt on the next draw with the new buffers */
+static void drop_normal_lines(struct e3d_primitive *prim)
+{
+	e3d_vbo_unref(prim->normal_lines);
+	prim->normal_lines = NULL;
+}
+
 void e3d_primitive_unref(struct e3d_primitive *prim)
 {
 	if (!prim)
@@ -251,10 +490,14 @@ void e3d_primitive_unref(struct e3d_primitive *prim)
 	if (--prim->ref)
 		return;
 
+	drop_vaos(prim);
+	drop_edges(prim);
+	drop_normal_lines(prim);
 	e3d_vbo_unref(prim->vertex);
 	e3d_vbo_unref(prim->color);
 	e3d_vbo_unref(prim->normal);
 	e3d_vbo_unref(prim->index);
+	e3d_vbo_unref(prim->packed);
 	free(prim);
 }
 
@@ -265,6 +508,9 @@ void e3d_primitive_set_vertex(struct e3d_primitive *prim, size_t off,
 	assert(vbo);
 	assert(e3d_vbo_is_v4(vbo));
 
+	drop_vaos(prim);
+	drop_edges(prim);
+	drop_normal_lines(prim);
 	e3d_vbo_unref(prim->vertex);
 	e3d_vbo_ref(vbo);
 	prim->voff = off;
@@ -278,6 +524,7 @@ void e3d_primitive_set_color(struct e3d_primitive *prim, size_t off,
 	assert(vbo);
 	assert(e3d_vbo_is_v4(vbo));
 
+	drop_vaos(prim);
 	e3d_vbo_unref(prim->color);
 	e3d_vbo_ref(vbo);
 	prim->coff = off;
@@ -291,6 +538,8 @@ void e3d_primitive_set_normal(struct e3d_primitive *prim, size_t off,
 	assert(vbo);
 	assert(e3d_vbo_is_v4(vbo));
 
+	drop_vaos(prim);
+	drop_normal_lines(prim);
 	e3d_vbo_unref(prim->normal);
 	e3d_vbo_ref(vbo);
 	prim->noff = off;
@@ -304,171 +553,630 @@ void e3d_primitive_set_index(struct e3d_primitive *prim, size_t off,
 	assert(vbo);
 	assert(e3d_vbo_is_idx(vbo));
 
+	drop_vaos(prim);
+	drop_edges(prim);
+	drop_normal_lines(prim);
 	e3d_vbo_unref(prim->index);
 	e3d_vbo_ref(vbo);
 	prim->ioff = off;
 	prim->index = vbo;
 }
 
+/*
+ * Sets the packed vertex buffer of \prim. If it is set, it is used instead of
+ * the separate vertex, color and normal buffers.
+ */
+void e3d_primitive_set_packed(struct e3d_primitive *prim, size_t off,
+							struct e3d_vbo *vbo)
+{
+	assert(prim);
+	assert(vbo);
+	assert(e3d_vbo_is_packed(vbo));
+
+	drop_vaos(prim);
+	drop_edges(prim);
+	drop_normal_lines(prim);
+	e3d_vbo_unref(prim->packed);
+	e3d_vbo_ref(vbo);
+	prim->poff = off;
+	prim->packed = vbo;
+}
+
+/*
+ * Converts the separate vertex, color and normal buffers of \prim into a new
+ * packed vertex buffer and drops the separate buffers. The index buffer is
+ * kept. All three buffers must be set and still have client memory. Only the
+ * vertices that are referenced by the primitive are packed.
+ * Does nothing if \prim is already packed.
+ */
+int e3d_primitive_pack(struct e3d_primitive *prim)
+{
+	struct e3d_vbo *vbo;
+	size_t i, num, idx;
+	int ret;
+
+	if (prim->packed)
+		return 0;
+
+	assert(prim->vertex && prim->vertex->data);
+	assert(prim->color && prim->color->data);
+	assert(prim->normal && prim->normal->data);
+
+	if (prim->index) {
+		num = 0;
+		for (i = 0; i < prim->num; ++i) {
+			idx = E3D_VBO_AT_IDX(prim->index, prim->ioff + i);
+			if (idx >= num)
+				num = idx + 1;
+		}
+	} else {
+		num = prim->num;
+	}
+
+	if (!num)
+		return -EINVAL;
+
+	ret = e3d_vbo_new_packed(&vbo, num);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < num; ++i)
+		e3d_vertex_pack(E3D_VBO_AT(vbo, i),
+				E3D_VBO_AT(prim->vertex, prim->voff + i),
+				E3D_VBO_AT(prim->color, prim->coff + i),
+				E3D_VBO_AT(prim->normal, prim->noff + i));
+
+	e3d_primitive_set_packed(prim, 0, vbo);
+	e3d_vbo_unref(vbo);
+
+	e3d_vbo_unref(prim->vertex);
+	e3d_vbo_unref(prim->color);
+	e3d_vbo_unref(prim->normal);
+	prim->vertex = NULL;
+	prim->color = NULL;
+	prim->normal = NULL;
+	prim->voff = 0;
+	prim->coff = 0;
+	prim->noff = 0;
+
+	return 0;
+}
+
+static int grab_once(struct e3d_vbo *vbo, int hint)
+{
+	if (!vbo || vbo->id)
+		return 0;
+
+	return e3d_vbo_grab(vbo, hint);
+}
+
+/*
+ * Uploads all buffers of \prim into GL buffer objects. Buffers that are
+ * already uploaded are skipped, so buffers shared between several primitives
+ * are only uploaded once.
+ */
+int e3d_primitive_grab(struct e3d_primitive *prim, int hint)
+{
+	int ret;
+
+	ret = grab_once(prim->vertex, hint);
+	if (ret)
+		return ret;
+	ret = grab_once(prim->color, hint);
+	if (ret)
+		return ret;
+	ret = grab_once(prim->normal, hint);
+	if (ret)
+		return ret;
+	ret = grab_once(prim->packed, hint);
+	if (ret)
+		return ret;
+
+	return grab_once(prim->index, hint);
+}
+
+/*
+ * Sets the matrix uniforms that \loc uses. Instanced shaders get the combined
+ * projection and eye matrix and apply the modelview matrix themselves.
+ * Full draws get the modelview matrix combined with the world to light matrices
+ * of the light of \trans so the shader does not multiply them per vertex.
+ */
 static void setup_uniforms(int how, const struct e3d_shader_locations *loc,
 						struct e3d_transform *trans)
 {
-	math_m4 tmp;
+	math_m4 tmp, inv;
+	const struct e3d_light *light;
 
-	/* modelview, projection and eye matrix combined */
+	/* projection and eye matrix combined */
 	math_m4_mult_dest(tmp, MATH_TIP(&trans->proj_stack),
 						MATH_TIP(&trans->eye_stack));
+	if (loc->uni[E3D_U_PE_MAT] >= 0)
+		E3D(glUniformMatrix4fv(loc->uni[E3D_U_PE_MAT], 1, 0,
+								(void*)tmp));
+
+	/* modelview, projection and eye matrix combined */
 	math_m4_mult(tmp, MATH_TIP(&trans->mod_stack));
 	E3D(glUniformMatrix4fv(loc->uni[E3D_U_MPE_MAT], 1, 0, (void*)tmp));
 
-	if (how == E3D_DRAW_FULL) {
-		/* modelview matrix */
+	/* modelview matrix */
+	if (loc->uni[E3D_U_M_MAT] >= 0)
 		E3D(glUniformMatrix4fv(loc->uni[E3D_U_M_MAT], 1, 0,
 					(void*)MATH_TIP(&trans->mod_stack)));
 
-		math_m4_invert_dest(tmp, MATH_TIP(&trans->mod_stack));
-		E3D(glUniformMatrix4fv(loc->uni[E3D_U_M_MAT_IT], 1, 0,
+	light = (how == E3D_DRAW_FULL) ? trans->light : NULL;
+
+	if (loc->uni[E3D_U_M_MAT_IT] >= 0 || light) {
+		math_m4_invert_dest(inv, MATH_TIP(&trans->mod_stack));
+		if (loc->uni[E3D_U_M_MAT_IT] >= 0)
+			E3D(glUniformMatrix4fv(loc->uni[E3D_U_M_MAT_IT], 1, 0,
+								(void*)inv));
+	}
+
+	/* object to light matrices */
+	if (light && loc->uni[E3D_U_LIGHT0_M_MAT] >= 0) {
+		math_m4_mult_dest(tmp, (void*)light->matrix,
+					MATH_TIP(&trans->mod_stack));
+		E3D(glUniformMatrix4fv(loc->uni[E3D_U_LIGHT0_M_MAT], 1, 0,
+								(void*)tmp));
+	}
+
+	if (light && loc->uni[E3D_U_LIGHT0_M_MAT_IT] >= 0) {
+		math_m4_mult_dest(tmp, (void*)light->matrix_it, inv);
+		E3D(glUniformMatrix4fv(loc->uni[E3D_U_LIGHT0_M_MAT_IT], 1, 0,
 								(void*)tmp));
-	} else if (how == E3D_DRAW_SILHOUETTE) {
+	}
+
+	if (how == E3D_DRAW_FULL && loc->uni[E3D_U_TINT] >= 0) {
+		if (trans->color)
+			E3D(glUniform4fv(loc->uni[E3D_U_TINT], 1,
+							trans->color));
+		else
+			E3D(glUniform4f(loc->uni[E3D_U_TINT], 1.0, 1.0, 1.0,
+									1.0));
+	}
+
+	if (how == E3D_DRAW_SILHOUETTE)
 		E3D(glUniform4f(loc->uni[E3D_U_COLOR], 0.0, 0.0, 0.0, 1.0));
-	} else if (how == E3D_DRAW_NORMALS) {
+	else if (how == E3D_DRAW_NORMALS)
 		E3D(glUniform4f(loc->uni[E3D_U_COLOR], 1.0, 0.1, 0.1, 1.0));
+}
+
+/*
+ * Returns the buffer that feeds attribute \attr of \prim and its offset.
+ */
+static struct e3d_vbo *attr_vbo(struct e3d_primitive *prim, size_t attr,
+								size_t *off)
+{
+	if (prim->packed) {
+		*off = prim->poff;
+		return prim->packed;
+	}
+
+	switch (attr) {
+		case E3D_A_VERTEX:
+			*off = prim->voff;
+			return prim->vertex;
+		case E3D_A_COLOR:
+			*off = prim->coff;
+			return prim->color;
+		case E3D_A_NORMAL:
+			*off = prim->noff;
+			return prim->normal;
+		default:
+			*off = 0;
+			return NULL;
 	}
 }
 
-void e3d_primitive_draw(struct e3d_primitive *prim, int how,
-	const struct e3d_shader_locations *loc, struct e3d_transform *trans)
+/*
+ * Computes the attribute layout that is used to draw \prim with drawer \how.
+ * Attributes that are not used are set to -1.
+ */
+static void get_layout(GLint *layout, struct e3d_primitive *prim, int how,
+				const struct e3d_shader_locations *loc)
 {
 	size_t i;
-	math_v4 vertex[2];
 
-	assert(prim->num);
+	for (i = 0; i < E3D_A_NUM; ++i)
+		layout[i] = -1;
 
-	setup_uniforms(how, loc, trans);
+	assert(prim->vertex || prim->packed);
+	layout[E3D_A_VERTEX] = loc->attr[E3D_A_VERTEX];
 
 	if (how == E3D_DRAW_FULL) {
-		assert(prim->vertex);
-		assert(prim->color);
-		assert(prim->normal);
+		assert(prim->color || prim->packed);
+		assert(prim->normal || prim->packed);
+		layout[E3D_A_COLOR] = loc->attr[E3D_A_COLOR];
+		layout[E3D_A_NORMAL] = loc->attr[E3D_A_NORMAL];
+	}
+}
 
-		E3D(glEnableVertexAttribArray(loc->attr[E3D_A_VERTEX]));
-		E3D(glEnableVertexAttribArray(loc->attr[E3D_A_COLOR]));
-		E3D(glEnableVertexAttribArray(loc->attr[E3D_A_NORMAL]));
-		e3d_vbo_bind(prim->vertex, loc->attr[E3D_A_VERTEX], prim->voff);
-		e3d_vbo_bind(prim->normal, loc->attr[E3D_A_NORMAL], prim->noff);
-		e3d_vbo_bind(prim->color, loc->attr[E3D_A_COLOR], prim->coff);
+static void bind_arrays(struct e3d_primitive *prim, const GLint *layout)
+{
+	struct e3d_vbo *vbo;
+	size_t i, off;
 
-		if (prim->index)
-			e3d_vbo_draw(prim->index, prim->type, prim->num,
-								prim->ioff);
+	for (i = 0; i < E3D_A_NUM; ++i) {
+		if (layout[i] < 0)
+			continue;
+
+		vbo = attr_vbo(prim, i, &off);
+		E3D(glEnableVertexAttribArray(layout[i]));
+		if (vbo == prim->packed)
+			e3d_vbo_bind_packed(vbo, i, layout[i], off);
 		else
-			glDrawArrays(prim->type, 0, prim->num);
-	} else if (how == E3D_DRAW_SILHOUETTE) {
-		assert(prim->vertex);
+			e3d_vbo_bind(vbo, layout[i], off);
+	}
+}
 
-		E3D(glEnableVertexAttribArray(loc->attr[E3D_A_VERTEX]));
-		e3d_vbo_bind(prim->vertex, loc->attr[E3D_A_VERTEX], prim->voff);
+static void unbind_arrays(const GLint *layout)
+{
+	size_t i;
 
-		if (prim->index)
-			e3d_vbo_draw(prim->index, prim->type, prim->num,
-								prim->ioff);
-		else
-			glDrawArrays(prim->type, 0, prim->num);
-	} else if (how == E3D_DRAW_NORMALS) {
+	for (i = 0; i < E3D_A_NUM; ++i)
+		if (layout[i] >= 0)
+			E3D(glDisableVertexAttribArray(layout[i]));
+}
+
+static bool is_grabbed(struct e3d_primitive *prim, const GLint *layout)
+{
+	struct e3d_vbo *vbo;
+	size_t i, off;
+
+	for (i = 0; i < E3D_A_NUM; ++i) {
+		if (layout[i] < 0)
+			continue;
+
+		vbo = attr_vbo(prim, i, &off);
+		if (!vbo->id)
+			return false;
+	}
+
+	return !prim->index || prim->index->id;
+}
+
+/*
+ * Returns the vertex array object of \prim for the given layout. It is created
+ * on first use. Vertex array objects would capture client memory pointers, so
+ * they are only created if all used buffers are GL buffer objects. Returns 0 if
+ * no vertex array object can be used.
+ */
+static GLuint get_vao(struct e3d_primitive *prim, const GLint *layout)
+{
+	struct e3d_vao *vao;
+	size_t i;
+
+	for (i = 0; i < prim->vao_num; ++i) {
+		vao = &prim->vaos[i];
+		if (!memcmp(vao->layout, layout, sizeof(vao->layout)))
+			return vao->id;
+	}
+
+	if (prim->vao_num >= E3D_PRIMITIVE_VAOS || !is_grabbed(prim, layout))
+		return 0;
+
+	vao = &prim->vaos[prim->vao_num];
+	E3D(glGenVertexArrays(1, &vao->id));
+	if (!vao->id)
+		return 0;
+
+	++prim->vao_num;
+	memcpy(vao->layout, layout, sizeof(vao->layout));
+
+	E3D(glBindVertexArray(vao->id));
+	bind_arrays(prim, layout);
+	if (prim->index)
+		E3D(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, prim->index->id));
+
+	return vao->id;
+}
+
+/* loads position and normal of vertex \i as four component vectors */
+static void load_vertex(struct e3d_primitive *prim, size_t i, math_v4 position,
+								math_v4 normal)
+{
+	if (prim->packed) {
+		e3d_vertex_unpack(E3D_VBO_AT(prim->packed, prim->poff + i),
+							position, NULL, normal);
+	} else {
+		math_v4_copy(position, E3D_VBO_AT(prim->vertex, prim->voff + i));
+		math_v4_copy(normal, E3D_VBO_AT(prim->normal, prim->noff + i));
+	}
+}
+
+/*
+ * Builds the cached line buffer of the normals debug drawer. Each drawn vertex
+ * gets one line from its position along its normal. The lines are uploaded
+ * into a static GL buffer object and the client memory is dropped, but if the
+ * upload fails the client memory is used.
+ */
+static int build_normal_lines(struct e3d_primitive *prim)
+{
+	struct e3d_vbo *vbo;
+	size_t i, v;
+	float *line;
+	math_v4 normal;
+	int ret;
+
+	if (prim->packed) {
+		assert(prim->packed->data);
+	} else {
 		assert(prim->vertex);
 		assert(prim->vertex->data);
 		assert(prim->normal);
 		assert(prim->normal->data);
+	}
 
-		E3D(glBindBuffer(GL_ARRAY_BUFFER, 0));
-		E3D(glEnableVertexAttribArray(loc->attr[E3D_A_VERTEX]));
+	ret = e3d_vbo_new_v4(&vbo, prim->num * 2);
+	if (ret)
+		return ret;
 
-		for (i = 0; i < prim->num; ++i) {
-			if (prim->index) {
-				math_v4_copy(vertex[0],
-					E3D_VBO_AT(prim->vertex, prim->voff +
-					*(GLuint*)E3D_VBO_AT(prim->index, i)));
-				math_v4_copy(vertex[1],
-					E3D_VBO_AT(prim->vertex, prim->voff +
-					*(GLuint*)E3D_VBO_AT(prim->index, i)));
-				math_v4_add(vertex[1],
-					E3D_VBO_AT(prim->normal, prim->noff +
-					*(GLuint*)E3D_VBO_AT(prim->index, i)));
-			} else {
-				math_v4_copy(vertex[0], E3D_VBO_AT(prim->vertex,
-							prim->voff + i));
-				math_v4_copy(vertex[1], E3D_VBO_AT(prim->vertex,
-							prim->voff + i));
-				math_v4_add(vertex[1], E3D_VBO_AT(prim->normal,
-							prim->noff + i));
+	for (i = 0; i < prim->num; ++i) {
+		if (prim->index)
+			v = E3D_VBO_AT_IDX(prim->index, prim->ioff + i);
+		else
+			v = i;
+
+		line = E3D_VBO_AT(vbo, i * 2);
+		load_vertex(prim, v, line, normal);
+		math_v4_copy(&line[4], line);
+		math_v4_add(&line[4], normal);
+	}
+
+	if (!e3d_vbo_grab(vbo, E3D_VBO_STATIC_DRAW))
+		e3d_vbo_release(vbo);
+
+	prim->normal_lines = vbo;
+	return 0;
+}
+
+static void draw_normals(struct e3d_primitive *prim,
+				const struct e3d_shader_locations *loc)
+{
+	GLint attr = loc->attr[E3D_A_VERTEX];
+
+	if (!prim->normal_lines && build_normal_lines(prim)) {
+		ulog_flog(e3d_log, ULOG_WARN,
+			"Primitive: Cannot build normal lines of %p\n", prim);
+		return;
+	}
+
+	E3D(glEnableVertexAttribArray(attr));
+	e3d_vbo_bind(prim->normal_lines, attr, 0);
+	glDrawArrays(GL_LINES, 0, prim->num * 2);
+	E3D(glDisableVertexAttribArray(attr));
+}
+
+/*
+ * Binds the per-instance attributes of \loc to the instances \first and
+ * following of \inst or disables them again if \inst is NULL. Each attribute
+ * advances once per instance.
+ */
+static void bind_instances(const struct e3d_shader_locations *loc,
+					struct e3d_vbo *inst, size_t first)
+{
+	static const struct {
+		size_t id;
+		size_t cols;
+		size_t off;
+	} attrs[] = {
+		{ E3D_A_INST_MAT, 4, offsetof(struct e3d_instance, model) },
+		{ E3D_A_INST_MAT_IT, 4,
+				offsetof(struct e3d_instance, model_it) },
+		{ E3D_A_INST_COLOR, 1, offsetof(struct e3d_instance, color) },
+	};
+	size_t i, c, off;
+	GLint attr;
+	void *ptr;
+
+	if (inst) {
+		assert(e3d_vbo_is_instances(inst));
+		E3D(glBindBuffer(GL_ARRAY_BUFFER, inst->id));
+	}
+
+	for (i = 0; i < sizeof(attrs) / sizeof(*attrs); ++i) {
+		if (loc->attr[attrs[i].id] < 0)
+			continue;
+
+		for (c = 0; c < attrs[i].cols; ++c) {
+			attr = loc->attr[attrs[i].id] + c;
+
+			if (!inst) {
+				E3D(glVertexAttribDivisor(attr, 0));
+				E3D(glDisableVertexAttribArray(attr));
+				continue;
 			}
 
-			E3D(glVertexAttribPointer(loc->attr[E3D_A_VERTEX], 4,
-						GL_FLOAT, GL_FALSE, 0, vertex));
-			glDrawArrays(GL_LINES, 0, 2);
+			off = sizeof(struct e3d_instance) * first +
+					attrs[i].off + sizeof(math_v4) * c;
+			if (inst->id)
+				ptr = (void*)off;
+			else
+				ptr = E3D_OFF(inst->data, off);
+
+			E3D(glEnableVertexAttribArray(attr));
+			E3D(glVertexAttribPointer(attr, 4, GL_FLOAT, GL_FALSE,
+					sizeof(struct e3d_instance), ptr));
+			E3D(glVertexAttribDivisor(attr, 1));
 		}
 	}
 }
 
 /*
- * This tries to auto-generate normals for the given primitive. Currently only
- * plain triangles are supported.
+ * Issues the draw call of \prim. If \instances is not 0, that many instances
+ * are drawn. The index buffer must already be bound.
  */
-int e3d_primitive_generate_normals(struct e3d_primitive *prim)
+static void draw_call(struct e3d_primitive *prim, size_t instances)
 {
-	size_t i;
-	math_v3 dest, a, b;
-	struct e3d_vbo *n, *v;
-	int ret;
+	size_t off;
+	void *ptr;
+	GLenum type;
+
+	if (!prim->index) {
+		if (instances)
+			E3D(glDrawArraysInstanced(prim->type, 0, prim->num,
+								instances));
+		else
+			glDrawArrays(prim->type, 0, prim->num);
+		return;
+	}
 
-	assert(prim->vertex);
-	assert(prim->vertex->data);
+	type = prim->index->ele_type;
+	off = e3d_tsize[type] * prim->ioff;
+	if (prim->index->id)
+		ptr = (void*)off;
+	else
+		ptr = E3D_OFF(prim->index->data, off);
+
+	if (instances)
+		E3D(glDrawElementsInstanced(prim->type, prim->num, type, ptr,
+								instances));
+	else
+		glDrawElements(prim->type, prim->num, type, ptr);
+}
 
-	if (!e3d_vbo_is_v4(prim->vertex))
-		return -EINVAL;
+static void draw(struct e3d_primitive *prim, int how,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans,
+				struct e3d_vbo *inst, size_t first, size_t num)
+{
+	GLint layout[E3D_A_NUM];
+	GLuint vao;
 
-	ret = e3d_vbo_new_v4(&n, prim->vertex->num);
-	if (ret)
-		return ret;
+	assert(prim->num);
 
-	e3d_primitive_set_normal(prim, 0, n);
-
-	v = prim->vertex;
-	for (i = 0; i < (prim->num - 2); i += 3) {
-		if (prim->index) {
-			math_v3_sub_dest(a,
-				E3D_VBO_AT(v, E3D_VBO_AT_IDX(prim->index, i)),
-				E3D_VBO_AT(v, E3D_VBO_AT_IDX(prim->index, i + 1)));
-			math_v3_sub_dest(b,
-				E3D_VBO_AT(v, E3D_VBO_AT_IDX(prim->index, i)),
-				E3D_VBO_AT(v, E3D_VBO_AT_IDX(prim->index, i + 2)));
-		} else {
-			math_v3_sub_dest(a, E3D_VBO_AT(v, i),
-							E3D_VBO_AT(v, i + 1));
-			math_v3_sub_dest(b, E3D_VBO_AT(v, i),
-							E3D_VBO_AT(v, i + 2));
-		}
-		math_v3_product_dest(dest, a, b);
-		math_v3_normalize(dest);
-
-		/*
-		 * Normals buffer is by default initialized to 0 so we can
-		 * safely copy v3 into v4 buffer.
-		 */
-		if (prim->index) {
-			math_v3_copy(E3D_VBO_AT(n, E3D_VBO_AT_IDX(prim->index, i)), dest);
-			math_v3_copy(E3D_VBO_AT(n, E3D_VBO_AT_IDX(prim->index, i +
-			1)), dest);
-			math_v3_copy(E3D_VBO_AT(n, E3D_VBO_AT_IDX(prim->index, i +
-			2)), dest);
-		} else {
-			math_v3_copy(E3D_VBO_AT(n, i), dest);
-			math_v3_copy(E3D_VBO_AT(n, i + 1), dest);
-			math_v3_copy(E3D_VBO_AT(n, i + 2), dest);
+	setup_uniforms(how, loc, trans);
+	++trans->drawn;
+
+	if (how == E3D_DRAW_NORMALS) {
+		assert(!inst);
+		draw_normals(prim, loc);
+		return;
+	}
+
+	get_layout(layout, prim, how, loc);
+	vao = get_vao(prim, layout);
+
+	if (vao) {
+		E3D(glBindVertexArray(vao));
+
+		/* instance attributes are reset so the cached state is kept */
+		if (inst)
+			bind_instances(loc, inst, first);
+		draw_call(prim, num);
+		if (inst)
+			bind_instances(loc, NULL, 0);
+
+		/* do not let later buffer binds modify the cached state */
+		E3D(glBindVertexArray(0));
+	} else {
+		bind_arrays(prim, layout);
+		if (inst)
+			bind_instances(loc, inst, first);
+		if (prim->index)
+			E3D(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,
+							prim->index->id));
+
+		draw_call(prim, num);
+
+		if (inst)
+			bind_instances(loc, NULL, 0);
+		unbind_arrays(layout);
+	}
+}
+
+/*
+ * Draws \prim with drawer \how. If all buffers are GL buffer objects, the
+ * attribute setup is cached in a vertex array object per attribute layout so
+ * drawing is a single bind and draw call. Otherwise, the attributes are set
+ * up on every call and disabled again afterwards.
+ */
+void e3d_primitive_draw(struct e3d_primitive *prim, int how,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans)
+{
+	draw(prim, how, loc, trans, NULL, 0, 0);
+}
+
+/*
+ * Draws \num instances of \prim with a single draw call. The instances are
+ * read from \inst starting at instance \first. \loc must belong to an
+ * instanced shader. Normals cannot be drawn instanced.
+ */
+void e3d_primitive_draw_instanced(struct e3d_primitive *prim, int how,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans,
+				struct e3d_vbo *inst, size_t first, size_t num)
+{
+	assert(inst);
+	assert(how != E3D_DRAW_NORMALS);
+
+	if (!num)
+		return;
+
+	draw(prim, how, loc, trans, inst, first, num);
+}
+
+static float *vertex_at(struct e3d_primitive *prim, size_t i)
+{
+	struct e3d_vertex *v;
+
+	if (prim->index)
+		i = E3D_VBO_AT_IDX(prim->index, prim->ioff + i);
+
+	if (prim->packed) {
+		v = E3D_VBO_AT(prim->packed, prim->poff + i);
+		return v->position;
+	}
+
+	return E3D_VBO_AT(prim->vertex, prim->voff + i);
+}
+
+/*
+ * Computes the bounding volumes of \prim out of its vertex buffer. Only
+ * vertices that are actually drawn are taken into account. The box is
+ * computed first and the sphere is centered on the box.
+ */
+void e3d_primitive_update_bounds(struct e3d_primitive *prim)
+{
+	struct e3d_bounds *b = &prim->bounds;
+	size_t i, j;
+	float *v, d, r;
+
+	e3d_bounds_clear(b);
+
+	if (!prim->num)
+		return;
+	if (prim->packed ? !prim->packed->data :
+				(!prim->vertex || !prim->vertex->data))
+		return;
+
+	v = vertex_at(prim, 0);
+	math_v3_copy(b->min, v);
+	math_v3_copy(b->max, v);
+
+	for (i = 1; i < prim->num; ++i) {
+		v = vertex_at(prim, i);
+		for (j = 0; j < 3; ++j) {
+			if (v[j] < b->min[j])
+				b->min[j] = v[j];
+			if (v[j] > b->max[j])
+				b->max[j] = v[j];
 		}
 	}
 
-	return 0;
+	for (j = 0; j < 3; ++j)
+		b->center[j] = (b->min[j] + b->max[j]) / 2.0f;
+
+	r = 0.0f;
+	for (i = 0; i < prim->num; ++i) {
+		v = vertex_at(prim, i);
+		d = (v[0] - b->center[0]) * (v[0] - b->center[0]) +
+			(v[1] - b->center[1]) * (v[1] - b->center[1]) +
+			(v[2] - b->center[2]) * (v[2] - b->center[2]);
+		if (d > r)
+			r = d;
+	}
+
+	b->radius = sqrtf(r);
+	b->empty = false;
 }
 
 void e3d_primitive_debug(struct e3d_primitive *prim)
@@ -492,5 +1200,9 @@ void e3d_primitive_debug(struct e3d_primitive *prim)
 						prim, prim->index, prim->ioff);
 	if (prim->index)
 		e3d_vbo_debug(prim->index);
+	ulog_flog(e3d_log, ULOG_DEBUG, "Prim %p packed %p %lu\n",
+						prim, prim->packed, prim->poff);
+	if (prim->packed)
+		e3d_vbo_debug(prim->packed);
 	ulog_flog(e3d_log, ULOG_DEBUG, "End of prim %p debug\n", prim);
 }
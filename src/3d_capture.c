@@ -0,0 +1,438 @@
+/*
+ * airhockey - 3D engine - frame capture
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Frames are read back into a ring of pixel buffer objects. glReadPixels() into
+ * a buffer object returns immediately and each buffer is only mapped when it is
+ * reused PBOS captures later, so the copy has long finished and the pipeline
+ * does not stall. The pixels are copied out of the mapped buffer into a free
+ * frame of the writer thread, which converts and writes them. If the writer
+ * falls behind and no frame is free, the frame is dropped instead of waiting.
+ * Only the render thread uses GL. The frame queue is protected by \lock, the
+ * writer only reads the size after the first frame was queued.
+ * Frames are taken at most \fps times per second of real time so the stream
+ * plays back at the right speed. If rendering is slower, each frame is written
+ * once for every interval that passed since the previous one, and frames that
+ * are dropped add their intervals to the next frame that is written. So the
+ * stream always covers the real time at \fps. Files ending in ".y4m" get a
+ * YUV4MPEG2 stream
+ * with full chroma resolution, all others a sequence of binary PPM images.
+ * The size is taken from the viewport of the first frame, frames with another
+ * viewport size are dropped.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SFML/OpenGL.h>
+
+#include "engine3d.h"
+#include "log.h"
+#include "main.h"
+
+#define PBOS 3
+#define FRAMES 4
+
+enum capture_format {
+	CAPTURE_PPM,
+	CAPTURE_Y4M,
+};
+
+struct e3d_capture {
+	FILE *file;
+	int format;
+	unsigned int fps;
+	int64_t interval;
+	int64_t next;
+
+	GLint x;
+	GLint y;
+	GLint width;
+	GLint height;
+	size_t size;
+
+	GLuint pbo[PBOS];
+	bool pending[PBOS];
+	unsigned int repeat[PBOS];
+	unsigned int lost;
+	size_t cur;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool quit;
+	bool failed;
+	unsigned char *frames[FRAMES];
+	unsigned int copies[FRAMES];
+	size_t head;
+	size_t num;
+	unsigned char *conv;
+
+	uint64_t captured;
+	uint64_t dropped;
+	uint64_t written;
+	int64_t time;
+};
+
+static inline unsigned char clamp_byte(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/*
+ * Converts the bottom-up RGBA \frame into \cap->conv. PPM images are top-down
+ * RGB, YUV4MPEG2 frames are top-down Y, Cb and Cr planes with BT.601 video
+ * range.
+ */
+static size_t convert_frame(struct e3d_capture *cap, const unsigned char *frame)
+{
+	const unsigned char *src;
+	unsigned char *dst, *y, *u, *v;
+	size_t pixels = (size_t)cap->width * cap->height;
+	GLint row, col;
+	int r, g, b;
+
+	dst = cap->conv;
+	y = cap->conv;
+	u = y + pixels;
+	v = u + pixels;
+
+	for (row = cap->height - 1; row >= 0; --row) {
+		src = &frame[(size_t)row * cap->width * 4];
+		for (col = 0; col < cap->width; ++col, src += 4) {
+			if (cap->format == CAPTURE_PPM) {
+				*dst++ = src[0];
+				*dst++ = src[1];
+				*dst++ = src[2];
+				continue;
+			}
+
+			r = src[0];
+			g = src[1];
+			b = src[2];
+			*y++ = clamp_byte(16 +
+				((66 * r + 129 * g + 25 * b + 128) >> 8));
+			*u++ = clamp_byte(128 +
+				((-38 * r - 74 * g + 112 * b + 128) >> 8));
+			*v++ = clamp_byte(128 +
+				((112 * r - 94 * g - 18 * b + 128) >> 8));
+		}
+	}
+
+	return pixels * 3;
+}
+
+static int write_frame(struct e3d_capture *cap, const unsigned char *frame,
+							unsigned int copies)
+{
+	size_t size;
+	unsigned int i;
+	int ret;
+
+	if (!cap->conv) {
+		cap->conv = malloc((size_t)cap->width * cap->height * 3);
+		if (!cap->conv)
+			return -ENOMEM;
+
+		if (cap->format == CAPTURE_Y4M && fprintf(cap->file,
+				"YUV4MPEG2 W%d H%d F%u:1 Ip A1:1 C444\n",
+				cap->width, cap->height, cap->fps) < 0)
+			return -EIO;
+	}
+
+	size = convert_frame(cap, frame);
+
+	for (i = 0; i < copies; ++i) {
+		if (cap->format == CAPTURE_Y4M)
+			ret = fputs("FRAME\n", cap->file);
+		else
+			ret = fprintf(cap->file, "P6\n%d %d\n255\n",
+						cap->width, cap->height);
+		if (ret < 0 || fwrite(cap->conv, size, 1, cap->file) != 1)
+			return -EIO;
+
+		++cap->written;
+	}
+
+	return 0;
+}
+
+static void *writer(void *data)
+{
+	struct e3d_capture *cap = data;
+	size_t idx;
+	bool failed;
+	int ret;
+
+	pthread_mutex_lock(&cap->lock);
+	while (1) {
+		while (!cap->num && !cap->quit)
+			pthread_cond_wait(&cap->cond, &cap->lock);
+		if (!cap->num)
+			break;
+
+		idx = cap->head;
+		failed = cap->failed;
+		pthread_mutex_unlock(&cap->lock);
+
+		/* frames are still consumed after errors so nobody waits */
+		ret = failed ? 0 : write_frame(cap, cap->frames[idx],
+							cap->copies[idx]);
+		if (ret)
+			ulog_flog(e3d_log, ULOG_ERROR,
+				"Capture: Cannot write frame (%d)\n", ret);
+
+		pthread_mutex_lock(&cap->lock);
+		if (ret)
+			cap->failed = true;
+		cap->head = (cap->head + 1) % FRAMES;
+		--cap->num;
+		pthread_cond_broadcast(&cap->cond);
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	return NULL;
+}
+
+/*
+ * Creates a capture that writes to the file \path with \fps frames per second.
+ * The writer thread is started immediately, the buffers are allocated with the
+ * first frame.
+ */
+int e3d_capture_new(struct e3d_capture **out, const char *path,
+							unsigned int fps)
+{
+	struct e3d_capture *cap;
+	size_t len;
+	int ret;
+
+	if (!fps)
+		return -EINVAL;
+
+	cap = malloc(sizeof(*cap));
+	if (!cap)
+		return -ENOMEM;
+
+	memset(cap, 0, sizeof(*cap));
+	cap->fps = fps;
+	cap->interval = 1000000 / fps;
+	cap->next = misc_now();
+
+	len = strlen(path);
+	if (len >= 4 && !strcmp(&path[len - 4], ".y4m"))
+		cap->format = CAPTURE_Y4M;
+	else
+		cap->format = CAPTURE_PPM;
+
+	cap->file = fopen(path, "wb");
+	if (!cap->file) {
+		ret = -errno;
+		ulog_flog(e3d_log, ULOG_ERROR,
+				"Capture: Cannot open %s (%d)\n", path, ret);
+		goto err_cap;
+	}
+
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+
+	ret = -pthread_create(&cap->thread, NULL, writer, cap);
+	if (ret) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+				"Capture: Cannot start writer thread\n");
+		goto err_file;
+	}
+
+	ulog_flog(e3d_log, ULOG_DEBUG, "Capture: Creating capture %p into %s "
+					"at %u fps\n", cap, path, fps);
+	*out = cap;
+	return 0;
+
+err_file:
+	pthread_cond_destroy(&cap->cond);
+	pthread_mutex_destroy(&cap->lock);
+	fclose(cap->file);
+err_cap:
+	free(cap);
+	return ret;
+}
+
+static int setup_buffers(struct e3d_capture *cap, const GLint *view)
+{
+	size_t i;
+
+	cap->x = view[0];
+	cap->y = view[1];
+	cap->width = view[2];
+	cap->height = view[3];
+	cap->size = (size_t)cap->width * cap->height * 4;
+
+	if (!cap->size)
+		return -EINVAL;
+
+	for (i = 0; i < FRAMES; ++i) {
+		cap->frames[i] = malloc(cap->size);
+		if (!cap->frames[i])
+			return -ENOMEM;
+	}
+
+	E3D(glGenBuffers(PBOS, cap->pbo));
+	for (i = 0; i < PBOS; ++i) {
+		E3D(glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbo[i]));
+		E3D(glBufferData(GL_PIXEL_PACK_BUFFER, cap->size, NULL,
+							GL_STREAM_READ));
+	}
+	E3D(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+
+	return 0;
+}
+
+/*
+ * Maps the pixel buffer \idx and queues its pixels for the writer. If \wait is
+ * true, this waits for a free frame instead of dropping the pixels.
+ */
+static void collect(struct e3d_capture *cap, size_t idx, bool wait)
+{
+	void *map;
+	size_t slot;
+	bool queued = false;
+
+	cap->pending[idx] = false;
+
+	E3D(glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbo[idx]));
+	map = E3D(glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+	if (!map)
+		goto out;
+
+	pthread_mutex_lock(&cap->lock);
+	while (wait && cap->num == FRAMES && !cap->failed)
+		pthread_cond_wait(&cap->cond, &cap->lock);
+
+	/* the writer never touches frames that are not queued */
+	if (cap->num < FRAMES) {
+		slot = (cap->head + cap->num) % FRAMES;
+		pthread_mutex_unlock(&cap->lock);
+
+		memcpy(cap->frames[slot], map, cap->size);
+		cap->copies[slot] = cap->repeat[idx] + cap->lost;
+		cap->lost = 0;
+
+		pthread_mutex_lock(&cap->lock);
+		++cap->num;
+		pthread_cond_broadcast(&cap->cond);
+		queued = true;
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	E3D(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+
+out:
+	E3D(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+	if (queued) {
+		++cap->captured;
+	} else {
+		++cap->dropped;
+		cap->lost += cap->repeat[idx];
+	}
+}
+
+/*
+ * Reads back the current frame of the window framebuffer. Call this after the
+ * frame was drawn and before e3d_window_frame().
+ */
+void e3d_capture_frame(struct e3d_capture *cap)
+{
+	GLint view[4];
+	int64_t now;
+	unsigned int repeat;
+	bool failed;
+	int ret;
+
+	now = misc_now();
+	if (now < cap->next)
+		return;
+
+	/* this frame also fills all intervals that were missed */
+	repeat = (now - cap->next) / cap->interval + 1;
+	cap->next += repeat * cap->interval;
+
+	pthread_mutex_lock(&cap->lock);
+	failed = cap->failed;
+	pthread_mutex_unlock(&cap->lock);
+	if (failed)
+		return;
+
+	glGetIntegerv(GL_VIEWPORT, view);
+	if (!cap->size) {
+		ret = setup_buffers(cap, view);
+		if (ret) {
+			ulog_flog(e3d_log, ULOG_ERROR, "Capture: Cannot "
+					"allocate capture buffers (%d)\n", ret);
+			pthread_mutex_lock(&cap->lock);
+			cap->failed = true;
+			pthread_mutex_unlock(&cap->lock);
+			return;
+		}
+	} else if (view[2] != cap->width || view[3] != cap->height) {
+		++cap->dropped;
+		cap->lost += repeat;
+		return;
+	}
+
+	if (cap->pending[cap->cur])
+		collect(cap, cap->cur, false);
+
+	E3D(glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbo[cap->cur]));
+	glReadPixels(cap->x, cap->y, cap->width, cap->height, GL_RGBA,
+						GL_UNSIGNED_BYTE, NULL);
+	E3D(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+
+	cap->pending[cap->cur] = true;
+	cap->repeat[cap->cur] = repeat;
+	cap->cur = (cap->cur + 1) % PBOS;
+	cap->time += misc_now() - now;
+}
+
+/*
+ * Writes the frames that are still in flight, stops the writer and frees
+ * \cap. The GL context of the captured frames must still be active.
+ */
+void e3d_capture_free(struct e3d_capture *cap)
+{
+	size_t i, idx;
+
+	for (i = 0; i < PBOS; ++i) {
+		idx = (cap->cur + i) % PBOS;
+		if (cap->pending[idx])
+			collect(cap, idx, true);
+	}
+
+	pthread_mutex_lock(&cap->lock);
+	cap->quit = true;
+	pthread_cond_broadcast(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->thread, NULL);
+
+	ulog_flog(e3d_log, ULOG_DEBUG, "Capture: Destroying capture %p "
+		"(written %lu dropped %lu, %ld us per frame)\n", cap,
+		cap->written, cap->dropped, cap->captured ?
+				(long)(cap->time / cap->captured) : 0L);
+
+	if (cap->size)
+		E3D(glDeleteBuffers(PBOS, cap->pbo));
+	for (i = 0; i < FRAMES; ++i)
+		free(cap->frames[i]);
+	free(cap->conv);
+
+	fclose(cap->file);
+	pthread_cond_destroy(&cap->cond);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap);
+}
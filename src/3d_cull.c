@@ -0,0 +1,236 @@
+/*
+ * airhockey - 3D engine - bounding volumes and culling
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine3d.h"
+#include "log.h"
+#include "mathw.h"
+
+void e3d_bounds_clear(struct e3d_bounds *bounds)
+{
+	memset(bounds, 0, sizeof(*bounds));
+	bounds->empty = true;
+}
+
+static void transform_point(math_v3 dest, math_m4 m, const math_v3 v)
+{
+	size_t i;
+
+	for (i = 0; i < 3; ++i)
+		dest[i] = m[0][i] * v[0] + m[1][i] * v[1] + m[2][i] * v[2] +
+								m[3][i];
+}
+
+/* returns the largest scale factor of the axes of \m */
+static float max_scale(math_m4 m)
+{
+	float s, r = 0.0f;
+	size_t i;
+
+	for (i = 0; i < 3; ++i) {
+		s = m[i][0] * m[i][0] + m[i][1] * m[i][1] + m[i][2] * m[i][2];
+		if (s > r)
+			r = s;
+	}
+
+	return sqrtf(r);
+}
+
+/*
+ * Transforms the box of \bounds by \m and stores the center and half extents of
+ * the axis aligned box that contains the result in \center and \ext.
+ */
+static void transform_box(math_v3 center, math_v3 ext, math_m4 m,
+					const struct e3d_bounds *bounds)
+{
+	math_v3 c, e;
+	size_t i;
+
+	for (i = 0; i < 3; ++i) {
+		c[i] = (bounds->min[i] + bounds->max[i]) / 2.0f;
+		e[i] = (bounds->max[i] - bounds->min[i]) / 2.0f;
+	}
+
+	transform_point(center, m, c);
+
+	for (i = 0; i < 3; ++i)
+		ext[i] = fabsf(m[0][i]) * e[0] + fabsf(m[1][i]) * e[1] +
+							fabsf(m[2][i]) * e[2];
+}
+
+static void merge_sphere(struct e3d_bounds *dest, const math_v3 center,
+								float radius)
+{
+	math_v3 d;
+	float dist, r;
+	size_t i;
+
+	for (i = 0; i < 3; ++i)
+		d[i] = center[i] - dest->center[i];
+	dist = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+
+	if (dist + radius <= dest->radius)
+		return;
+
+	if (dist + dest->radius <= radius) {
+		math_v3_copy(dest->center, (void*)center);
+		dest->radius = radius;
+		return;
+	}
+
+	r = (dist + dest->radius + radius) / 2.0f;
+	for (i = 0; i < 3; ++i)
+		dest->center[i] += d[i] * (r - dest->radius) / dist;
+	dest->radius = r;
+}
+
+/*
+ * Merges \src transformed by \m into \dest. If \m is NULL, no transformation
+ * is applied.
+ */
+void e3d_bounds_merge(struct e3d_bounds *dest, const struct e3d_bounds *src,
+								math_m4 m)
+{
+	math_v3 center, ext, min, max;
+	float radius;
+	size_t i;
+
+	if (src->empty)
+		return;
+
+	if (m) {
+		transform_box(center, ext, m, src);
+		for (i = 0; i < 3; ++i) {
+			min[i] = center[i] - ext[i];
+			max[i] = center[i] + ext[i];
+		}
+		transform_point(center, m, src->center);
+		radius = src->radius * max_scale(m);
+	} else {
+		math_v3_copy(min, (void*)src->min);
+		math_v3_copy(max, (void*)src->max);
+		math_v3_copy(center, (void*)src->center);
+		radius = src->radius;
+	}
+
+	if (dest->empty) {
+		math_v3_copy(dest->min, min);
+		math_v3_copy(dest->max, max);
+		math_v3_copy(dest->center, center);
+		dest->radius = radius;
+		dest->empty = false;
+		return;
+	}
+
+	for (i = 0; i < 3; ++i) {
+		if (min[i] < dest->min[i])
+			dest->min[i] = min[i];
+		if (max[i] > dest->max[i])
+			dest->max[i] = max[i];
+	}
+
+	merge_sphere(dest, center, radius);
+}
+
+/*
+ * Extracts the six clipping planes of the view frustum out of the combined
+ * projection and eye matrix \m. The planes point inwards and are normalized.
+ */
+void e3d_frustum_extract(struct e3d_frustum *frustum, math_m4 m)
+{
+	size_t i, j;
+	float len;
+
+	for (i = 0; i < 3; ++i) {
+		for (j = 0; j < 4; ++j) {
+			frustum->planes[i * 2][j] = m[j][3] + m[j][i];
+			frustum->planes[i * 2 + 1][j] = m[j][3] - m[j][i];
+		}
+	}
+
+	for (i = 0; i < 6; ++i) {
+		len = sqrtf(frustum->planes[i][0] * frustum->planes[i][0] +
+				frustum->planes[i][1] * frustum->planes[i][1] +
+				frustum->planes[i][2] * frustum->planes[i][2]);
+		for (j = 0; j < 4; ++j)
+			frustum->planes[i][j] /= len;
+	}
+}
+
+static inline float plane_dist(const math_v4 plane, const math_v3 v)
+{
+	return plane[0] * v[0] + plane[1] * v[1] + plane[2] * v[2] + plane[3];
+}
+
+/*
+ * Returns true if \bounds transformed by \m into world space is at least
+ * partially inside of the frustum. The sphere is tested first as it is cheaper
+ * and the box is only tested if the sphere intersects the frustum.
+ */
+bool e3d_frustum_test(const struct e3d_frustum *frustum,
+				const struct e3d_bounds *bounds, math_m4 m)
+{
+	math_v3 center, ext;
+	float radius;
+	size_t i;
+	const float *p;
+
+	if (bounds->empty)
+		return true;
+
+	transform_point(center, m, bounds->center);
+	radius = bounds->radius * max_scale(m);
+
+	for (i = 0; i < 6; ++i)
+		if (plane_dist(frustum->planes[i], center) < -radius)
+			return false;
+
+	transform_box(center, ext, m, bounds);
+
+	for (i = 0; i < 6; ++i) {
+		p = frustum->planes[i];
+		radius = fabsf(p[0]) * ext[0] + fabsf(p[1]) * ext[1] +
+							fabsf(p[2]) * ext[2];
+		if (plane_dist(p, center) < -radius)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns the radius of \bounds transformed by the current modelview matrix of
+ * \transform on the screen relative to half the viewport height. Bounds that
+ * are empty or contain the eye are infinitely large.
+ */
+float e3d_transform_size(struct e3d_transform *transform,
+					const struct e3d_bounds *bounds)
+{
+	math_m4 m;
+	math_v3 center;
+	float radius, depth;
+
+	if (bounds->empty)
+		return FLT_MAX;
+
+	math_m4_mult_dest(m, MATH_TIP(&transform->eye_stack),
+					MATH_TIP(&transform->mod_stack));
+	transform_point(center, m, bounds->center);
+	radius = bounds->radius * max_scale(m);
+
+	/* the eye looks along the negative z axis */
+	depth = -center[2];
+	if (depth <= radius)
+		return FLT_MAX;
+
+	return radius * MATH_TIP(&transform->proj_stack)[1][1] / depth;
+}
@@ -0,0 +1,271 @@
+/*
+ * airhockey - 3D engine - headless GL context handling
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * This implements the window API without a display. The GL context renders
+ * into an EGL pbuffer surface so there is a default framebuffer just like with
+ * a window. The Mesa surfaceless platform is preferred as it needs no display
+ * server at all, otherwise the default EGL display is used.
+ * The size of the surface is read from E3D_HEADLESS_SIZE ("<width>x<height>").
+ * If E3D_HEADLESS_FRAMES is set, the window is closed after that many frames.
+ * There are no input events and no key is ever pressed.
+ * Build with "make HEADLESS=1" to use this instead of the SFML window.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <SFML/OpenGL.h>
+
+#include "engine3d.h"
+#include "log.h"
+#include "main.h"
+#include "mathw.h"
+
+struct e3d_window {
+	EGLDisplay dpy;
+	EGLSurface surface;
+	EGLContext ctx;
+	unsigned int width;
+	unsigned int height;
+	uint64_t max_frames;
+
+	uint64_t frames;
+	int64_t last_frame;
+
+	int64_t fps_secs;
+	uint64_t fps_count;
+};
+
+static const EGLint config_attrs[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+	EGL_RED_SIZE, 8,
+	EGL_GREEN_SIZE, 8,
+	EGL_BLUE_SIZE, 8,
+	EGL_ALPHA_SIZE, 8,
+	EGL_DEPTH_SIZE, 24,
+	EGL_STENCIL_SIZE, 8,
+	EGL_NONE
+};
+
+static void load_config(struct e3d_window *wnd)
+{
+	const char *val;
+	unsigned int width, height;
+
+	wnd->width = 200;
+	wnd->height = 200;
+	wnd->max_frames = 0;
+
+	val = getenv("E3D_HEADLESS_SIZE");
+	if (val) {
+		if (sscanf(val, "%ux%u", &width, &height) == 2 && width &&
+								height) {
+			wnd->width = width;
+			wnd->height = height;
+		} else {
+			ulog_flog(e3d_log, ULOG_WARN,
+				"Window: Invalid headless size %s\n", val);
+		}
+	}
+
+	val = getenv("E3D_HEADLESS_FRAMES");
+	if (val)
+		wnd->max_frames = strtoull(val, NULL, 10);
+}
+
+static EGLDisplay get_display()
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+	const char *exts;
+	EGLDisplay dpy = EGL_NO_DISPLAY;
+
+	exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+				eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+	if (exts && strstr(exts, "EGL_MESA_platform_surfaceless") &&
+							get_platform_display)
+		dpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+						EGL_DEFAULT_DISPLAY, NULL);
+
+	if (dpy == EGL_NO_DISPLAY)
+		dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	return dpy;
+}
+
+static void setup_viewport(struct e3d_window *wnd)
+{
+	glViewport(0, 0, wnd->width, wnd->height);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	gluPerspective(52.0f, (float)wnd->width / wnd->height, 1.0f, 100.0f);
+}
+
+struct e3d_window *e3d_window_new()
+{
+	struct e3d_window *wnd;
+	EGLConfig config;
+	EGLint num, surface_attrs[5];
+
+	wnd = malloc(sizeof(*wnd));
+	if (!wnd) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+					"Window: Cannot allocate memory\n");
+		return NULL;
+	}
+
+	memset(wnd, 0, sizeof(*wnd));
+	wnd->last_frame = misc_now();
+	load_config(wnd);
+
+	wnd->dpy = get_display();
+	if (wnd->dpy == EGL_NO_DISPLAY) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+					"Window: Cannot get EGL display\n");
+		goto err_wnd;
+	}
+
+	if (!eglInitialize(wnd->dpy, NULL, NULL)) {
+		ulog_flog(e3d_log, ULOG_ERROR, "Window: Cannot initialize EGL "
+						"(0x%x)\n", eglGetError());
+		goto err_wnd;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+					"Window: Cannot bind OpenGL API\n");
+		goto err_dpy;
+	}
+
+	if (!eglChooseConfig(wnd->dpy, config_attrs, &config, 1, &num) ||
+								num < 1) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+				"Window: Cannot find EGL pbuffer config\n");
+		goto err_dpy;
+	}
+
+	surface_attrs[0] = EGL_WIDTH;
+	surface_attrs[1] = wnd->width;
+	surface_attrs[2] = EGL_HEIGHT;
+	surface_attrs[3] = wnd->height;
+	surface_attrs[4] = EGL_NONE;
+
+	wnd->surface = eglCreatePbufferSurface(wnd->dpy, config,
+								surface_attrs);
+	if (wnd->surface == EGL_NO_SURFACE) {
+		ulog_flog(e3d_log, ULOG_ERROR, "Window: Cannot create pbuffer "
+						"(0x%x)\n", eglGetError());
+		goto err_dpy;
+	}
+
+	wnd->ctx = eglCreateContext(wnd->dpy, config, EGL_NO_CONTEXT, NULL);
+	if (wnd->ctx == EGL_NO_CONTEXT) {
+		ulog_flog(e3d_log, ULOG_ERROR, "Window: Cannot create context "
+						"(0x%x)\n", eglGetError());
+		goto err_surface;
+	}
+
+	if (!eglMakeCurrent(wnd->dpy, wnd->surface, wnd->surface, wnd->ctx)) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+					"Window: Cannot activate window\n");
+		goto err_ctx;
+	}
+
+	ulog_flog(e3d_log, ULOG_DEBUG, "Window: Creating headless window %p "
+		"(%ux%u, %s)\n", wnd, wnd->width, wnd->height,
+					(const char*)glGetString(GL_RENDERER));
+	e3d_state_reset();
+
+	setup_viewport(wnd);
+	glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	return wnd;
+
+err_ctx:
+	eglDestroyContext(wnd->dpy, wnd->ctx);
+err_surface:
+	eglDestroySurface(wnd->dpy, wnd->surface);
+err_dpy:
+	eglTerminate(wnd->dpy);
+err_wnd:
+	free(wnd);
+	return NULL;
+}
+
+void e3d_window_free(struct e3d_window *wnd)
+{
+	ulog_flog(e3d_log, ULOG_DEBUG, "Window: Destroying window %p "
+					"(frames %lu)\n", wnd, wnd->frames);
+	eglMakeCurrent(wnd->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+							EGL_NO_CONTEXT);
+	eglDestroyContext(wnd->dpy, wnd->ctx);
+	eglDestroySurface(wnd->dpy, wnd->surface);
+	eglTerminate(wnd->dpy);
+	free(wnd);
+}
+
+void e3d_window_activate(struct e3d_window *wnd)
+{
+	eglMakeCurrent(wnd->dpy, wnd->surface, wnd->surface, wnd->ctx);
+	e3d_state_reset();
+}
+
+/*
+ * There are no events. Returns 0 after the configured number of frames and
+ * -EAGAIN otherwise.
+ */
+int e3d_window_poll(struct e3d_window *wnd, struct e3d_event *out)
+{
+	if (wnd->max_frames && wnd->frames >= wnd->max_frames)
+		return 0;
+
+	return -EAGAIN;
+}
+
+int64_t e3d_window_elapsed(struct e3d_window *wnd)
+{
+	return misc_now() - wnd->last_frame;
+}
+
+void e3d_window_frame(struct e3d_window *wnd)
+{
+	int64_t now;
+
+	eglSwapBuffers(wnd->dpy, wnd->surface);
+
+	now = misc_now();
+	wnd->fps_secs += now - wnd->last_frame;
+	wnd->fps_count++;
+	wnd->frames++;
+
+	if (wnd->fps_secs > 1000000) {
+		ulog_flog(e3d_log, ULOG_DEBUG, "Window: fps %lu frames %lu\n",
+						wnd->fps_count, wnd->frames);
+		wnd->fps_count = 0;
+		wnd->fps_secs -= 1000000;
+	}
+
+	wnd->last_frame = misc_now();
+}
+
+void e3d_window_projection(const struct e3d_window *wnd, math_m4 m)
+{
+	glGetFloatv(GL_PROJECTION_MATRIX, (GLfloat*)m);
+}
+
+bool e3d_window_get_key(const struct e3d_window *wnd, unsigned int key)
+{
+	return false;
+}
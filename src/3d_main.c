@@ -45,11 +45,42 @@ struct e3d_functions e3d_gl = {
 	.glEnableVertexAttribArray = glEnableVertexAttribArray,
 	.glVertexAttribPointer = glVertexAttribPointer,
 	.glDisableVertexAttribArray = glDisableVertexAttribArray,
+	.glGenVertexArrays = glGenVertexArrays,
+	.glBindVertexArray = glBindVertexArray,
+	.glDeleteVertexArrays = glDeleteVertexArrays,
+	.glVertexAttribDivisor = glVertexAttribDivisor,
+	.glDrawArraysInstanced = glDrawArraysInstanced,
+	.glDrawElementsInstanced = glDrawElementsInstanced,
+	.glEnable = glEnable,
+	.glDisable = glDisable,
+	.glPolygonMode = glPolygonMode,
+	.glDepthFunc = glDepthFunc,
+	.glCullFace = glCullFace,
+	.glLineWidth = glLineWidth,
+	.glGenFramebuffers = glGenFramebuffers,
+	.glBindFramebuffer = glBindFramebuffer,
+	.glDeleteFramebuffers = glDeleteFramebuffers,
+	.glFramebufferTexture2D = glFramebufferTexture2D,
+	.glCheckFramebufferStatus = glCheckFramebufferStatus,
+	.glDrawBuffers = glDrawBuffers,
+	.glActiveTexture = glActiveTexture,
+	.glGetProgramBinary = glGetProgramBinary,
+	.glProgramBinary = glProgramBinary,
+	.glProgramParameteri = glProgramParameteri,
+	.glMapBuffer = glMapBuffer,
+	.glUnmapBuffer = glUnmapBuffer,
+	.glGenQueries = glGenQueries,
+	.glDeleteQueries = glDeleteQueries,
+	.glBeginQuery = glBeginQuery,
+	.glEndQuery = glEndQuery,
+	.glGetQueryObjectiv = glGetQueryObjectiv,
+	.glGetQueryObjectui64v = glGetQueryObjectui64v,
 };
 
 void e3d_init(struct ulog_dev *log)
 {
 	e3d_log = ulog_ref(log);
+	e3d_state_init();
 }
 
 void e3d_destroy()
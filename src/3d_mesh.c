@@ -0,0 +1,701 @@
+/*
+ * airhockey - 3D engine - mesh optimization
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Vertex welding
+ * Welding merges all corners of a primitive that have equal vertex, color and
+ * normal data into a single vertex and builds an index buffer that references
+ * the merged vertices. Duplicates are found with an open addressing hash table
+ * over the attribute data so this runs in linear time.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine3d.h"
+#include "log.h"
+#include "mathw.h"
+
+/* vertex, color and normal */
+#define KEY_SIZE 12
+
+struct weld {
+	struct e3d_primitive *prim;
+	size_t *slots;
+	size_t mask;
+	size_t *first;
+	size_t num;
+};
+
+static inline size_t source(struct e3d_primitive *prim, size_t i)
+{
+	if (prim->index)
+		return e3d_vbo_get_idx(prim->index, prim->ioff + i);
+	return i;
+}
+
+/*
+ * Loads all attributes of source vertex \s into \key. Adding zero turns
+ * negative zeros into positive ones so they compare and hash equal.
+ */
+static void load_key(struct e3d_primitive *prim, size_t s, float *key)
+{
+	const float *v, *c, *n;
+	size_t i;
+
+	v = E3D_VBO_AT(prim->vertex, prim->voff + s);
+	c = E3D_VBO_AT(prim->color, prim->coff + s);
+	n = E3D_VBO_AT(prim->normal, prim->noff + s);
+
+	for (i = 0; i < 4; ++i) {
+		key[i] = v[i] + 0.0f;
+		key[i + 4] = c[i] + 0.0f;
+		key[i + 8] = n[i] + 0.0f;
+	}
+}
+
+static bool equal(const float *a, const float *b)
+{
+	size_t i;
+
+	for (i = 0; i < KEY_SIZE; ++i)
+		if (a[i] != b[i])
+			return false;
+
+	return true;
+}
+
+static uint32_t hash(const float *key)
+{
+	uint32_t h = 2166136261u, w;
+	size_t i;
+
+	for (i = 0; i < KEY_SIZE; ++i) {
+		memcpy(&w, &key[i], sizeof(w));
+		h ^= w;
+		h *= 16777619;
+	}
+
+	return h ^ (h >> 15);
+}
+
+/*
+ * Returns the merged vertex for source vertex \s and adds a new one if no equal
+ * vertex was found.
+ */
+static size_t lookup(struct weld *w, size_t s)
+{
+	size_t i, id;
+	float key[KEY_SIZE], other[KEY_SIZE];
+
+	load_key(w->prim, s, key);
+
+	i = hash(key) & w->mask;
+	while (w->slots[i]) {
+		id = w->slots[i] - 1;
+		load_key(w->prim, w->first[id], other);
+		if (equal(key, other))
+			return id;
+		i = (i + 1) & w->mask;
+	}
+
+	id = w->num++;
+	w->first[id] = s;
+	w->slots[i] = id + 1;
+	return id;
+}
+
+static int copy_v4(struct e3d_vbo **out, struct e3d_vbo *src, size_t off,
+					const size_t *first, size_t num)
+{
+	struct e3d_vbo *vbo;
+	size_t i;
+	int ret;
+
+	ret = e3d_vbo_new_v4(&vbo, num);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < num; ++i)
+		math_v4_copy(E3D_VBO_AT(vbo, i),
+					E3D_VBO_AT(src, off + first[i]));
+
+	*out = vbo;
+	return 0;
+}
+
+/*
+ * Replaces the buffers of \prim with new buffers of \vnum vertices. New vertex
+ * \i is a copy of old vertex \first[i] and corner \i of the new index buffer
+ * references new vertex \remap[i].
+ */
+static int rebuild(struct e3d_primitive *prim, const size_t *first,
+					size_t vnum, const size_t *remap)
+{
+	struct e3d_vbo *vertex, *color, *normal, *index;
+	size_t i;
+	int ret;
+
+	ret = copy_v4(&vertex, prim->vertex, prim->voff, first, vnum);
+	if (ret)
+		return ret;
+	ret = copy_v4(&color, prim->color, prim->coff, first, vnum);
+	if (ret)
+		goto err_vertex;
+	ret = copy_v4(&normal, prim->normal, prim->noff, first, vnum);
+	if (ret)
+		goto err_color;
+	ret = e3d_vbo_new_idx_type(&index, e3d_idx_type(vnum), prim->num);
+	if (ret)
+		goto err_normal;
+
+	for (i = 0; i < prim->num; ++i)
+		e3d_vbo_set_idx(index, i, remap[i]);
+
+	e3d_primitive_set_vertex(prim, 0, vertex);
+	e3d_primitive_set_color(prim, 0, color);
+	e3d_primitive_set_normal(prim, 0, normal);
+	e3d_primitive_set_index(prim, 0, index);
+	e3d_vbo_unref(index);
+
+err_normal:
+	e3d_vbo_unref(normal);
+err_color:
+	e3d_vbo_unref(color);
+err_vertex:
+	e3d_vbo_unref(vertex);
+	return ret;
+}
+
+/*
+ * Welds all equal vertices of \prim. The vertex, color and normal buffers must
+ * be set and have client memory. \prim may already be indexed. Afterwards,
+ * \prim uses new buffers that contain each vertex only once and a new index
+ * buffer with the narrowest index type that can address all vertices.
+ */
+int e3d_primitive_weld(struct e3d_primitive *prim)
+{
+	struct weld w;
+	size_t i, size, *remap;
+	int ret = -ENOMEM;
+
+	assert(prim->vertex && prim->vertex->data);
+	assert(prim->color && prim->color->data);
+	assert(prim->normal && prim->normal->data);
+
+	if (!prim->num)
+		return -EINVAL;
+
+	size = 1;
+	while (size < prim->num * 2)
+		size <<= 1;
+
+	memset(&w, 0, sizeof(w));
+	w.prim = prim;
+	w.mask = size - 1;
+	w.slots = calloc(size, sizeof(*w.slots));
+	w.first = malloc(sizeof(*w.first) * prim->num);
+	remap = malloc(sizeof(*remap) * prim->num);
+	if (!w.slots || !w.first || !remap)
+		goto err;
+
+	for (i = 0; i < prim->num; ++i)
+		remap[i] = lookup(&w, source(prim, i));
+
+	ret = rebuild(prim, w.first, w.num, remap);
+	if (ret)
+		goto err;
+
+	ulog_flog(e3d_log, ULOG_DEBUG, "Weld: %lu corners to %lu vertices "
+				"(%lu byte indices)\n", prim->num, w.num,
+					e3d_tsize[prim->index->ele_type]);
+
+err:
+	free(remap);
+	free(w.first);
+	free(w.slots);
+	return ret;
+}
+
+/*
+ * Triangle order optimization
+ * Triangles are reordered for the post-transform vertex cache with Tom
+ * Forsyth's linear-speed algorithm. It greedily emits the triangle with the
+ * best score where vertices score high if they are in a simulated LRU cache and
+ * have few triangles left.
+ * The result is split into clusters at triangles that miss the cache with all
+ * corners. Such cuts do not hurt cache efficiency so the clusters can be
+ * sorted freely to reduce overdraw: clusters that face away from the center of
+ * the mesh are likely to occlude the others and are drawn first. The cluster
+ * order is dropped if it loses more than OVERDRAW_THRESHOLD of cache
+ * efficiency.
+ * At last, vertices are renumbered in order of first use so vertex fetches are
+ * sequential.
+ * Efficiency is measured as average cache miss ratio (ACMR), that is, the
+ * number of vertex shader invocations per triangle with a FIFO cache of
+ * FIFO_SIZE entries which is common for current hardware.
+ */
+
+#define CACHE_SIZE 32
+#define FIFO_SIZE 16
+#define OVERDRAW_THRESHOLD 1.05f
+#define CLUSTER_MIN 16
+
+struct fifo {
+	size_t *stamp;
+	size_t time;
+};
+
+static int fifo_init(struct fifo *fifo, size_t vnum)
+{
+	fifo->stamp = calloc(vnum, sizeof(*fifo->stamp));
+	if (!fifo->stamp)
+		return -ENOMEM;
+
+	fifo->time = FIFO_SIZE + 1;
+	return 0;
+}
+
+/* all entries are older than the cache size afterwards */
+static void fifo_flush(struct fifo *fifo)
+{
+	fifo->time += FIFO_SIZE + 1;
+}
+
+/* returns the number of cache misses of triangle \tri */
+static size_t fifo_tri(struct fifo *fifo, const size_t *tri)
+{
+	size_t i, misses = 0;
+
+	for (i = 0; i < 3; ++i) {
+		if (fifo->time - fifo->stamp[tri[i]] > FIFO_SIZE) {
+			fifo->stamp[tri[i]] = fifo->time++;
+			++misses;
+		}
+	}
+
+	return misses;
+}
+
+static float acmr(struct fifo *fifo, const size_t *idx, size_t tnum)
+{
+	size_t i, misses = 0;
+
+	fifo_flush(fifo);
+	for (i = 0; i < tnum; ++i)
+		misses += fifo_tri(fifo, &idx[i * 3]);
+
+	return (float)misses / tnum;
+}
+
+struct forsyth {
+	const size_t *idx;
+	size_t tnum;
+	size_t *adj_off;
+	size_t *adj;
+	size_t *valence;
+	int *pos;
+	float *vscore;
+	float *tscore;
+	bool *done;
+};
+
+static float vertex_score(int pos, size_t valence)
+{
+	float s;
+
+	if (!valence)
+		return -1.0f;
+
+	if (pos < 0)
+		s = 0.0f;
+	else if (pos < 3)
+		s = 0.75f;
+	else
+		s = powf(1.0f - (pos - 3) / (float)(CACHE_SIZE - 3), 1.5f);
+
+	return s + 2.0f / sqrtf(valence);
+}
+
+static float tri_score(struct forsyth *f, size_t t)
+{
+	const size_t *tri = &f->idx[t * 3];
+
+	return f->vscore[tri[0]] + f->vscore[tri[1]] + f->vscore[tri[2]];
+}
+
+/* removes triangle \t from the remaining triangles of vertex \v */
+static void remove_adj(struct forsyth *f, size_t v, size_t t)
+{
+	size_t i, *list = &f->adj[f->adj_off[v]];
+
+	for (i = 0; i < f->valence[v]; ++i) {
+		if (list[i] == t) {
+			list[i] = list[--f->valence[v]];
+			return;
+		}
+	}
+}
+
+static int forsyth_init(struct forsyth *f, const size_t *idx, size_t tnum,
+								size_t vnum)
+{
+	size_t i, t, v;
+
+	memset(f, 0, sizeof(*f));
+	f->idx = idx;
+	f->tnum = tnum;
+	f->adj_off = calloc(vnum + 1, sizeof(*f->adj_off));
+	f->adj = malloc(tnum * 3 * sizeof(*f->adj));
+	f->valence = calloc(vnum, sizeof(*f->valence));
+	f->pos = malloc(vnum * sizeof(*f->pos));
+	f->vscore = malloc(vnum * sizeof(*f->vscore));
+	f->tscore = malloc(tnum * sizeof(*f->tscore));
+	f->done = calloc(tnum, sizeof(*f->done));
+	if (!f->adj_off || !f->adj || !f->valence || !f->pos || !f->vscore ||
+						!f->tscore || !f->done)
+		return -ENOMEM;
+
+	for (i = 0; i < tnum * 3; ++i)
+		++f->adj_off[idx[i] + 1];
+	for (v = 0; v < vnum; ++v)
+		f->adj_off[v + 1] += f->adj_off[v];
+	for (i = 0; i < tnum * 3; ++i) {
+		v = idx[i];
+		f->adj[f->adj_off[v] + f->valence[v]++] = i / 3;
+	}
+
+	for (v = 0; v < vnum; ++v) {
+		f->pos[v] = -1;
+		f->vscore[v] = vertex_score(-1, f->valence[v]);
+	}
+	for (t = 0; t < tnum; ++t)
+		f->tscore[t] = tri_score(f, t);
+
+	return 0;
+}
+
+static void forsyth_destroy(struct forsyth *f)
+{
+	free(f->done);
+	free(f->tscore);
+	free(f->vscore);
+	free(f->pos);
+	free(f->valence);
+	free(f->adj);
+	free(f->adj_off);
+}
+
+/* writes the triangles of \f in cache optimized order into \out */
+static void forsyth_run(struct forsyth *f, size_t *out)
+{
+	size_t cache[CACHE_SIZE + 3], next[CACHE_SIZE + 3];
+	size_t cnum = 0, nnum, i, j, k, t, v, best, cursor = 0;
+	const size_t *tri;
+	float score, best_score;
+
+	best = 0;
+	for (t = 1; t < f->tnum; ++t)
+		if (f->tscore[t] > f->tscore[best])
+			best = t;
+
+	for (k = 0; k < f->tnum; ++k) {
+		if (best == (size_t)-1) {
+			while (f->done[cursor])
+				++cursor;
+			best = cursor;
+		}
+
+		tri = &f->idx[best * 3];
+		memcpy(&out[k * 3], tri, sizeof(*tri) * 3);
+		f->done[best] = true;
+
+		/* put the corners in front of the cache */
+		nnum = 0;
+		for (i = 0; i < 3; ++i) {
+			remove_adj(f, tri[i], best);
+			for (j = 0; j < nnum; ++j)
+				if (next[j] == tri[i])
+					break;
+			if (j == nnum)
+				next[nnum++] = tri[i];
+		}
+		for (i = 0; i < cnum; ++i)
+			if (cache[i] != tri[0] && cache[i] != tri[1] &&
+							cache[i] != tri[2])
+				next[nnum++] = cache[i];
+
+		for (i = 0; i < nnum; ++i) {
+			v = next[i];
+			f->pos[v] = (i < CACHE_SIZE) ? (int)i : -1;
+			f->vscore[v] = vertex_score(f->pos[v], f->valence[v]);
+		}
+
+		/* rescore affected triangles and pick the best one */
+		best = -1;
+		best_score = -1.0f;
+		for (i = 0; i < nnum; ++i) {
+			v = next[i];
+			for (j = 0; j < f->valence[v]; ++j) {
+				t = f->adj[f->adj_off[v] + j];
+				score = tri_score(f, t);
+				f->tscore[t] = score;
+				if (score > best_score) {
+					best_score = score;
+					best = t;
+				}
+			}
+		}
+
+		cnum = (nnum < CACHE_SIZE) ? nnum : CACHE_SIZE;
+		memcpy(cache, next, sizeof(*cache) * cnum);
+	}
+}
+
+struct cluster {
+	size_t start;
+	size_t num;
+	float key;
+};
+
+static int cluster_cmp(const void *a, const void *b)
+{
+	const struct cluster *ca = a, *cb = b;
+
+	if (ca->key > cb->key)
+		return -1;
+	if (ca->key < cb->key)
+		return 1;
+	return (ca->start < cb->start) ? -1 : 1;
+}
+
+/*
+ * Computes the area weighted centroid of \num triangles of \idx into \c and
+ * returns the area weighted normal in \n. Both are scaled by the total area.
+ */
+static void tri_moments(struct e3d_primitive *prim, const size_t *idx,
+					size_t num, math_v3 c, math_v3 n, float *area)
+{
+	const float *a, *b, *d;
+	math_v3 e1, e2, x;
+	size_t t, i;
+	float ar;
+
+	memset(c, 0, sizeof(math_v3));
+	memset(n, 0, sizeof(math_v3));
+	*area = 0.0f;
+
+	for (t = 0; t < num; ++t) {
+		a = E3D_VBO_AT(prim->vertex, prim->voff + idx[t * 3]);
+		b = E3D_VBO_AT(prim->vertex, prim->voff + idx[t * 3 + 1]);
+		d = E3D_VBO_AT(prim->vertex, prim->voff + idx[t * 3 + 2]);
+
+		for (i = 0; i < 3; ++i) {
+			e1[i] = b[i] - a[i];
+			e2[i] = d[i] - a[i];
+		}
+		x[0] = e1[1] * e2[2] - e1[2] * e2[1];
+		x[1] = e1[2] * e2[0] - e1[0] * e2[2];
+		x[2] = e1[0] * e2[1] - e1[1] * e2[0];
+		ar = sqrtf(x[0] * x[0] + x[1] * x[1] + x[2] * x[2]);
+
+		for (i = 0; i < 3; ++i) {
+			c[i] += (a[i] + b[i] + d[i]) / 3.0f * ar;
+			n[i] += x[i];
+		}
+		*area += ar;
+	}
+}
+
+/*
+ * Splits \idx into clusters and writes them sorted for overdraw into \out.
+ * Hard boundaries are triangles that miss the cache with all corners. Hard
+ * clusters are split further wherever the cluster so far, started with a cold
+ * cache, is within OVERDRAW_THRESHOLD of the cache efficiency of the whole
+ * hard cluster.
+ * Returns the number of clusters or 0 on allocation failure.
+ */
+static size_t sort_clusters(struct e3d_primitive *prim, struct fifo *fifo,
+			const size_t *idx, size_t tnum, size_t *out)
+{
+	struct cluster *cl, *hard;
+	size_t t, h, start, end, num, hnum, i, misses;
+	math_v3 mc, c, n;
+	float area, len, limit;
+
+	cl = malloc(sizeof(*cl) * tnum * 2);
+	if (!cl)
+		return 0;
+	hard = &cl[tnum];
+
+	hnum = 0;
+	fifo_flush(fifo);
+	for (t = 0; t < tnum; ++t) {
+		if (fifo_tri(fifo, &idx[t * 3]) == 3 || !t) {
+			hard[hnum].start = t;
+			hard[hnum].num = 0;
+			++hnum;
+		}
+		++hard[hnum - 1].num;
+	}
+
+	num = 0;
+	for (h = 0; h < hnum; ++h) {
+		start = hard[h].start;
+		end = start + hard[h].num;
+		limit = acmr(fifo, &idx[start * 3], hard[h].num) *
+							OVERDRAW_THRESHOLD;
+
+		misses = 0;
+		fifo_flush(fifo);
+		for (t = start; t < end; ++t) {
+			misses += fifo_tri(fifo, &idx[t * 3]);
+			i = t + 1 - start;
+			if (t + 1 == end || (i >= CLUSTER_MIN &&
+						misses <= limit * i)) {
+				cl[num].start = start;
+				cl[num].num = i;
+				++num;
+				start = t + 1;
+				misses = 0;
+				fifo_flush(fifo);
+			}
+		}
+	}
+
+	tri_moments(prim, idx, tnum, mc, n, &area);
+	if (area > 0.0f)
+		for (i = 0; i < 3; ++i)
+			mc[i] /= area;
+
+	for (t = 0; t < num; ++t) {
+		tri_moments(prim, &idx[cl[t].start * 3], cl[t].num, c, n,
+									&area);
+		len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		cl[t].key = 0.0f;
+		if (area <= 0.0f || len <= 0.0f)
+			continue;
+
+		for (i = 0; i < 3; ++i)
+			cl[t].key += (c[i] / area - mc[i]) * n[i] / len;
+	}
+
+	qsort(cl, num, sizeof(*cl), cluster_cmp);
+
+	for (i = 0, t = 0; t < num; ++t) {
+		memcpy(&out[i * 3], &idx[cl[t].start * 3],
+					sizeof(*idx) * cl[t].num * 3);
+		i += cl[t].num;
+	}
+
+	free(cl);
+	return num;
+}
+
+/*
+ * Optimizes the triangle and vertex order of \prim for the vertex cache,
+ * overdraw and vertex fetch. Only indexed triangle lists are optimized, other
+ * primitives are left untouched. The vertex, color and normal buffers must be
+ * set and have client memory, packed primitives are skipped.
+ * The average cache miss ratio before and after the optimization is logged.
+ */
+int e3d_primitive_optimize(struct e3d_primitive *prim)
+{
+	struct forsyth f;
+	struct fifo fifo;
+	size_t *idx, *opt, *sorted, *first, *remap, *map;
+	size_t i, tnum, vnum, clusters;
+	float before, after, sorted_acmr;
+	int ret = -ENOMEM;
+
+	if (prim->packed || prim->type != GL_TRIANGLES || !prim->index ||
+								prim->num < 3)
+		return 0;
+
+	assert(prim->vertex && prim->vertex->data);
+	assert(prim->color && prim->color->data);
+	assert(prim->normal && prim->normal->data);
+
+	tnum = prim->num / 3;
+	vnum = prim->vertex->num - prim->voff;
+
+	idx = malloc(sizeof(*idx) * tnum * 3);
+	opt = malloc(sizeof(*opt) * tnum * 3);
+	sorted = malloc(sizeof(*sorted) * tnum * 3);
+	first = malloc(sizeof(*first) * vnum);
+	remap = malloc(sizeof(*remap) * tnum * 3);
+	map = malloc(sizeof(*map) * vnum);
+	fifo.stamp = NULL;
+	if (!idx || !opt || !sorted || !first || !remap || !map)
+		goto err;
+
+	ret = fifo_init(&fifo, vnum);
+	if (ret)
+		goto err;
+
+	for (i = 0; i < tnum * 3; ++i)
+		idx[i] = source(prim, i);
+
+	before = acmr(&fifo, idx, tnum);
+
+	ret = forsyth_init(&f, idx, tnum, vnum);
+	if (!ret)
+		forsyth_run(&f, opt);
+	forsyth_destroy(&f);
+	if (ret)
+		goto err;
+
+	after = acmr(&fifo, opt, tnum);
+
+	clusters = sort_clusters(prim, &fifo, opt, tnum, sorted);
+	if (!clusters) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	sorted_acmr = acmr(&fifo, sorted, tnum);
+	if (sorted_acmr <= after * OVERDRAW_THRESHOLD) {
+		memcpy(opt, sorted, sizeof(*opt) * tnum * 3);
+		after = sorted_acmr;
+	} else {
+		clusters = 1;
+	}
+
+	/* renumber vertices in order of first use */
+	for (i = 0; i < vnum; ++i)
+		map[i] = (size_t)-1;
+	for (vnum = 0, i = 0; i < tnum * 3; ++i) {
+		if (map[opt[i]] == (size_t)-1) {
+			map[opt[i]] = vnum;
+			first[vnum++] = opt[i];
+		}
+		remap[i] = map[opt[i]];
+	}
+
+	prim->num = tnum * 3;
+	ret = rebuild(prim, first, vnum, remap);
+	if (ret)
+		goto err;
+
+	ulog_flog(e3d_log, ULOG_DEBUG, "Optimize: %lu triangles %lu vertices "
+			"%lu clusters ACMR %.3f -> %.3f\n", tnum, vnum,
+						clusters, before, after);
+
+err:
+	free(fifo.stamp);
+	free(map);
+	free(remap);
+	free(first);
+	free(sorted);
+	free(opt);
+	free(idx);
+	return ret;
+}
@@ -0,0 +1,318 @@
+/*
+ * airhockey - 3D engine - normal generation
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Normals are generated directly on the raw buffers. If SSE is available,
+ * triangles are processed in batches of four. The vertices of a batch are
+ * transposed so each SSE register holds one coordinate of all four triangles
+ * and the cross products and normalizations are computed for the whole batch
+ * at once. Remaining triangles and builds without SSE use the scalar path.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "engine3d.h"
+#include "log.h"
+#include "mathw.h"
+
+struct gen {
+	const float *vertex;
+	const void *index;
+	GLenum index_type;
+	float *normal;
+	size_t num;
+	unsigned int flags;
+};
+
+static inline size_t corner(const struct gen *g, size_t i)
+{
+	if (!g->index)
+		return i;
+
+	switch (g->index_type) {
+		case GL_UNSIGNED_BYTE:
+			return ((const GLubyte*)g->index)[i];
+		case GL_UNSIGNED_SHORT:
+			return ((const GLushort*)g->index)[i];
+		default:
+			return ((const GLuint*)g->index)[i];
+	}
+}
+
+static inline void store(const struct gen *g, size_t v, const float *n)
+{
+	float *dest = &g->normal[v * 4];
+
+	if (g->flags & E3D_NORMALS_SMOOTH) {
+		dest[0] += n[0];
+		dest[1] += n[1];
+		dest[2] += n[2];
+	} else {
+		dest[0] = n[0];
+		dest[1] = n[1];
+		dest[2] = n[2];
+	}
+}
+
+static inline float inv_length(float l)
+{
+	return (l > 0.0f) ? 1.0f / sqrtf(l) : 0.0f;
+}
+
+static void gen_scalar(const struct gen *g, size_t first)
+{
+	size_t t;
+	const float *a, *b, *c;
+	float e1[3], e2[3], n[3], l;
+
+	for (t = first; t < g->num; ++t) {
+		a = &g->vertex[corner(g, t * 3) * 4];
+		b = &g->vertex[corner(g, t * 3 + 1) * 4];
+		c = &g->vertex[corner(g, t * 3 + 2) * 4];
+
+		e1[0] = a[0] - b[0];
+		e1[1] = a[1] - b[1];
+		e1[2] = a[2] - b[2];
+		e2[0] = a[0] - c[0];
+		e2[1] = a[1] - c[1];
+		e2[2] = a[2] - c[2];
+
+		n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+		n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+		n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+
+		/* smooth normals are weighted by area and normalized later */
+		if (!(g->flags & E3D_NORMALS_SMOOTH)) {
+			l = inv_length(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			n[0] *= l;
+			n[1] *= l;
+			n[2] *= l;
+		}
+
+		store(g, corner(g, t * 3), n);
+		store(g, corner(g, t * 3 + 1), n);
+		store(g, corner(g, t * 3 + 2), n);
+	}
+}
+
+static void normalize_scalar(float *n, size_t first, size_t num)
+{
+	size_t i;
+	float l;
+
+	for (i = first; i < num; ++i) {
+		l = inv_length(n[i * 4] * n[i * 4] + n[i * 4 + 1] * n[i * 4 + 1] +
+						n[i * 4 + 2] * n[i * 4 + 2]);
+		n[i * 4] *= l;
+		n[i * 4 + 1] *= l;
+		n[i * 4 + 2] *= l;
+	}
+}
+
+#ifdef __SSE__
+
+/*
+ * Returns 1 / sqrt(\v) for all four elements and 0 for elements that are not
+ * greater than zero. The approximation refines the hardware estimate with one
+ * Newton-Raphson step which gives about 22 bits of precision.
+ */
+static inline __m128 rsqrt4(__m128 v, bool approx)
+{
+	__m128 r, mask;
+
+	if (approx) {
+		r = _mm_rsqrt_ps(v);
+		r = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r),
+			_mm_sub_ps(_mm_set1_ps(3.0f),
+				_mm_mul_ps(_mm_mul_ps(v, r), r)));
+	} else {
+		r = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(v));
+	}
+
+	mask = _mm_cmpgt_ps(v, _mm_setzero_ps());
+	return _mm_and_ps(r, mask);
+}
+
+/* loads corner \c of the four triangles starting at \t transposed */
+static inline void load_corner(const struct gen *g, size_t t, size_t c,
+					__m128 *x, __m128 *y, __m128 *z)
+{
+	__m128 r0, r1, r2, r3;
+
+	r0 = _mm_loadu_ps(&g->vertex[corner(g, t * 3 + c) * 4]);
+	r1 = _mm_loadu_ps(&g->vertex[corner(g, (t + 1) * 3 + c) * 4]);
+	r2 = _mm_loadu_ps(&g->vertex[corner(g, (t + 2) * 3 + c) * 4]);
+	r3 = _mm_loadu_ps(&g->vertex[corner(g, (t + 3) * 3 + c) * 4]);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+	*x = r0;
+	*y = r1;
+	*z = r2;
+}
+
+static inline void store4(const struct gen *g, size_t v, __m128 n)
+{
+	float *dest = &g->normal[v * 4];
+
+	if (g->flags & E3D_NORMALS_SMOOTH)
+		n = _mm_add_ps(_mm_loadu_ps(dest), n);
+	_mm_storeu_ps(dest, n);
+}
+
+/* returns the index of the first triangle that was not processed */
+static size_t gen_sse(const struct gen *g)
+{
+	size_t t, k;
+	__m128 ax, ay, az, bx, by, bz, cx, cy, cz;
+	__m128 nx, ny, nz, nw, l;
+	__m128 rows[4];
+
+	for (t = 0; t + 4 <= g->num; t += 4) {
+		load_corner(g, t, 0, &ax, &ay, &az);
+		load_corner(g, t, 1, &bx, &by, &bz);
+		load_corner(g, t, 2, &cx, &cy, &cz);
+
+		/* edges are stored in \b and \c */
+		bx = _mm_sub_ps(ax, bx);
+		by = _mm_sub_ps(ay, by);
+		bz = _mm_sub_ps(az, bz);
+		cx = _mm_sub_ps(ax, cx);
+		cy = _mm_sub_ps(ay, cy);
+		cz = _mm_sub_ps(az, cz);
+
+		nx = _mm_sub_ps(_mm_mul_ps(by, cz), _mm_mul_ps(bz, cy));
+		ny = _mm_sub_ps(_mm_mul_ps(bz, cx), _mm_mul_ps(bx, cz));
+		nz = _mm_sub_ps(_mm_mul_ps(bx, cy), _mm_mul_ps(by, cx));
+
+		if (!(g->flags & E3D_NORMALS_SMOOTH)) {
+			l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx),
+				_mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+			l = rsqrt4(l, g->flags & E3D_NORMALS_APPROX);
+			nx = _mm_mul_ps(nx, l);
+			ny = _mm_mul_ps(ny, l);
+			nz = _mm_mul_ps(nz, l);
+		}
+
+		nw = _mm_setzero_ps();
+		_MM_TRANSPOSE4_PS(nx, ny, nz, nw);
+		rows[0] = nx;
+		rows[1] = ny;
+		rows[2] = nz;
+		rows[3] = nw;
+
+		/* keep triangle order so the last triangle wins on flat normals */
+		for (k = 0; k < 4; ++k) {
+			store4(g, corner(g, (t + k) * 3), rows[k]);
+			store4(g, corner(g, (t + k) * 3 + 1), rows[k]);
+			store4(g, corner(g, (t + k) * 3 + 2), rows[k]);
+		}
+	}
+
+	return t;
+}
+
+/* returns the index of the first normal that was not processed */
+static size_t normalize_sse(float *n, size_t num, bool approx)
+{
+	size_t i;
+	__m128 x, y, z, w, l;
+
+	for (i = 0; i + 4 <= num; i += 4) {
+		x = _mm_loadu_ps(&n[i * 4]);
+		y = _mm_loadu_ps(&n[i * 4 + 4]);
+		z = _mm_loadu_ps(&n[i * 4 + 8]);
+		w = _mm_loadu_ps(&n[i * 4 + 12]);
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+
+		l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+							_mm_mul_ps(z, z));
+		l = rsqrt4(l, approx);
+		x = _mm_mul_ps(x, l);
+		y = _mm_mul_ps(y, l);
+		z = _mm_mul_ps(z, l);
+
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		_mm_storeu_ps(&n[i * 4], x);
+		_mm_storeu_ps(&n[i * 4 + 4], y);
+		_mm_storeu_ps(&n[i * 4 + 8], z);
+		_mm_storeu_ps(&n[i * 4 + 12], w);
+	}
+
+	return i;
+}
+
+#else /* __SSE__ */
+
+static inline size_t gen_sse(const struct gen *g)
+{
+	return 0;
+}
+
+static inline size_t normalize_sse(float *n, size_t num, bool approx)
+{
+	return 0;
+}
+
+#endif /* __SSE__ */
+
+/*
+ * This generates normals for the given primitive. Only plain triangles are
+ * supported, both with and without index buffer. The new normal buffer has one
+ * entry for each vertex of the vertex buffer.
+ * With E3D_NORMALS_SMOOTH the area weighted normals of all triangles sharing a
+ * vertex index are averaged. Without an index buffer no vertices are shared so
+ * this results in flat normals. Otherwise, every vertex gets the normal of the
+ * last triangle that uses it.
+ * E3D_NORMALS_APPROX uses a faster but less exact reciprocal square root for
+ * the normalization if it is supported by the CPU.
+ */
+int e3d_primitive_generate_normals(struct e3d_primitive *prim,
+							unsigned int flags)
+{
+	struct e3d_vbo *n;
+	struct gen g;
+	size_t i;
+	int ret;
+
+	assert(prim->vertex);
+	assert(prim->vertex->data);
+
+	if (!e3d_vbo_is_v4(prim->vertex) || prim->type != GL_TRIANGLES)
+		return -EINVAL;
+
+	ret = e3d_vbo_new_v4(&n, prim->vertex->num);
+	if (ret)
+		return ret;
+
+	g.vertex = E3D_VBO_AT(prim->vertex, prim->voff);
+	g.index = prim->index ? E3D_VBO_AT(prim->index, prim->ioff) : NULL;
+	g.index_type = prim->index ? prim->index->ele_type : 0;
+	g.normal = n->data;
+	g.num = prim->num / 3;
+	g.flags = flags;
+
+	i = gen_sse(&g);
+	gen_scalar(&g, i);
+
+	if (flags & E3D_NORMALS_SMOOTH) {
+		i = normalize_sse(n->data, n->num, flags & E3D_NORMALS_APPROX);
+		normalize_scalar(n->data, i, n->num);
+	}
+
+	e3d_primitive_set_normal(prim, 0, n);
+	e3d_vbo_unref(n);
+
+	return 0;
+}
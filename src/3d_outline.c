@@ -0,0 +1,206 @@
+/*
+ * airhockey - 3D engine - screen space outlines
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * The offscreen framebuffer has two RGBA color textures for the scene color and
+ * the encoded normals and a depth texture. All textures are recreated if the
+ * viewport size changes. The depth of the outline shader is compared with
+ * GL_ALWAYS so the scene depth is copied into the window framebuffer and later
+ * passes are still depth tested against the scene.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SFML/OpenGL.h>
+
+#include "engine3d.h"
+#include "log.h"
+#include "mathw.h"
+
+/* full-screen quad in normalized device coordinates */
+static const GLfloat quad[4][4] = {
+	{ -1.0f, -1.0f, 0.0f, 1.0f },
+	{ 1.0f, -1.0f, 0.0f, 1.0f },
+	{ -1.0f, 1.0f, 0.0f, 1.0f },
+	{ 1.0f, 1.0f, 0.0f, 1.0f },
+};
+
+static const GLenum buffers[] = {
+	GL_COLOR_ATTACHMENT0,
+	GL_COLOR_ATTACHMENT1,
+};
+
+void e3d_outline_init(struct e3d_outline *outline)
+{
+	memset(outline, 0, sizeof(*outline));
+}
+
+static void drop_targets(struct e3d_outline *outline)
+{
+	if (outline->fbo)
+		E3D(glDeleteFramebuffers(1, &outline->fbo));
+	if (outline->color)
+		glDeleteTextures(1, &outline->color);
+	if (outline->normal)
+		glDeleteTextures(1, &outline->normal);
+	if (outline->depth)
+		glDeleteTextures(1, &outline->depth);
+
+	memset(outline, 0, sizeof(*outline));
+}
+
+void e3d_outline_destroy(struct e3d_outline *outline)
+{
+	drop_targets(outline);
+}
+
+static GLuint new_texture(GLint width, GLint height, GLint format,
+								GLenum type)
+{
+	GLuint tex = 0;
+
+	glGenTextures(1, &tex);
+	if (!tex)
+		return 0;
+
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0,
+			format == GL_DEPTH_COMPONENT24 ? GL_DEPTH_COMPONENT :
+							GL_RGBA, type, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return tex;
+}
+
+static int create_targets(struct e3d_outline *outline, GLint width,
+								GLint height)
+{
+	GLenum status;
+
+	drop_targets(outline);
+
+	outline->color = new_texture(width, height, GL_RGBA8,
+							GL_UNSIGNED_BYTE);
+	outline->normal = new_texture(width, height, GL_RGBA8,
+							GL_UNSIGNED_BYTE);
+	outline->depth = new_texture(width, height, GL_DEPTH_COMPONENT24,
+							GL_UNSIGNED_INT);
+	if (!outline->color || !outline->normal || !outline->depth)
+		goto err;
+
+	E3D(glGenFramebuffers(1, &outline->fbo));
+	if (!outline->fbo)
+		goto err;
+
+	E3D(glBindFramebuffer(GL_FRAMEBUFFER, outline->fbo));
+	E3D(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+					GL_TEXTURE_2D, outline->color, 0));
+	E3D(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+					GL_TEXTURE_2D, outline->normal, 0));
+	E3D(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+					GL_TEXTURE_2D, outline->depth, 0));
+	E3D(glDrawBuffers(2, buffers));
+	status = E3D(glCheckFramebufferStatus(GL_FRAMEBUFFER));
+	E3D(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+			"Outline: Incomplete framebuffer 0x%x\n", status);
+		drop_targets(outline);
+		return -EINVAL;
+	}
+
+	outline->width = width;
+	outline->height = height;
+	ulog_flog(e3d_log, ULOG_DEBUG, "Outline: Creating targets %dx%d\n",
+								width, height);
+	return 0;
+
+err:
+	ulog_flog(e3d_log, ULOG_ERROR, "Outline: Cannot create targets\n");
+	drop_targets(outline);
+	return -ENOMEM;
+}
+
+/*
+ * Redirects drawing into the offscreen framebuffer of \outline and clears it.
+ * The targets are resized to the current viewport first. If this fails,
+ * drawing still goes to the window and a negative error is returned.
+ */
+int e3d_outline_begin(struct e3d_outline *outline)
+{
+	GLint view[4];
+	int ret;
+
+	glGetIntegerv(GL_VIEWPORT, view);
+
+	if (!outline->fbo || outline->width != view[2] ||
+						outline->height != view[3]) {
+		ret = create_targets(outline, view[2], view[3]);
+		if (ret)
+			return ret;
+	}
+
+	E3D(glBindFramebuffer(GL_FRAMEBUFFER, outline->fbo));
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	return 0;
+}
+
+static void bind_texture(GLint uni, GLenum unit, GLuint tex)
+{
+	E3D(glActiveTexture(GL_TEXTURE0 + unit));
+	glBindTexture(GL_TEXTURE_2D, tex);
+	E3D(glUniform1i(uni, unit));
+}
+
+/*
+ * Switches back to the window framebuffer and draws the scene of the offscreen
+ * framebuffer with outlines. The outline shader \loc must be in use. The
+ * projection matrix of \trans is needed to linearize the depth values.
+ */
+void e3d_outline_end(struct e3d_outline *outline,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans)
+{
+	const float *proj = (void*)MATH_TIP(&trans->proj_stack);
+	GLint attr;
+	GLenum unit;
+
+	E3D(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+	bind_texture(loc->uni[E3D_U_COLOR_MAP], 0, outline->color);
+	bind_texture(loc->uni[E3D_U_NORMAL_MAP], 1, outline->normal);
+	bind_texture(loc->uni[E3D_U_DEPTH_MAP], 2, outline->depth);
+
+	/* m[2][2] and m[3][2] of the projection matrix and the texel size */
+	E3D(glUniform4f(loc->uni[E3D_U_OUTLINE], proj[10], proj[14],
+			1.0f / outline->width, 1.0f / outline->height));
+
+	E3D(glDepthFunc(GL_ALWAYS));
+	E3D(glDisable(GL_CULL_FACE));
+
+	attr = loc->attr[E3D_A_VERTEX];
+	E3D(glBindBuffer(GL_ARRAY_BUFFER, 0));
+	E3D(glEnableVertexAttribArray(attr));
+	E3D(glVertexAttribPointer(attr, 4, GL_FLOAT, GL_FALSE, 0, quad));
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	E3D(glDisableVertexAttribArray(attr));
+
+	E3D(glEnable(GL_CULL_FACE));
+
+	/* the textures must not be bound while they are drawn into */
+	for (unit = 3; unit-- > 0; ) {
+		E3D(glActiveTexture(GL_TEXTURE0 + unit));
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+}
@@ -0,0 +1,184 @@
+/*
+ * airhockey - 3D engine - render queues
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * The sort key of an item contains the buffer object of its vertices in the
+ * upper 32 bits and its depth in eye space in the lower 32 bits. Non-negative
+ * floats compare like their bit patterns, so items that share buffers are
+ * drawn together and front to back within these.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine3d.h"
+#include "log.h"
+#include "mathw.h"
+
+void e3d_queue_init(struct e3d_queue *queue)
+{
+	memset(queue, 0, sizeof(*queue));
+}
+
+void e3d_queue_destroy(struct e3d_queue *queue)
+{
+	free(queue->items);
+	memset(queue, 0, sizeof(*queue));
+}
+
+void e3d_queue_reset(struct e3d_queue *queue)
+{
+	queue->num = 0;
+}
+
+/* returns the depth of the center of \prim transformed by \m in eye space */
+static float item_depth(struct e3d_primitive *prim, math_m4 m, math_m4 eye)
+{
+	math_v3 p;
+	const float *c = prim->bounds.center;
+	size_t i;
+
+	for (i = 0; i < 3; ++i)
+		p[i] = m[0][i] * c[0] + m[1][i] * c[1] + m[2][i] * c[2] +
+								m[3][i];
+
+	/* the eye looks along the negative z axis */
+	return -(eye[0][2] * p[0] + eye[1][2] * p[1] + eye[2][2] * p[2] +
+								eye[3][2]);
+}
+
+static uint64_t item_key(struct e3d_primitive *prim, float depth)
+{
+	struct e3d_vbo *vbo;
+	uint32_t bits;
+
+	vbo = prim->packed ? prim->packed : prim->vertex;
+
+	if (!(depth > 0.0f))
+		depth = 0.0f;
+	memcpy(&bits, &depth, sizeof(bits));
+
+	return (uint64_t)vbo->id << 32 | bits;
+}
+
+/*
+ * Adds \prim with the modelview matrix \m to \queue. The eye matrix of \trans
+ * is used to compute the depth of the item.
+ */
+int e3d_queue_add(struct e3d_queue *queue, struct e3d_primitive *prim,
+				math_m4 m, struct e3d_transform *trans)
+{
+	struct e3d_draw_item *item;
+	size_t nsize;
+
+	if (!prim->num)
+		return 0;
+
+	assert(prim->vertex || prim->packed);
+
+	if (queue->num >= queue->size) {
+		nsize = queue->size ? queue->size * 2 : 64;
+		item = realloc(queue->items, nsize * sizeof(*item));
+		if (!item)
+			return -ENOMEM;
+		queue->items = item;
+		queue->size = nsize;
+	}
+
+	item = &queue->items[queue->num++];
+	item->prim = prim;
+	math_m4_copy(item->matrix, m);
+	if (trans->color)
+		memcpy(item->color, trans->color, sizeof(item->color));
+	else
+		math_v4_copy(item->color, (math_v4){ 1.0, 1.0, 1.0, 1.0 });
+	item->key = item_key(prim, item_depth(prim, m,
+					MATH_TIP(&trans->eye_stack)));
+
+	return 0;
+}
+
+/*
+ * Adds all visible primitives of \shape and its childs to \queue. The current
+ * modelview matrix of \trans is the parent transformation of \shape.
+ */
+int e3d_queue_add_shape(struct e3d_queue *queue,
+		const struct e3d_shape *shape, struct e3d_transform *trans)
+{
+	const struct e3d_shape *iter;
+	int ret;
+
+	shape = e3d_shape_lod(shape, trans);
+	ret = math_stack_push_mult(&trans->mod_stack,
+				math_trs_matrix_const(&shape->alter));
+	if (ret)
+		return ret;
+
+	if (!e3d_transform_visible(trans, &shape->bounds))
+		goto out;
+
+	if (shape->prim) {
+		ret = e3d_queue_add(queue, shape->prim,
+					MATH_TIP(&trans->mod_stack), trans);
+		if (ret)
+			goto out;
+	}
+
+	for (iter = shape->childs; iter; iter = iter->next) {
+		ret = e3d_queue_add_shape(queue, iter, trans);
+		if (ret)
+			goto out;
+	}
+
+out:
+	math_stack_pop(&trans->mod_stack);
+	return ret;
+}
+
+static int item_cmp(const void *a, const void *b)
+{
+	const struct e3d_draw_item *x = a, *y = b;
+
+	if (x->key < y->key)
+		return -1;
+	return x->key > y->key;
+}
+
+void e3d_queue_sort(struct e3d_queue *queue)
+{
+	qsort(queue->items, queue->num, sizeof(*queue->items), item_cmp);
+}
+
+/*
+ * Draws all items of \queue in order with drawer \how. The modelview matrix and
+ * the color of \trans are replaced by the ones of each item.
+ */
+void e3d_queue_draw(struct e3d_queue *queue, int how,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans)
+{
+	struct e3d_draw_item *item;
+	size_t i;
+
+	if (!queue->num)
+		return;
+
+	if (math_stack_push(&trans->mod_stack))
+		return;
+
+	for (i = 0; i < queue->num; ++i) {
+		item = &queue->items[i];
+		math_m4_copy(MATH_TIP(&trans->mod_stack), item->matrix);
+		trans->color = item->color;
+		e3d_primitive_draw(item->prim, how, loc, trans);
+	}
+
+	trans->color = NULL;
+	math_stack_pop(&trans->mod_stack);
+}
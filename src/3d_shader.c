@@ -6,8 +6,11 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include <SFML/OpenGL.h>
 
@@ -15,9 +18,43 @@
 #include "log.h"
 #include "main.h"
 
+/*
+ * Shader sources
+ * Each shader type is built from a vertex and fragment shader file with fixed
+ * \defines. Lit shader types are built in variants, see e3d_shader_variant().
+ * \features are the flags a variant of the type can be built with.
+ */
+struct shader_source {
+	const char *name;
+	const cstr *vert;
+	const cstr *frag;
+	const char *defines;
+	const char **attrs;
+	const char **unis;
+	bool lit;
+	unsigned int features;
+};
+
+/*
+ * Variants of a shader are kept in a list of the shader that e3d_shader_new()
+ * returned. \shader is NULL if the variant failed to build so it is not built
+ * again.
+ */
+struct variant {
+	struct variant *next;
+	size_t lights;
+	unsigned int flags;
+	struct e3d_shader *shader;
+};
+
 struct e3d_shader {
 	GLuint program;
 	struct e3d_shader_locations loc;
+
+	const struct shader_source *src;
+	size_t lights;
+	unsigned int flags;
+	struct variant *variants;
 };
 
 static struct e3d_shader *create_shader()
@@ -48,20 +85,32 @@ static struct e3d_shader *create_shader()
 
 static void free_shader(struct e3d_shader *shader)
 {
+	struct variant *iter;
+
+	while ((iter = shader->variants)) {
+		shader->variants = iter->next;
+		if (iter->shader)
+			free_shader(iter->shader);
+		free(iter);
+	}
+
 	E3D(glDeleteProgram(shader->program));
 	free(shader);
 }
 
+/*
+ * Compiles the shader source \src of \size bytes and attaches it to \shader.
+ * \defines is inserted after the #version line so the same file can be
+ * compiled in several variants.
+ */
 static int compile_shader(struct e3d_shader *shader, GLint type,
-							const cstr *path)
+			const char *src, size_t size, const char *defines)
 {
-	int ret;
-	char *out;
-	size_t size;
 	GLuint obj;
 	GLint result;
-	GLchar *vsh;
-	GLint vnum;
+	const GLchar *vsh[3];
+	GLint vnum[3];
+	const char *eol;
 
 	obj = E3D(glCreateShader(type));
 	if (!obj) {
@@ -70,22 +119,23 @@ static int compile_shader(struct e3d_shader *shader, GLint type,
 		return -EINVAL;
 	}
 
-	ret = misc_load_file(path, &out, &size);
-	if (ret) {
-		ulog_flog(e3d_log, ULOG_ERROR,
-				"Shader: Cannot load shader file %s %d\n",
-							CSTR_CHAR(path), ret);
-		E3D(glDeleteShader(obj));
-		return ret;
+	/* #version must stay the first statement */
+	vnum[0] = 0;
+	if (size > 8 && !strncmp(src, "#version", 8)) {
+		eol = memchr(src, '\n', size);
+		if (eol)
+			vnum[0] = eol - src + 1;
 	}
 
-	vsh = out;
-	vnum = size;
+	vsh[0] = src;
+	vsh[1] = defines;
+	vnum[1] = strlen(defines);
+	vsh[2] = src + vnum[0];
+	vnum[2] = size - vnum[0];
 
-	E3D(glShaderSource(obj, 1, (const GLchar**)&vsh, &vnum));
+	E3D(glShaderSource(obj, 3, vsh, vnum));
 	E3D(glCompileShader(obj));
 	E3D(glGetShaderiv(obj, GL_COMPILE_STATUS, &result));
-	free(vsh);
 
 	if (result == GL_FALSE) {
 		ulog_flog(e3d_log, ULOG_ERROR,
@@ -118,67 +168,340 @@ static int link_shader(struct e3d_shader *shader)
 	return 0;
 }
 
-static const char *debug_attrs[E3D_A_NUM] = {
-	[E3D_A_VERTEX] = "position_in",
-	[E3D_A_COLOR] = "color_in",
-	[E3D_A_NORMAL] = "normal_in",
-};
+/*
+ * Program binary cache
+ * Linked programs are stored in \cache_dir in one file per program. The file
+ * name is a hash of the sources, defines, attribute bindings and the GL
+ * vendor, renderer and version strings. The file starts with a header that
+ * repeats the hash and the driver string so collisions and driver updates are
+ * detected. Every mismatch or error silently falls back to compiling the
+ * sources, which then replaces the cache file.
+ * Binaries need GL 4.1 or ARB_get_program_binary. The cache is not used if the
+ * driver supports no binary formats.
+ */
 
-static const char *debug_unis[E3D_U_NUM] = {
-	[E3D_U_M_MAT] = "m_mat",
-	[E3D_U_M_MAT_IT] = "m_mat_it",
-	[E3D_U_MPE_MAT] = "mpe_mat",
-	[E3D_U_CAM_POS] = "cam_pos",
+static const char cache_dir[] = "./cache";
 
-	[E3D_U_LIGHT0_ENABLED] = "lights[0].enabled",
-	[E3D_U_LIGHT0_COLOR] = "lights[0].color",
-	[E3D_U_LIGHT0_MAT] = "lights[0].mat",
-	[E3D_U_LIGHT0_MAT_IT] = "lights[0].mat_it",
+#define CACHE_MAGIC 0x50443345
+#define CACHE_VERSION 1
+#define CACHE_DRIVER 256
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	char driver[CACHE_DRIVER];
+	uint32_t format;
+	uint32_t length;
+	int64_t build_time;
 };
 
-static int init_debug_shader(struct e3d_shader *shader)
+/* 64bit FNV-1a hash of \size bytes at \data continuing from \hash */
+static uint64_t hash_data(uint64_t hash, const void *data, size_t size)
 {
-	int ret;
+	const unsigned char *d = data;
 	size_t i;
-	static const cstr vert = CSTR_STATIC("./shader/debug.vert");
-	static const cstr frag = CSTR_STATIC("./shader/debug.frag");
 
-	ret = compile_shader(shader, GL_VERTEX_SHADER, &vert);
-	if (ret)
+	for (i = 0; i < size; ++i) {
+		hash ^= d[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static uint64_t hash_str(uint64_t hash, const char *str)
+{
+	/* include the terminating zero so concatenations differ */
+	return hash_data(hash, str, strlen(str) + 1);
+}
+
+static bool cache_supported()
+{
+	GLint num = 0;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num);
+	return num > 0;
+}
+
+static void cache_driver(char *driver)
+{
+	const char *vendor, *renderer, *version;
+
+	vendor = (const char*)glGetString(GL_VENDOR);
+	renderer = (const char*)glGetString(GL_RENDERER);
+	version = (const char*)glGetString(GL_VERSION);
+
+	memset(driver, 0, CACHE_DRIVER);
+	snprintf(driver, CACHE_DRIVER, "%s|%s|%s", vendor ? vendor : "",
+			renderer ? renderer : "", version ? version : "");
+}
+
+static void cache_path(char *path, size_t size, uint64_t key)
+{
+	snprintf(path, size, "%s/%016llx.bin", cache_dir,
+						(unsigned long long)key);
+}
+
+/*
+ * Loads the program binary with \key into the program of \shader. Returns 0 on
+ * success. The stored build time of the program is written into \saved.
+ */
+static int cache_load(struct e3d_shader *shader, uint64_t key,
+					const char *driver, int64_t *saved)
+{
+	struct cache_header hdr;
+	char path[128];
+	FILE *file;
+	void *bin;
+	GLint result;
+	int ret = -EINVAL;
+
+	cache_path(path, sizeof(path), key);
+	file = fopen(path, "rb");
+	if (!file)
+		return -errno;
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1)
+		goto err_file;
+
+	if (hdr.magic != CACHE_MAGIC || hdr.version != CACHE_VERSION ||
+			hdr.key != key || !hdr.length ||
+			memcmp(hdr.driver, driver, CACHE_DRIVER))
+		goto err_file;
+
+	bin = malloc(hdr.length);
+	if (!bin) {
+		ret = -ENOMEM;
+		goto err_file;
+	}
+
+	if (fread(bin, hdr.length, 1, file) != 1)
+		goto err_bin;
+
+	E3D(glProgramBinary(shader->program, hdr.format, bin, hdr.length));
+	E3D(glGetProgramiv(shader->program, GL_LINK_STATUS, &result));
+	if (result == GL_FALSE)
+		goto err_bin;
+
+	*saved = hdr.build_time;
+	ret = 0;
+
+err_bin:
+	free(bin);
+err_file:
+	fclose(file);
+	return ret;
+}
+
+/* stores the linked program of \shader with \key in the cache */
+static void cache_store(struct e3d_shader *shader, uint64_t key,
+					const char *driver, int64_t build_time)
+{
+	struct cache_header hdr;
+	char path[128];
+	FILE *file;
+	void *bin;
+	GLint length = 0;
+	GLsizei written = 0;
+	GLenum format;
+
+	E3D(glGetProgramiv(shader->program, GL_PROGRAM_BINARY_LENGTH,
+								&length));
+	if (length <= 0)
+		return;
+
+	bin = malloc(length);
+	if (!bin)
+		return;
+
+	E3D(glGetProgramBinary(shader->program, length, &written, &format,
+									bin));
+	if (written <= 0)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.key = key;
+	memcpy(hdr.driver, driver, CACHE_DRIVER);
+	hdr.format = format;
+	hdr.length = written;
+	hdr.build_time = build_time;
+
+	if (mkdir(cache_dir, 0755) && errno != EEXIST)
+		goto out;
+
+	cache_path(path, sizeof(path), key);
+	file = fopen(path, "wb");
+	if (!file)
+		goto out;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+					fwrite(bin, written, 1, file) != 1) {
+		fclose(file);
+		remove(path);
+		goto out;
+	}
+
+	fclose(file);
+
+out:
+	free(bin);
+}
+
+/*
+ * Compiles and links the vertex and fragment shader of \src with \defines. The
+ * attributes of \src are bound to their ids and the locations of its uniforms
+ * are looked up. Unnamed ids are set to -1.
+ * The linked program is loaded from the binary cache if possible.
+ */
+static int init_shader(struct e3d_shader *shader,
+			const struct shader_source *src, const char *defines)
+{
+	const cstr *vert = src->vert, *frag = src->frag;
+	const char **attrs = src->attrs, **unis = src->unis;
+	int ret;
+	size_t i, vsize, fsize;
+	char *vsrc, *fsrc;
+	char driver[CACHE_DRIVER];
+	bool cache;
+	uint64_t key;
+	int64_t start, saved = 0;
+
+	ret = misc_load_file(vert, &vsrc, &vsize);
+	if (ret) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+				"Shader: Cannot load shader file %s %d\n",
+							CSTR_CHAR(vert), ret);
 		return ret;
-	ret = compile_shader(shader, GL_FRAGMENT_SHADER, &frag);
+	}
+
+	ret = misc_load_file(frag, &fsrc, &fsize);
+	if (ret) {
+		ulog_flog(e3d_log, ULOG_ERROR,
+				"Shader: Cannot load shader file %s %d\n",
+							CSTR_CHAR(frag), ret);
+		goto err_vert;
+	}
+
+	start = misc_now();
+	cache = cache_supported();
+	key = 0;
+
+	if (cache) {
+		cache_driver(driver);
+		key = hash_data(0xcbf29ce484222325ULL, vsrc, vsize);
+		key = hash_data(key, fsrc, fsize);
+		key = hash_str(key, defines);
+		for (i = 0; i < E3D_A_NUM; ++i)
+			key = hash_str(key, attrs[i] ? attrs[i] : "");
+		key = hash_str(key, driver);
+
+		if (!cache_load(shader, key, driver, &saved)) {
+			start = misc_now() - start;
+			ulog_flog(e3d_log, ULOG_DEBUG, "Shader: Cache hit "
+				"%016llx in %lld us, saved %lld us\n",
+				(unsigned long long)key, (long long)start,
+						(long long)(saved - start));
+			goto locations;
+		}
+
+		ulog_flog(e3d_log, ULOG_DEBUG, "Shader: Cache miss %016llx\n",
+						(unsigned long long)key);
+	}
+
+	ret = compile_shader(shader, GL_VERTEX_SHADER, vsrc, vsize, defines);
 	if (ret)
-		return ret;
+		goto err_frag;
+	ret = compile_shader(shader, GL_FRAGMENT_SHADER, fsrc, fsize, defines);
+	if (ret)
+		goto err_frag;
 
 	for (i = 0; i < E3D_A_NUM; ++i) {
-		if (debug_attrs[i]) {
+		if (attrs[i])
 			E3D(glBindAttribLocation(shader->program, i,
-							debug_attrs[i]));
-			shader->loc.attr[i] = i;
-		} else {
-			shader->loc.attr[i] = -1;
-		}
+								attrs[i]));
 	}
 
+	if (cache)
+		E3D(glProgramParameteri(shader->program,
+				GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+
 	ret = link_shader(shader);
 	if (ret)
-		return ret;
+		goto err_frag;
+
+	if (cache)
+		cache_store(shader, key, driver, misc_now() - start);
+
+locations:
+	for (i = 0; i < E3D_A_NUM; ++i)
+		shader->loc.attr[i] = attrs[i] ? (GLint)i : -1;
 
 	for (i = 0; i < E3D_U_NUM; ++i) {
-		if (debug_unis[i]) {
+		if (unis[i]) {
 			shader->loc.uni[i] = E3D(glGetUniformLocation(
-					shader->program, debug_unis[i]));
+						shader->program, unis[i]));
+			/* variants may not use every uniform */
 			if (shader->loc.uni[i] == -1)
-				ulog_flog(e3d_log, ULOG_WARN, "Shader: Cannot "
-				"find %s uniform location\n", debug_unis[i]);
+				ulog_flog(e3d_log, ULOG_DEBUG, "Shader: Cannot "
+				"find %s uniform location\n", unis[i]);
 		} else {
 			shader->loc.uni[i] = -1;
 		}
 	}
 
-	return 0;
+err_frag:
+	free(fsrc);
+err_vert:
+	free(vsrc);
+	return ret;
 }
 
+static const cstr debug_vert = CSTR_STATIC("./shader/debug.vert");
+static const cstr debug_frag = CSTR_STATIC("./shader/debug.frag");
+
+static const char *debug_attrs[E3D_A_NUM] = {
+	[E3D_A_VERTEX] = "position_in",
+	[E3D_A_COLOR] = "color_in",
+	[E3D_A_NORMAL] = "normal_in",
+};
+
+static const char *debug_unis[E3D_U_NUM] = {
+	[E3D_U_M_MAT_IT] = "m_mat_it",
+	[E3D_U_MPE_MAT] = "mpe_mat",
+	[E3D_U_TINT] = "tint",
+
+	[E3D_U_LIGHT0_COLOR] = "lights[0].color",
+	[E3D_U_LIGHT0_CAMERA] = "lights[0].camera",
+	[E3D_U_LIGHT0_M_MAT] = "lights[0].m_mat",
+	[E3D_U_LIGHT0_M_MAT_IT] = "lights[0].m_mat_it",
+};
+
+static const char *debug_inst_attrs[E3D_A_NUM] = {
+	[E3D_A_VERTEX] = "position_in",
+	[E3D_A_COLOR] = "color_in",
+	[E3D_A_NORMAL] = "normal_in",
+	[E3D_A_INST_MAT] = "inst_mat",
+	[E3D_A_INST_MAT_IT] = "inst_mat_it",
+	[E3D_A_INST_COLOR] = "inst_color",
+};
+
+static const char *debug_inst_unis[E3D_U_NUM] = {
+	[E3D_U_M_MAT] = "m_mat",
+	[E3D_U_M_MAT_IT] = "m_mat_it",
+	[E3D_U_PE_MAT] = "pe_mat",
+
+	[E3D_U_LIGHT0_COLOR] = "lights[0].color",
+	[E3D_U_LIGHT0_CAMERA] = "lights[0].camera",
+	[E3D_U_LIGHT0_MAT] = "lights[0].mat",
+	[E3D_U_LIGHT0_M_MAT_IT] = "lights[0].m_mat_it",
+};
+
+static const cstr simple_vert = CSTR_STATIC("./shader/simple.vert");
+static const cstr simple_frag = CSTR_STATIC("./shader/simple.frag");
+
 static const char *simple_attrs[E3D_A_NUM] = {
 	[E3D_A_VERTEX] = "position_in",
 };
@@ -188,85 +511,203 @@ static const char *simple_unis[E3D_U_NUM] = {
 	[E3D_U_COLOR] = "color",
 };
 
-static int init_simple_shader(struct e3d_shader *shader)
+static const char *simple_inst_attrs[E3D_A_NUM] = {
+	[E3D_A_VERTEX] = "position_in",
+	[E3D_A_INST_MAT] = "inst_mat",
+};
+
+static const char *simple_inst_unis[E3D_U_NUM] = {
+	[E3D_U_M_MAT] = "m_mat",
+	[E3D_U_PE_MAT] = "pe_mat",
+	[E3D_U_COLOR] = "color",
+};
+
+static const cstr outline_vert = CSTR_STATIC("./shader/outline.vert");
+static const cstr outline_frag = CSTR_STATIC("./shader/outline.frag");
+
+static const char *outline_attrs[E3D_A_NUM] = {
+	[E3D_A_VERTEX] = "position_in",
+};
+
+static const char *outline_unis[E3D_U_NUM] = {
+	[E3D_U_COLOR_MAP] = "color_map",
+	[E3D_U_NORMAL_MAP] = "normal_map",
+	[E3D_U_DEPTH_MAP] = "depth_map",
+	[E3D_U_OUTLINE] = "outline",
+};
+
+static const char instanced[] = "#define E3D_INSTANCED\n";
+
+static const struct shader_source sources[] = {
+	[E3D_SHADER_DEBUG] = {
+		.name = "debug",
+		.vert = &debug_vert,
+		.frag = &debug_frag,
+		.defines = "",
+		.attrs = debug_attrs,
+		.unis = debug_unis,
+		.lit = true,
+		.features = E3D_SHADER_NORMALS,
+	},
+	[E3D_SHADER_SIMPLE] = {
+		.name = "normals",
+		.vert = &simple_vert,
+		.frag = &simple_frag,
+		.defines = "",
+		.attrs = simple_attrs,
+		.unis = simple_unis,
+	},
+	[E3D_SHADER_DEBUG_INSTANCED] = {
+		.name = "debug instanced",
+		.vert = &debug_vert,
+		.frag = &debug_frag,
+		.defines = instanced,
+		.attrs = debug_inst_attrs,
+		.unis = debug_inst_unis,
+		.lit = true,
+		.features = E3D_SHADER_NORMALS,
+	},
+	[E3D_SHADER_SIMPLE_INSTANCED] = {
+		.name = "normals instanced",
+		.vert = &simple_vert,
+		.frag = &simple_frag,
+		.defines = instanced,
+		.attrs = simple_inst_attrs,
+		.unis = simple_inst_unis,
+	},
+	[E3D_SHADER_OUTLINE] = {
+		.name = "outline",
+		.vert = &outline_vert,
+		.frag = &outline_frag,
+		.defines = "",
+		.attrs = outline_attrs,
+		.unis = outline_unis,
+	},
+};
+
+#define SOURCES (sizeof(sources) / sizeof(*sources))
+
+/*
+ * Builds the variant of \src with \lights lights and the features \flags. The
+ * defines of the variant are appended to the defines of \src.
+ */
+static int build_shader(struct e3d_shader **out,
+		const struct shader_source *src, size_t lights,
+		unsigned int flags)
 {
+	struct e3d_shader *shader;
+	char defines[256];
 	int ret;
-	size_t i;
-	static const cstr vert = CSTR_STATIC("./shader/simple.vert");
-	static const cstr frag = CSTR_STATIC("./shader/simple.frag");
 
-	ret = compile_shader(shader, GL_VERTEX_SHADER, &vert);
-	if (ret)
-		return ret;
-	ret = compile_shader(shader, GL_FRAGMENT_SHADER, &frag);
-	if (ret)
-		return ret;
+	if (src->lit)
+		snprintf(defines, sizeof(defines),
+				"%s#define E3D_LIGHT_NUM %zu\n%s", src->defines,
+				lights, (flags & E3D_SHADER_NORMALS) ?
+					"#define E3D_NORMALS\n" : "");
+	else
+		snprintf(defines, sizeof(defines), "%s", src->defines);
 
-	for (i = 0; i < E3D_A_NUM; ++i) {
-		if (simple_attrs[i]) {
-			E3D(glBindAttribLocation(shader->program, i,
-							simple_attrs[i]));
-			shader->loc.attr[i] = i;
-		} else {
-			shader->loc.attr[i] = -1;
-		}
-	}
+	shader = create_shader();
+	if (!shader)
+		return -ENOMEM;
 
-	ret = link_shader(shader);
-	if (ret)
+	ret = init_shader(shader, src, defines);
+	if (ret) {
+		free_shader(shader);
 		return ret;
-
-	for (i = 0; i < E3D_U_NUM; ++i) {
-		if (simple_unis[i]) {
-			shader->loc.uni[i] = E3D(glGetUniformLocation(
-					shader->program, simple_unis[i]));
-			if (shader->loc.uni[i] == -1)
-				ulog_flog(e3d_log, ULOG_WARN, "Shader: Cannot "
-				"find %s uniform location\n", simple_unis[i]);
-		} else {
-			shader->loc.uni[i] = -1;
-		}
 	}
 
+	shader->src = src;
+	shader->lights = lights;
+	shader->flags = flags;
+	*out = shader;
+
 	return 0;
 }
 
+/*
+ * Lit shaders are built with a single light and all features. Other variants
+ * are built on demand with e3d_shader_variant().
+ */
 int e3d_shader_new(struct e3d_shader **out, enum e3d_shader_type type)
 {
 	int ret;
-	const char *name = "<invalid>";
+	const struct shader_source *src;
 	struct e3d_shader *shader;
 
-	shader = create_shader();
-	if (!shader)
-		return -ENOMEM;
-
-	switch (type) {
-		case E3D_SHADER_DEBUG:
-			ret = init_debug_shader(shader);
-			name = "debug";
-			break;
-		case E3D_SHADER_SIMPLE:
-			ret = init_simple_shader(shader);
-			name = "normals";
-			break;
-		default:
-			ulog_flog(e3d_log, ULOG_ERROR,
+	if ((size_t)type >= SOURCES) {
+		ulog_flog(e3d_log, ULOG_ERROR,
 					"Shader: Invalid shader type\n");
-			ret = -EINVAL;
-			break;
+		return -EINVAL;
 	}
 
-	if (ret) {
-		free_shader(shader);
-	} else {
-		*out = shader;
-		ulog_flog(e3d_log, ULOG_DEBUG,
+	src = &sources[type];
+	ret = build_shader(&shader, src, src->lit ? 1 : 0, src->features);
+	if (ret)
+		return ret;
+
+	*out = shader;
+	ulog_flog(e3d_log, ULOG_DEBUG,
 				"Shader: Creating shader %p of type %s\n",
-								shader, name);
+							shader, src->name);
+
+	return 0;
+}
+
+/*
+ * Returns the variant of the lit shader \shader for \lights lights and the
+ * features \flags in \out. The variant is built on the first request and
+ * stays owned by \shader. Returns -EINVAL if \shader is not lit, the request is
+ * out of range or the variant cannot be built. Callers should keep using
+ * \shader then.
+ */
+int e3d_shader_variant(struct e3d_shader *shader, struct e3d_shader **out,
+					size_t lights, unsigned int flags)
+{
+	const struct shader_source *src = shader->src;
+	struct variant *iter;
+	int ret;
+
+	if (!src->lit || !lights || lights > E3D_SHADER_LIGHTS ||
+						(flags & ~src->features))
+		return -EINVAL;
+
+	if (lights == shader->lights && flags == shader->flags) {
+		*out = shader;
+		return 0;
 	}
 
-	return ret;
+	for (iter = shader->variants; iter; iter = iter->next) {
+		if (iter->lights == lights && iter->flags == flags)
+			goto found;
+	}
+
+	iter = malloc(sizeof(*iter));
+	if (!iter)
+		return -ENOMEM;
+
+	memset(iter, 0, sizeof(*iter));
+	iter->lights = lights;
+	iter->flags = flags;
+	iter->next = shader->variants;
+	shader->variants = iter;
+
+	ret = build_shader(&iter->shader, src, lights, flags);
+	if (ret)
+		ulog_flog(e3d_log, ULOG_ERROR, "Shader: Cannot build variant "
+			"of %s with %zu lights and flags %x\n", src->name,
+								lights, flags);
+	else
+		ulog_flog(e3d_log, ULOG_DEBUG, "Shader: Building variant %p "
+			"of %s with %zu lights and flags %x\n", iter->shader,
+						src->name, lights, flags);
+
+found:
+	if (!iter->shader)
+		return -EINVAL;
+
+	*out = iter->shader;
+	return 0;
 }
 
 void e3d_shader_free(struct e3d_shader *shader)
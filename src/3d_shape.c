@@ -27,7 +27,8 @@ int e3d_shape_new(struct e3d_shape **shape)
 
 	memset(s, 0, sizeof(*s));
 	s->ref = 1;
-	math_m4_identity(s->alter);
+	math_trs_identity(&s->alter);
+	e3d_bounds_clear(&s->bounds);
 
 	*shape = s;
 	return 0;
@@ -58,6 +59,7 @@ void e3d_shape_unref(struct e3d_shape *shape)
 		e3d_shape_unref(tmp);
 	}
 
+	e3d_shape_unref(shape->lod);
 	e3d_primitive_unref(shape->prim);
 	free(shape);
 }
@@ -81,13 +83,189 @@ void e3d_shape_set_primitive(struct e3d_shape *shape,
 	e3d_primitive_ref(shape->prim);
 }
 
+/*
+ * Appends \lod as next coarser level of detail to the chain of \shape. The
+ * current last level of the chain is used down to the projected size \min.
+ */
+void e3d_shape_add_lod(struct e3d_shape *shape, struct e3d_shape *lod,
+								float min)
+{
+	assert(!lod->lod);
+
+	while (shape->lod)
+		shape = shape->lod;
+
+	e3d_shape_ref(lod);
+	shape->lod = lod;
+	shape->lod_min = min;
+}
+
+/*
+ * Returns the level of detail of \shape that is drawn with the current
+ * modelview matrix of \trans. The \lod_size of \trans is used if it is set,
+ * otherwise the projected size of \shape is computed without hysteresis.
+ */
+const struct e3d_shape *e3d_shape_lod(const struct e3d_shape *shape,
+						struct e3d_transform *trans)
+{
+	const struct e3d_shape *iter;
+	float size;
+
+	if (!shape->lod)
+		return shape;
+
+	if (trans->lod_size > 0.0f) {
+		size = trans->lod_size;
+	} else {
+		if (math_stack_push_mult(&trans->mod_stack,
+					math_trs_matrix_const(&shape->alter)))
+			return shape;
+		size = e3d_transform_size(trans, &shape->bounds);
+		math_stack_pop(&trans->mod_stack);
+	}
+
+	for (iter = shape; iter->lod; iter = iter->lod)
+		if (size >= iter->lod_min)
+			break;
+
+	return iter;
+}
+
+/*
+ * Returns the size that selects the levels of detail of an object with the
+ * projected size \size. \last is the size that selected the current levels of
+ * the object and is only replaced if \size differs from it by more than
+ * E3D_LOD_HYSTERESIS.
+ */
+float e3d_lod_hysteresis(float *last, float size)
+{
+	if (size > *last * (1.0f + E3D_LOD_HYSTERESIS) ||
+				size < *last * (1.0f - E3D_LOD_HYSTERESIS))
+		*last = size;
+
+	return *last;
+}
+
+/*
+ * Recomputes the bounding volume of \shape and all its childs. Primitives must
+ * have valid bounding volumes already. This also rebuilds the \alter matrices
+ * which are only read with math_trs_matrix_const() while drawing.
+ */
+void e3d_shape_update_bounds(struct e3d_shape *shape)
+{
+	struct e3d_shape *iter;
+
+	math_trs_update(&shape->alter);
+	e3d_bounds_clear(&shape->bounds);
+
+	if (shape->prim)
+		e3d_bounds_merge(&shape->bounds, &shape->prim->bounds, NULL);
+
+	for (iter = shape->childs; iter; iter = iter->next) {
+		e3d_shape_update_bounds(iter);
+		e3d_bounds_merge(&shape->bounds, &iter->bounds,
+					math_trs_matrix_const(&iter->alter));
+	}
+
+	if (shape->lod)
+		e3d_shape_update_bounds(shape->lod);
+}
+
+/*
+ * Optimizes all primitives of \shape and its childs. See
+ * e3d_primitive_optimize().
+ */
+int e3d_shape_optimize(struct e3d_shape *shape)
+{
+	struct e3d_shape *iter;
+	int ret;
+
+	if (shape->prim) {
+		ret = e3d_primitive_optimize(shape->prim);
+		if (ret)
+			return ret;
+	}
+
+	for (iter = shape->childs; iter; iter = iter->next) {
+		ret = e3d_shape_optimize(iter);
+		if (ret)
+			return ret;
+	}
+
+	if (shape->lod)
+		return e3d_shape_optimize(shape->lod);
+
+	return 0;
+}
+
+/*
+ * Converts all primitives of \shape and its childs to packed vertices. See
+ * e3d_primitive_pack().
+ */
+int e3d_shape_pack(struct e3d_shape *shape)
+{
+	struct e3d_shape *iter;
+	int ret;
+
+	if (shape->prim) {
+		ret = e3d_primitive_pack(shape->prim);
+		if (ret)
+			return ret;
+	}
+
+	for (iter = shape->childs; iter; iter = iter->next) {
+		ret = e3d_shape_pack(iter);
+		if (ret)
+			return ret;
+	}
+
+	if (shape->lod)
+		return e3d_shape_pack(shape->lod);
+
+	return 0;
+}
+
+/*
+ * Uploads the buffers of all primitives of \shape and its childs into GL buffer
+ * objects. See e3d_primitive_grab().
+ */
+int e3d_shape_grab(struct e3d_shape *shape, int hint)
+{
+	struct e3d_shape *iter;
+	int ret;
+
+	if (shape->prim) {
+		ret = e3d_primitive_grab(shape->prim, hint);
+		if (ret)
+			return ret;
+	}
+
+	for (iter = shape->childs; iter; iter = iter->next) {
+		ret = e3d_shape_grab(iter, hint);
+		if (ret)
+			return ret;
+	}
+
+	if (shape->lod)
+		return e3d_shape_grab(shape->lod, hint);
+
+	return 0;
+}
+
 void e3d_shape_draw(const struct e3d_shape *shape, int drawer,
 	const struct e3d_shader_locations *loc, struct e3d_transform *trans)
 {
 	const struct e3d_shape *iter;
 
-	math_stack_push(&trans->mod_stack);
-	math_m4_mult(MATH_TIP(&trans->mod_stack), (void*)shape->alter);
+	shape = e3d_shape_lod(shape, trans);
+	if (math_stack_push_mult(&trans->mod_stack,
+				math_trs_matrix_const(&shape->alter)))
+		return;
+
+	if (!e3d_transform_visible(trans, &shape->bounds)) {
+		math_stack_pop(&trans->mod_stack);
+		return;
+	}
 
 	if (shape->prim)
 		e3d_primitive_draw(shape->prim, drawer, loc, trans);
@@ -98,6 +276,34 @@ void e3d_shape_draw(const struct e3d_shape *shape, int drawer,
 	math_stack_pop(&trans->mod_stack);
 }
 
+/*
+ * Draws \num instances of \shape with one draw call per primitive. The
+ * instances are not culled here, so only visible instances should be passed.
+ * All instances use the same level of detail, so set the \lod_size of \trans
+ * to the size of the largest instance.
+ */
+void e3d_shape_draw_instanced(const struct e3d_shape *shape, int drawer,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans,
+			struct e3d_vbo *inst, size_t first, size_t num)
+{
+	const struct e3d_shape *iter;
+
+	shape = e3d_shape_lod(shape, trans);
+	if (math_stack_push_mult(&trans->mod_stack,
+				math_trs_matrix_const(&shape->alter)))
+		return;
+
+	if (shape->prim)
+		e3d_primitive_draw_instanced(shape->prim, drawer, loc, trans,
+							inst, first, num);
+
+	for (iter = shape->childs; iter; iter = iter->next)
+		e3d_shape_draw_instanced(iter, drawer, loc, trans, inst,
+								first, num);
+
+	math_stack_pop(&trans->mod_stack);
+}
+
 void e3d_shape_debug(struct e3d_shape *shape)
 {
 	struct e3d_shape *iter;
@@ -113,6 +319,12 @@ void e3d_shape_debug(struct e3d_shape *shape)
 	for (iter = shape->childs; iter; iter = iter->next)
 		e3d_shape_debug(iter);
 
+	if (shape->lod) {
+		ulog_flog(e3d_log, ULOG_DEBUG, "Shape %p lod below %f:\n",
+							shape, shape->lod_min);
+		e3d_shape_debug(shape->lod);
+	}
+
 	ulog_flog(e3d_log, ULOG_DEBUG, "End of shape %p debug\n", shape);
 }
 
@@ -159,6 +371,7 @@ void e3d_eye_init(struct e3d_eye *eye)
 {
 	math_v4_copy(eye->position, (math_v4){ 0.0f, 0.0f, 0.0f, 1.0f });
 	math_m4_identity(eye->matrix);
+	math_trs_identity(&eye->rotation);
 }
 
 void e3d_eye_destroy(struct e3d_eye *eye)
@@ -176,12 +389,7 @@ void e3d_eye_reset(struct e3d_eye *eye)
  */
 void e3d_eye_rotate(struct e3d_eye *eye, float angle, math_v3 axis)
 {
-	math_m4 m;
-	math_q4 q;
-
-	math_q4_rotate(q, angle, axis);
-	math_q4_to_m4(q, m);
-	math_m4_mult(eye->matrix, m);
+	math_trs_rotate(&eye->rotation, angle, axis);
 }
 
 /*
@@ -196,39 +404,41 @@ void e3d_eye_look_at(struct e3d_eye *eye, math_v3 pos, math_v3 at, math_v3 up)
 	look_at(eye->matrix, pos, at, up);
 }
 
-void e3d_eye_apply(const struct e3d_eye *eye, math_m4 m)
-{
-	math_m4_mult(m, (void*)eye->matrix);
-}
-
-void e3d_eye_supply(const struct e3d_eye *eye,
-					const struct e3d_shader_locations *loc)
+void e3d_eye_apply(struct e3d_eye *eye, math_m4 m)
 {
-	E3D(glUniform4fv(loc->uni[E3D_U_CAM_POS], 1, (void*)eye->position));
+	math_m4_mult(m, eye->matrix);
+	math_m4_mult(m, math_trs_matrix(&eye->rotation));
 }
 
 void e3d_light_init(struct e3d_light *light)
 {
 	math_m4_identity(light->matrix);
+	math_m4_identity(light->matrix_it);
 }
 
 void e3d_light_look_at(struct e3d_light *light, math_v3 pos, math_v3 at,
 								math_v3 up)
 {
 	look_at(light->matrix, pos, at, up);
+	math_m4_invert_dest(light->matrix_it, light->matrix);
 }
 
 void e3d_light_supply(const struct e3d_light *light, size_t num,
-					const struct e3d_shader_locations *loc)
+	const struct e3d_eye *eye, const struct e3d_shader_locations *loc)
 {
-	math_m4 t_mat;
+	const float *p = eye->position;
+	float c[3];
+	size_t i;
 
-	E3D(glUniform1i(loc->uni[E3D_U_LIGHT0_ENABLED], 1));
 	E3D(glUniform3f(loc->uni[E3D_U_LIGHT0_COLOR], 1.0, 1.0, 1.0));
-	E3D(glUniformMatrix4fv(loc->uni[E3D_U_LIGHT0_MAT], 1, 0,
+
+	/* only instanced shaders use the world to light matrix */
+	if (loc->uni[E3D_U_LIGHT0_MAT] >= 0)
+		E3D(glUniformMatrix4fv(loc->uni[E3D_U_LIGHT0_MAT], 1, 0,
 							(void*)light->matrix));
 
-	math_m4_invert_dest(t_mat, (void*)light->matrix);
-	E3D(glUniformMatrix4fv(loc->uni[E3D_U_LIGHT0_MAT_IT], 1, 0,
-								(void*)t_mat));
+	for (i = 0; i < 3; ++i)
+		c[i] = light->matrix[0][i] * p[0] + light->matrix[1][i] * p[1] +
+			light->matrix[2][i] * p[2] + light->matrix[3][i] * p[3];
+	E3D(glUniform3f(loc->uni[E3D_U_LIGHT0_CAMERA], c[0], c[1], c[2]));
 }
@@ -0,0 +1,528 @@
+/*
+ * airhockey - 3D engine - silhouette edges
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Edge adjacency
+ * Corners with equal positions are merged first, so edges are shared between
+ * triangles even if the vertices differ in color or normal. Edges are found
+ * with an open addressing hash table over the pair of merged positions. Each
+ * edge stores its end points and the planes of the two adjacent triangles.
+ * Edges with only one triangle are boundary edges. If more than two triangles
+ * share an edge, only the first two are used.
+ *
+ * An edge is a silhouette edge if one of its triangles faces the eye and the
+ * other one does not. Boundary edges are used if their triangle faces away
+ * from the eye, like the edges of back faces that the wireframe outline draws.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine3d.h"
+#include "log.h"
+#include "mathw.h"
+
+struct adj {
+	math_v4 *pos;
+	size_t *pid;
+	size_t *slots;
+	size_t mask;
+	size_t *first;
+	size_t pnum;
+
+	struct e3d_edge *edges;
+	size_t (*keys)[2];
+	size_t *eslots;
+	size_t emask;
+	size_t num;
+};
+
+static inline size_t corner(struct e3d_primitive *prim, size_t i)
+{
+	if (prim->index)
+		return e3d_vbo_get_idx(prim->index, prim->ioff + i);
+	return i;
+}
+
+static void load_position(struct e3d_primitive *prim, size_t i, math_v4 pos)
+{
+	if (prim->packed)
+		e3d_vertex_unpack(E3D_VBO_AT(prim->packed, prim->poff + i),
+							pos, NULL, NULL);
+	else
+		math_v4_copy(pos, E3D_VBO_AT(prim->vertex, prim->voff + i));
+}
+
+static uint32_t hash(const uint32_t *w, size_t num)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < num; ++i) {
+		h ^= w[i];
+		h *= 16777619;
+	}
+
+	return h ^ (h >> 15);
+}
+
+static size_t table_size(size_t num)
+{
+	size_t size = 16;
+
+	while (size < num * 2)
+		size <<= 1;
+
+	return size;
+}
+
+/* returns the merged position of vertex \v and adds a new one if needed */
+static size_t lookup_pos(struct adj *a, size_t v)
+{
+	uint32_t w[3];
+	float key[3];
+	size_t i, id;
+
+	/* adding zero turns negative zeros into positive ones */
+	for (i = 0; i < 3; ++i)
+		key[i] = a->pos[v][i] + 0.0f;
+	memcpy(w, key, sizeof(w));
+
+	i = hash(w, 3) & a->mask;
+	while (a->slots[i]) {
+		id = a->slots[i] - 1;
+		if (a->pos[a->first[id]][0] == key[0] &&
+				a->pos[a->first[id]][1] == key[1] &&
+				a->pos[a->first[id]][2] == key[2])
+			return id;
+		i = (i + 1) & a->mask;
+	}
+
+	id = a->pnum++;
+	a->first[id] = v;
+	a->slots[i] = id + 1;
+	return id;
+}
+
+static void add_edge(struct adj *a, size_t p0, size_t p1, const math_v4 plane)
+{
+	struct e3d_edge *e;
+	uint32_t w[2];
+	size_t i, id, lo, hi;
+
+	lo = (p0 < p1) ? p0 : p1;
+	hi = (p0 < p1) ? p1 : p0;
+	w[0] = lo;
+	w[1] = hi;
+
+	i = hash(w, 2) & a->emask;
+	while (a->eslots[i]) {
+		id = a->eslots[i] - 1;
+		if (a->keys[id][0] == lo && a->keys[id][1] == hi) {
+			e = &a->edges[id];
+			if (e->boundary) {
+				math_v4_copy(e->planes[1], (void*)plane);
+				e->boundary = false;
+			}
+			return;
+		}
+		i = (i + 1) & a->emask;
+	}
+
+	id = a->num++;
+	a->eslots[i] = id + 1;
+	a->keys[id][0] = lo;
+	a->keys[id][1] = hi;
+
+	e = &a->edges[id];
+	memcpy(e->a, a->pos[a->first[p0]], sizeof(e->a));
+	memcpy(e->b, a->pos[a->first[p1]], sizeof(e->b));
+	math_v4_copy(e->planes[0], (void*)plane);
+	math_v4_copy(e->planes[1], (void*)plane);
+	e->boundary = true;
+}
+
+static void add_tri(struct adj *a, size_t v0, size_t v1, size_t v2)
+{
+	size_t p0, p1, p2, i;
+	const float *x, *y, *z;
+	math_v3 e1, e2;
+	math_v4 plane;
+
+	p0 = a->pid[v0];
+	p1 = a->pid[v1];
+	p2 = a->pid[v2];
+	if (p0 == p1 || p1 == p2 || p2 == p0)
+		return;
+
+	x = a->pos[v0];
+	y = a->pos[v1];
+	z = a->pos[v2];
+	for (i = 0; i < 3; ++i) {
+		e1[i] = y[i] - x[i];
+		e2[i] = z[i] - x[i];
+	}
+
+	plane[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	plane[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	plane[2] = e1[0] * e2[1] - e1[1] * e2[0];
+	plane[3] = -(plane[0] * x[0] + plane[1] * x[1] + plane[2] * x[2]);
+
+	add_edge(a, p0, p1, plane);
+	add_edge(a, p1, p2, plane);
+	add_edge(a, p2, p0, plane);
+}
+
+static void free_adj(struct adj *a)
+{
+	free(a->eslots);
+	free(a->keys);
+	free(a->edges);
+	free(a->first);
+	free(a->slots);
+	free(a->pid);
+	free(a->pos);
+}
+
+/*
+ * Computes the edge adjacency of \prim which is needed for
+ * e3d_silhouette_add(). Only triangle lists, strips and fans are supported,
+ * other primitives get no edges. The client memory of the vertices must be
+ * available. The edges are dropped when the vertices or indices of \prim are
+ * replaced. Does nothing if \prim already has edges.
+ */
+int e3d_primitive_build_edges(struct e3d_primitive *prim)
+{
+	struct adj a;
+	struct e3d_edge *edges;
+	size_t i, vnum, tnum;
+
+	if (prim->edges || prim->num < 3)
+		return 0;
+
+	if (prim->type == GL_TRIANGLES)
+		tnum = prim->num / 3;
+	else if (prim->type == GL_TRIANGLE_STRIP ||
+					prim->type == GL_TRIANGLE_FAN)
+		tnum = prim->num - 2;
+	else
+		return 0;
+
+	if (prim->packed)
+		assert(prim->packed->data);
+	else
+		assert(prim->vertex && prim->vertex->data);
+
+	vnum = 0;
+	for (i = 0; i < prim->num; ++i)
+		if (corner(prim, i) >= vnum)
+			vnum = corner(prim, i) + 1;
+
+	memset(&a, 0, sizeof(a));
+	a.mask = table_size(vnum) - 1;
+	a.emask = table_size(tnum * 3) - 1;
+	a.pos = malloc(sizeof(*a.pos) * vnum);
+	a.pid = malloc(sizeof(*a.pid) * vnum);
+	a.slots = calloc(a.mask + 1, sizeof(*a.slots));
+	a.first = malloc(sizeof(*a.first) * vnum);
+	a.edges = malloc(sizeof(*a.edges) * tnum * 3);
+	a.keys = malloc(sizeof(*a.keys) * tnum * 3);
+	a.eslots = calloc(a.emask + 1, sizeof(*a.eslots));
+	if (!a.pos || !a.pid || !a.slots || !a.first || !a.edges ||
+							!a.keys || !a.eslots) {
+		free_adj(&a);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < vnum; ++i) {
+		load_position(prim, i, a.pos[i]);
+		a.pid[i] = lookup_pos(&a, i);
+	}
+
+	for (i = 0; i + 2 < prim->num; ) {
+		switch (prim->type) {
+			case GL_TRIANGLES:
+				add_tri(&a, corner(prim, i),
+						corner(prim, i + 1),
+						corner(prim, i + 2));
+				i += 3;
+				break;
+			case GL_TRIANGLE_STRIP:
+				add_tri(&a, corner(prim, i + (i & 1)),
+						corner(prim, i + 1 - (i & 1)),
+						corner(prim, i + 2));
+				i += 1;
+				break;
+			default:
+				add_tri(&a, corner(prim, 0),
+						corner(prim, i + 1),
+						corner(prim, i + 2));
+				i += 1;
+				break;
+		}
+	}
+
+	/* shrinking cannot fail in practice but keep the array if it does */
+	edges = realloc(a.edges, sizeof(*edges) * (a.num ? a.num : 1));
+	if (edges)
+		a.edges = edges;
+
+	prim->edges = a.edges;
+	prim->edge_num = a.num;
+	a.edges = NULL;
+	free_adj(&a);
+
+	return 0;
+}
+
+/*
+ * Computes the edge adjacency of all primitives of \shape and its childs. See
+ * e3d_primitive_build_edges().
+ */
+int e3d_shape_build_edges(struct e3d_shape *shape)
+{
+	struct e3d_shape *iter;
+	int ret;
+
+	if (shape->prim) {
+		ret = e3d_primitive_build_edges(shape->prim);
+		if (ret)
+			return ret;
+	}
+
+	for (iter = shape->childs; iter; iter = iter->next) {
+		ret = e3d_shape_build_edges(iter);
+		if (ret)
+			return ret;
+	}
+
+	if (shape->lod)
+		return e3d_shape_build_edges(shape->lod);
+
+	return 0;
+}
+
+void e3d_silhouette_init(struct e3d_silhouette *sil)
+{
+	memset(sil, 0, sizeof(*sil));
+}
+
+void e3d_silhouette_destroy(struct e3d_silhouette *sil)
+{
+	e3d_vbo_unref(sil->vbo);
+	memset(sil, 0, sizeof(*sil));
+}
+
+void e3d_silhouette_reset(struct e3d_silhouette *sil)
+{
+	sil->num = 0;
+}
+
+/* drops the cached edges, see e3d_silhouette_add_cached() */
+void e3d_silhouette_invalidate(struct e3d_silhouette *sil)
+{
+	sil->cached = false;
+}
+
+/* makes room for \num more line vertices */
+static int reserve(struct e3d_silhouette *sil, size_t num)
+{
+	struct e3d_vbo *vbo;
+	size_t size;
+	int ret;
+
+	if (sil->vbo && sil->num + num <= sil->vbo->num)
+		return 0;
+
+	size = sil->vbo ? sil->vbo->num : 256;
+	while (size < sil->num + num)
+		size <<= 1;
+
+	ret = e3d_vbo_new_v4(&vbo, size);
+	if (ret)
+		return ret;
+
+	if (sil->vbo) {
+		memcpy(vbo->data, sil->vbo->data,
+				sizeof(math_v4) * sil->num);
+		e3d_vbo_unref(sil->vbo);
+	}
+
+	sil->vbo = vbo;
+	return 0;
+}
+
+static void transform_point(float *dest, math_m4 m, const float *v)
+{
+	size_t i;
+
+	for (i = 0; i < 3; ++i)
+		dest[i] = m[0][i] * v[0] + m[1][i] * v[1] + m[2][i] * v[2] +
+								m[3][i];
+	dest[3] = 1.0f;
+}
+
+static inline bool facing(const math_v4 plane, const math_v3 eye)
+{
+	return plane[0] * eye[0] + plane[1] * eye[1] + plane[2] * eye[2] +
+							plane[3] > 0.0f;
+}
+
+/*
+ * Adds the silhouette edges of \prim as seen from \eye to \sil. \m transforms
+ * \prim into world space and \eye is the eye position in world space.
+ * Primitives without edge adjacency are skipped.
+ */
+int e3d_silhouette_add(struct e3d_silhouette *sil, struct e3d_primitive *prim,
+						math_m4 m, const math_v3 eye)
+{
+	const struct e3d_edge *e;
+	math_m4 inv;
+	math_v4 local;
+	bool f0, f1;
+	size_t i;
+	float *out;
+	int ret;
+
+	if (!prim->edge_num)
+		return 0;
+
+	/* the new edges overwrite the cached ones */
+	if (sil->num < sil->cache_num)
+		sil->cached = false;
+
+	math_m4_invert_dest(inv, m);
+	transform_point(local, inv, eye);
+
+	for (i = 0; i < prim->edge_num; ++i) {
+		e = &prim->edges[i];
+		f0 = facing(e->planes[0], local);
+		f1 = facing(e->planes[1], local);
+
+		if (e->boundary ? f0 : f0 == f1)
+			continue;
+
+		ret = reserve(sil, 2);
+		if (ret)
+			return ret;
+
+		out = E3D_VBO_AT(sil->vbo, sil->num);
+		transform_point(out, m, e->a);
+		transform_point(out + 4, m, e->b);
+		sil->num += 2;
+	}
+
+	return 0;
+}
+
+/*
+ * Same as e3d_silhouette_add() but reuses the edges of the previous call if
+ * \prim, \m and \eye did not change. This must be the first primitive that is
+ * added after e3d_silhouette_reset(). The cached edges stay valid as long as
+ * \prim is not modified and they are not overwritten by other edges because
+ * this is skipped in a frame.
+ */
+int e3d_silhouette_add_cached(struct e3d_silhouette *sil,
+		struct e3d_primitive *prim, math_m4 m, const math_v3 eye)
+{
+	int ret;
+
+	assert(!sil->num);
+
+	if (sil->cached && sil->cache_prim == prim &&
+			!memcmp(sil->cache_m, m, sizeof(sil->cache_m)) &&
+			!memcmp(sil->cache_eye, eye, sizeof(sil->cache_eye))) {
+		sil->num = sil->cache_num;
+		return 0;
+	}
+
+	sil->cached = false;
+	ret = e3d_silhouette_add(sil, prim, m, eye);
+	if (ret)
+		return ret;
+
+	sil->cached = true;
+	sil->cache_num = sil->num;
+	sil->cache_prim = prim;
+	memcpy(sil->cache_m, m, sizeof(sil->cache_m));
+	memcpy(sil->cache_eye, eye, sizeof(sil->cache_eye));
+	return 0;
+}
+
+/*
+ * Adds the silhouette edges of all visible primitives of \shape and its childs.
+ * The current modelview matrix of \trans is the parent transformation of
+ * \shape.
+ */
+int e3d_silhouette_add_shape(struct e3d_silhouette *sil,
+			const struct e3d_shape *shape,
+			struct e3d_transform *trans, const math_v3 eye)
+{
+	const struct e3d_shape *iter;
+	int ret;
+
+	shape = e3d_shape_lod(shape, trans);
+	ret = math_stack_push_mult(&trans->mod_stack,
+				math_trs_matrix_const(&shape->alter));
+	if (ret)
+		return ret;
+
+	if (!e3d_transform_visible(trans, &shape->bounds))
+		goto out;
+
+	if (shape->prim) {
+		ret = e3d_silhouette_add(sil, shape->prim,
+					MATH_TIP(&trans->mod_stack), eye);
+		if (ret)
+			goto out;
+	}
+
+	for (iter = shape->childs; iter; iter = iter->next) {
+		ret = e3d_silhouette_add_shape(sil, iter, trans, eye);
+		if (ret)
+			goto out;
+	}
+
+out:
+	math_stack_pop(&trans->mod_stack);
+	return ret;
+}
+
+/*
+ * Draws all silhouette edges of \sil as black lines with one draw call. The
+ * edges are in world space so the modelview matrix of \trans is applied on
+ * top of them.
+ */
+void e3d_silhouette_draw(struct e3d_silhouette *sil,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans)
+{
+	math_m4 mpe;
+	GLint attr;
+
+	if (!sil->num)
+		return;
+
+	/* the client memory is used if the upload fails */
+	e3d_vbo_grab_range(sil->vbo, sil->num, E3D_VBO_STREAM_DRAW);
+
+	math_m4_mult_dest(mpe, MATH_TIP(&trans->proj_stack),
+						MATH_TIP(&trans->eye_stack));
+	math_m4_mult(mpe, MATH_TIP(&trans->mod_stack));
+	E3D(glUniformMatrix4fv(loc->uni[E3D_U_MPE_MAT], 1, 0, (void*)mpe));
+	E3D(glUniform4f(loc->uni[E3D_U_COLOR], 0.0, 0.0, 0.0, 1.0));
+
+	attr = loc->attr[E3D_A_VERTEX];
+	E3D(glEnableVertexAttribArray(attr));
+	e3d_vbo_bind(sil->vbo, attr, 0);
+	glDrawArrays(GL_LINES, 0, sil->num);
+	E3D(glDisableVertexAttribArray(attr));
+
+	++trans->drawn;
+}
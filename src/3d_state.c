@@ -0,0 +1,363 @@
+/*
+ * airhockey - 3D engine - GL state cache
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * The state setting functions of the E3D table are replaced by wrappers that
+ * remember the last value that was passed to GL and drop calls that would not
+ * change it. The original functions are kept in \real.
+ * Element array bindings, attribute array enables and divisors belong to the
+ * bound vertex array object. The state of vertex array object 0 is saved while
+ * another one is bound, the state of all others is unknown when they are
+ * bound. Unknown state is marked with values that GL never uses so the next
+ * call is always forwarded.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SFML/OpenGL.h>
+
+#include "engine3d.h"
+#include "log.h"
+
+#define UNKNOWN_ID ((GLuint)-1)
+#define UNKNOWN_ENUM ((GLenum)0)
+#define ATTRS 32
+
+struct vao_state {
+	GLuint element;
+	uint32_t enabled;
+	uint32_t enabled_known;
+	GLuint divisor[ATTRS];
+	uint32_t divisor_known;
+};
+
+static const GLenum caps[] = {
+	GL_DEPTH_TEST,
+	GL_CULL_FACE,
+	GL_BLEND,
+	GL_STENCIL_TEST,
+	GL_SCISSOR_TEST,
+};
+
+#define CAPS (sizeof(caps) / sizeof(*caps))
+
+static struct {
+	GLuint program;
+	GLuint array;
+	GLuint vao;
+	struct vao_state cur;
+	struct vao_state vao0;
+
+	/* 0 is disabled, 1 enabled and everything else unknown */
+	int cap[CAPS];
+
+	GLenum polygon_mode;
+	GLenum depth_func;
+	GLenum cull_face;
+	GLfloat line_width;
+} state;
+
+static struct e3d_functions real;
+static bool installed;
+
+struct e3d_state_stats e3d_state_stats;
+
+static inline bool elide(bool same)
+{
+	if (same)
+		++e3d_state_stats.elided;
+	else
+		++e3d_state_stats.issued;
+	return same;
+}
+
+static void vao_state_reset(struct vao_state *vao)
+{
+	memset(vao, 0, sizeof(*vao));
+	vao->element = UNKNOWN_ID;
+}
+
+/*
+ * Forgets all cached state. Call this after GL state was changed without the
+ * E3D table, for instance, if another context was made current.
+ */
+void e3d_state_reset()
+{
+	size_t i;
+
+	state.program = UNKNOWN_ID;
+	state.array = UNKNOWN_ID;
+	state.vao = UNKNOWN_ID;
+	vao_state_reset(&state.cur);
+	vao_state_reset(&state.vao0);
+
+	for (i = 0; i < CAPS; ++i)
+		state.cap[i] = -1;
+
+	state.polygon_mode = UNKNOWN_ENUM;
+	state.depth_func = UNKNOWN_ENUM;
+	state.cull_face = UNKNOWN_ENUM;
+	state.line_width = -1.0f;
+}
+
+void e3d_state_stats_reset()
+{
+	memset(&e3d_state_stats, 0, sizeof(e3d_state_stats));
+}
+
+static void APIENTRY use_program(GLuint program)
+{
+	if (elide(state.program == program))
+		return;
+
+	state.program = program;
+	real.glUseProgram(program);
+}
+
+static void APIENTRY delete_program(GLuint program)
+{
+	/* the program stays in use until another one is used */
+	if (state.program == program)
+		state.program = UNKNOWN_ID;
+	real.glDeleteProgram(program);
+}
+
+static void APIENTRY bind_buffer(GLenum target, GLuint buffer)
+{
+	GLuint *cached;
+
+	if (target == GL_ARRAY_BUFFER)
+		cached = &state.array;
+	else if (target == GL_ELEMENT_ARRAY_BUFFER)
+		cached = &state.cur.element;
+	else
+		cached = NULL;
+
+	if (elide(cached && *cached == buffer))
+		return;
+
+	if (cached)
+		*cached = buffer;
+	real.glBindBuffer(target, buffer);
+}
+
+static void APIENTRY delete_buffers(GLsizei n, const GLuint *buffers)
+{
+	GLsizei i;
+
+	/*
+	 * Deleting bound buffers binds 0 instead. This only affects the bound
+	 * vertex array object. If another one is bound, vertex array object 0
+	 * keeps the deleted name, which may be reused, so its binding becomes
+	 * unknown.
+	 */
+	for (i = 0; i < n; ++i) {
+		if (state.array == buffers[i])
+			state.array = 0;
+		if (state.cur.element == buffers[i])
+			state.cur.element = 0;
+		if (state.vao != 0 && state.vao0.element == buffers[i])
+			state.vao0.element = UNKNOWN_ID;
+	}
+
+	real.glDeleteBuffers(n, buffers);
+}
+
+static void APIENTRY bind_vertex_array(GLuint array)
+{
+	if (elide(state.vao == array))
+		return;
+
+	if (state.vao == 0)
+		state.vao0 = state.cur;
+
+	if (array == 0)
+		state.cur = state.vao0;
+	else
+		vao_state_reset(&state.cur);
+
+	state.vao = array;
+	real.glBindVertexArray(array);
+}
+
+static void APIENTRY delete_vertex_arrays(GLsizei n, const GLuint *arrays)
+{
+	GLsizei i;
+
+	/* deleting the bound vertex array object binds 0 instead */
+	for (i = 0; i < n; ++i) {
+		if (state.vao == arrays[i] && state.vao != 0) {
+			state.vao = 0;
+			state.cur = state.vao0;
+		}
+	}
+
+	real.glDeleteVertexArrays(n, arrays);
+}
+
+static bool attr_cached(uint32_t bits, uint32_t known, GLuint index,
+								bool value)
+{
+	if (index >= ATTRS || !(known & (1U << index)))
+		return false;
+
+	return !!(bits & (1U << index)) == value;
+}
+
+static void set_attr(GLuint index, bool value)
+{
+	if (index >= ATTRS)
+		return;
+
+	state.cur.enabled_known |= 1U << index;
+	if (value)
+		state.cur.enabled |= 1U << index;
+	else
+		state.cur.enabled &= ~(1U << index);
+}
+
+static void APIENTRY enable_attr(GLuint index)
+{
+	if (elide(attr_cached(state.cur.enabled, state.cur.enabled_known,
+							index, true)))
+		return;
+
+	set_attr(index, true);
+	real.glEnableVertexAttribArray(index);
+}
+
+static void APIENTRY disable_attr(GLuint index)
+{
+	if (elide(attr_cached(state.cur.enabled, state.cur.enabled_known,
+							index, false)))
+		return;
+
+	set_attr(index, false);
+	real.glDisableVertexAttribArray(index);
+}
+
+static void APIENTRY attr_divisor(GLuint index, GLuint divisor)
+{
+	bool same;
+
+	same = index < ATTRS &&
+		(state.cur.divisor_known & (1U << index)) &&
+		state.cur.divisor[index] == divisor;
+	if (elide(same))
+		return;
+
+	if (index < ATTRS) {
+		state.cur.divisor_known |= 1U << index;
+		state.cur.divisor[index] = divisor;
+	}
+	real.glVertexAttribDivisor(index, divisor);
+}
+
+static int *cap_state(GLenum cap)
+{
+	size_t i;
+
+	for (i = 0; i < CAPS; ++i)
+		if (caps[i] == cap)
+			return &state.cap[i];
+
+	return NULL;
+}
+
+static void APIENTRY enable(GLenum cap)
+{
+	int *cached = cap_state(cap);
+
+	if (elide(cached && *cached == 1))
+		return;
+
+	if (cached)
+		*cached = 1;
+	real.glEnable(cap);
+}
+
+static void APIENTRY disable(GLenum cap)
+{
+	int *cached = cap_state(cap);
+
+	if (elide(cached && *cached == 0))
+		return;
+
+	if (cached)
+		*cached = 0;
+	real.glDisable(cap);
+}
+
+static void APIENTRY polygon_mode(GLenum face, GLenum mode)
+{
+	/* only the common case of setting both faces is cached */
+	if (elide(face == GL_FRONT_AND_BACK && state.polygon_mode == mode))
+		return;
+
+	state.polygon_mode = (face == GL_FRONT_AND_BACK) ? mode : UNKNOWN_ENUM;
+	real.glPolygonMode(face, mode);
+}
+
+static void APIENTRY depth_func(GLenum func)
+{
+	if (elide(state.depth_func == func))
+		return;
+
+	state.depth_func = func;
+	real.glDepthFunc(func);
+}
+
+static void APIENTRY cull_face(GLenum mode)
+{
+	if (elide(state.cull_face == mode))
+		return;
+
+	state.cull_face = mode;
+	real.glCullFace(mode);
+}
+
+static void APIENTRY line_width(GLfloat width)
+{
+	if (elide(state.line_width == width))
+		return;
+
+	state.line_width = width;
+	real.glLineWidth(width);
+}
+
+/*
+ * Replaces the state setting functions of the E3D table with the caching
+ * wrappers. This is done only once as the wrappers would wrap themselves.
+ */
+void e3d_state_init()
+{
+	if (installed)
+		return;
+
+	installed = true;
+	real = e3d_gl;
+	e3d_state_reset();
+	e3d_state_stats_reset();
+
+	e3d_gl.glUseProgram = use_program;
+	e3d_gl.glDeleteProgram = delete_program;
+	e3d_gl.glBindBuffer = bind_buffer;
+	e3d_gl.glDeleteBuffers = delete_buffers;
+	e3d_gl.glBindVertexArray = bind_vertex_array;
+	e3d_gl.glDeleteVertexArrays = delete_vertex_arrays;
+	e3d_gl.glEnableVertexAttribArray = enable_attr;
+	e3d_gl.glDisableVertexAttribArray = disable_attr;
+	e3d_gl.glVertexAttribDivisor = attr_divisor;
+	e3d_gl.glEnable = enable;
+	e3d_gl.glDisable = disable;
+	e3d_gl.glPolygonMode = polygon_mode;
+	e3d_gl.glDepthFunc = depth_func;
+	e3d_gl.glCullFace = cull_face;
+	e3d_gl.glLineWidth = line_width;
+}
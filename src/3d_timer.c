@@ -0,0 +1,108 @@
+/*
+ * airhockey - 3D engine - GPU timers
+ * Written 2011 by David Herrmann <dh.herrmann@googlemail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Each measurement uses the next query of a small ring. Before a measurement
+ * starts, all pending queries are polled in the order they were issued and
+ * the available results are added up. Usually a result is available one or
+ * two frames later. If the next query is still pending, the measurement is
+ * skipped instead of waiting for the GPU. The queries are generated with the
+ * first measurement so timers can be initialized without a GL context.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SFML/OpenGL.h>
+
+#include "engine3d.h"
+#include "log.h"
+
+void e3d_timer_init(struct e3d_timer *timer)
+{
+	memset(timer, 0, sizeof(*timer));
+}
+
+void e3d_timer_destroy(struct e3d_timer *timer)
+{
+	if (timer->query[0])
+		E3D(glDeleteQueries(E3D_TIMER_QUERIES, timer->query));
+	memset(timer, 0, sizeof(*timer));
+}
+
+static void collect(struct e3d_timer *timer)
+{
+	size_t i, idx;
+	GLint available;
+	GLuint64 ns;
+
+	for (i = 0; i < E3D_TIMER_QUERIES; ++i) {
+		idx = (timer->cur + i) % E3D_TIMER_QUERIES;
+		if (!timer->pending[idx])
+			continue;
+
+		E3D(glGetQueryObjectiv(timer->query[idx],
+					GL_QUERY_RESULT_AVAILABLE, &available));
+		if (!available)
+			break;
+
+		E3D(glGetQueryObjectui64v(timer->query[idx], GL_QUERY_RESULT,
+									&ns));
+		timer->pending[idx] = false;
+		timer->ns += ns;
+		++timer->samples;
+	}
+}
+
+/*
+ * Starts measuring the GPU time of the following GL commands. Only one timer
+ * can run at a time.
+ */
+void e3d_timer_begin(struct e3d_timer *timer)
+{
+	if (!timer->query[0])
+		E3D(glGenQueries(E3D_TIMER_QUERIES, timer->query));
+
+	collect(timer);
+
+	if (timer->pending[timer->cur]) {
+		++timer->skipped;
+		return;
+	}
+
+	E3D(glBeginQuery(GL_TIME_ELAPSED, timer->query[timer->cur]));
+	timer->running = true;
+}
+
+void e3d_timer_end(struct e3d_timer *timer)
+{
+	if (!timer->running)
+		return;
+
+	E3D(glEndQuery(GL_TIME_ELAPSED));
+	timer->running = false;
+	timer->pending[timer->cur] = true;
+	timer->cur = (timer->cur + 1) % E3D_TIMER_QUERIES;
+}
+
+/* forgets the collected results but keeps the pending queries */
+void e3d_timer_reset(struct e3d_timer *timer)
+{
+	timer->ns = 0;
+	timer->samples = 0;
+	timer->skipped = 0;
+}
+
+/* average GPU time of the collected results in milliseconds */
+float e3d_timer_ms(const struct e3d_timer *timer)
+{
+	if (!timer->samples)
+		return 0.0f;
+
+	return timer->ns / (double)timer->samples / 1000000.0;
+}
@@ -86,6 +86,7 @@ struct e3d_window *e3d_window_new()
 
 	ulog_flog(e3d_log, ULOG_DEBUG,
 		"Window: Creating window %p (frames %lu)\n", wnd, wnd->frames);
+	e3d_state_reset();
 
 	ev.Size.Width = mode.Width;
 	ev.Size.Height = mode.Height;
@@ -119,6 +120,7 @@ void e3d_window_free(struct e3d_window *wnd)
 void e3d_window_activate(struct e3d_window *wnd)
 {
 	sfWindow_SetActive(wnd->ctx, true);
+	e3d_state_reset();
 }
 
 static int convert_event(const sfEvent *event, struct e3d_event *out)
@@ -122,9 +122,45 @@ err:
 	return ret;
 }
 
-static int load_raw_index(struct e3d_vbo **vbo, const struct uconf_entry *e)
+/*
+ * Loads the explicit index list \e. All indices must be smaller than \vnum. The
+ * narrowest index type that can address \vnum vertices is used.
+ */
+static int load_raw_index(struct e3d_vbo **vbo, const struct uconf_entry *e,
+								size_t vnum)
 {
+	int ret;
+	struct e3d_vbo *v;
+	const struct uconf_entry *iter;
+	size_t i, idx;
+
+	assert(e);
+
+	if (!uconf_entry_is_list(e) || !e->v.list.num)
+		return -EINVAL;
+
+	ret = e3d_vbo_new_idx_type(&v, e3d_idx_type(vnum), e->v.list.num);
+	if (ret)
+		return ret;
+
+	i = 0;
+	UCONF_ENTRY_FOR(e, iter) {
+		ret = config_load_size(iter, &idx);
+		if (ret)
+			goto err;
+		if (idx >= vnum) {
+			ret = -EINVAL;
+			goto err;
+		}
+		e3d_vbo_set_idx(v, i++, idx);
+	}
+
+	*vbo = v;
 	return 0;
+
+err:
+	e3d_vbo_unref(v);
+	return ret;
 }
 
 /*
@@ -136,7 +172,7 @@ static int load_raw(const struct uconf_entry *e, struct e3d_shape *shape)
 {
 	int ret = 0;
 	const struct uconf_entry *vertex, *color, *normal, *index, *iter;
-	size_t voff, coff, noff, ioff;
+	size_t voff, coff, noff, ioff, vnum;
 	GLuint type;
 	struct e3d_shape *new;
 	struct e3d_vbo *vbo;
@@ -238,36 +274,57 @@ static int load_raw(const struct uconf_entry *e, struct e3d_shape *shape)
 	ret = load_raw_vertex(&vbo, vertex);
 	if (ret)
 		goto err_prim;
-	prim->num = vbo->num;
+	if (voff >= vbo->num) {
+		e3d_vbo_unref(vbo);
+		ret = -EINVAL;
+		goto err_prim;
+	}
+	vnum = vbo->num - voff;
+	prim->num = vnum;
 	e3d_primitive_set_vertex(prim, voff, vbo);
 	e3d_vbo_unref(vbo);
 
-	ret = load_raw_color(&vbo, color, prim->num);
+	ret = load_raw_color(&vbo, color, coff + vnum);
 	if (ret)
 		goto err_prim;
 	e3d_primitive_set_color(prim, coff, vbo);
 	e3d_vbo_unref(vbo);
 
 	if (normal) {
-		ret = load_raw_normal(&vbo, normal, prim->num);
+		ret = load_raw_normal(&vbo, normal, noff + vnum);
 		if (ret)
 			goto err_prim;
 		e3d_primitive_set_normal(prim, noff, vbo);
 		e3d_vbo_unref(vbo);
-	} else {
-		ret = e3d_primitive_generate_normals(prim);
-		if (ret)
-			goto err_prim;
 	}
 
 	if (index) {
-		ret = load_raw_index(&vbo, index);
+		ret = load_raw_index(&vbo, index, vnum);
 		if (ret)
 			goto err_prim;
+		if (ioff >= vbo->num) {
+			e3d_vbo_unref(vbo);
+			ret = -EINVAL;
+			goto err_prim;
+		}
+		prim->num = vbo->num - ioff;
 		e3d_primitive_set_index(prim, ioff, vbo);
 		e3d_vbo_unref(vbo);
 	}
 
+	/* normals depend on the index so generate them after it is set */
+	if (!normal) {
+		ret = e3d_primitive_generate_normals(prim, 0);
+		if (ret)
+			goto err_prim;
+	}
+
+	/* merge duplicate corners into an indexed mesh */
+	ret = e3d_primitive_weld(prim);
+	if (ret)
+		goto err_prim;
+
+	e3d_primitive_update_bounds(prim);
 	e3d_shape_set_primitive(new, prim);
 	e3d_shape_link(shape, new);
 
@@ -332,14 +389,14 @@ static void fill_cylinder(struct e3d_vbo *vbo, math_v3 extents, size_t detail)
 }
 
 /*
- * This creates a new cylinder with the given extends. It creates two circles
- * for the bottom and top with triangle fans and one primitive with triangles
- * for the side wall.
+ * This generates the primitives of a new cylinder with the given extends. Two
+ * circles for the bottom and top use triangle fans and the side wall uses
+ * triangles. They are stored into \prims in this order with one reference
+ * each.
  */
-static int create_cylinder(struct e3d_shape *shape, math_v3 extents,
+static int generate_cylinder(struct e3d_primitive **prims, math_v3 extents,
 						math_v4 col, size_t detail)
 {
-	struct e3d_shape *bottom, *top, *round;
 	struct e3d_primitive *pbottom, *ptop, *pround;
 	struct e3d_vbo *vb, *cb, *nb;
 	int ret = 0;
@@ -410,19 +467,6 @@ static int create_cylinder(struct e3d_shape *shape, math_v3 extents,
 	e3d_primitive_set_normal(pround, 0, nb);
 	e3d_vbo_unref(nb);
 
-	/* shapes */
-	ret = e3d_shape_new(&bottom);
-	if (ret)
-		goto err_pround;
-
-	ret = e3d_shape_new(&top);
-	if (ret)
-		goto err_bottom;
-
-	ret = e3d_shape_new(&round);
-	if (ret)
-		goto err_top;
-
 	/* triangle fan buffer for bottom circle with indices and normals */
 	/* reverse order as we have to face down */
 	*(GLuint*)E3D_VBO_AT(pbottom->index, 0) = 0;
@@ -437,7 +481,7 @@ static int create_cylinder(struct e3d_shape *shape, math_v3 extents,
 	pbottom->type = GL_TRIANGLE_FAN;
 	e3d_primitive_set_vertex(pbottom, 0, vb);
 	e3d_primitive_set_color(pbottom, 0, cb);
-	e3d_shape_set_primitive(bottom, pbottom);
+	e3d_primitive_update_bounds(pbottom);
 
 	/* triangle fan buffer for upper circle with indices and normals */
 	*(GLuint*)E3D_VBO_AT(ptop->index, 0) = 0;
@@ -452,7 +496,7 @@ static int create_cylinder(struct e3d_shape *shape, math_v3 extents,
 	ptop->type = GL_TRIANGLE_FAN;
 	e3d_primitive_set_vertex(ptop, detail, vb);
 	e3d_primitive_set_color(ptop, detail, cb);
-	e3d_shape_set_primitive(top, ptop);
+	e3d_primitive_update_bounds(ptop);
 
 	/* create triangles buffer for side wall */
 	for (i = 0; i < (detail - 1); ++i) {
@@ -475,21 +519,18 @@ static int create_cylinder(struct e3d_shape *shape, math_v3 extents,
 	pround->type = GL_TRIANGLES;
 	e3d_primitive_set_vertex(pround, 0, vb);
 	e3d_primitive_set_color(pround, 0, cb);
-	ret = e3d_primitive_generate_normals(pround);
+	ret = e3d_primitive_generate_normals(pround, 0);
 	if (ret)
-		goto err_round;
-	e3d_shape_set_primitive(round, pround);
-
-	e3d_shape_link(shape, bottom);
-	e3d_shape_link(shape, top);
-	e3d_shape_link(shape, round);
-
-err_round:
-	e3d_shape_unref(round);
-err_top:
-	e3d_shape_unref(top);
-err_bottom:
-	e3d_shape_unref(bottom);
+		goto err_pround;
+	e3d_primitive_update_bounds(pround);
+
+	prims[0] = pbottom;
+	prims[1] = ptop;
+	prims[2] = pround;
+	e3d_vbo_unref(cb);
+	e3d_vbo_unref(vb);
+	return 0;
+
 err_pround:
 	e3d_primitive_unref(pround);
 err_ptop:
@@ -503,9 +544,189 @@ err_vert:
 	return ret;
 }
 
+/*
+ * Mesh cache
+ * Generated primitives are cached with the parameters of their generator, so
+ * loading equal shapes again shares the primitives and their buffers instead of
+ * generating them again. The primitives are optimized and packed before they
+ * are cached, so every shape gets the same primitives regardless of its
+ * "optimize" entry and of the order the shapes are loaded in. The cache keeps a
+ * reference to all primitives until config_flush_meshes() is called, which must
+ * happen before the GL context is destroyed.
+ */
+
+#define MESH_PRIMS 3
+
+struct mesh {
+	struct mesh *next;
+	math_v3 extents;
+	math_v4 color;
+	size_t detail;
+	struct e3d_primitive *prims[MESH_PRIMS];
+};
+
+static struct mesh *meshes;
+
+void config_flush_meshes()
+{
+	struct mesh *mesh;
+	size_t i;
+
+	while (meshes) {
+		mesh = meshes;
+		meshes = mesh->next;
+		for (i = 0; i < MESH_PRIMS; ++i)
+			e3d_primitive_unref(mesh->prims[i]);
+		free(mesh);
+	}
+}
+
+/*
+ * Stores the primitives of the cylinder with the given parameters into \prims
+ * with one reference each. They are generated and cached if they are not in
+ * the cache, yet.
+ */
+static int get_cylinder(struct e3d_primitive **prims, math_v3 extents,
+						math_v4 col, size_t detail)
+{
+	struct mesh *mesh;
+	size_t i;
+	int ret;
+
+	for (mesh = meshes; mesh; mesh = mesh->next) {
+		if (mesh->detail == detail &&
+			!memcmp(mesh->extents, extents, sizeof(math_v3)) &&
+			!memcmp(mesh->color, col, sizeof(math_v4)))
+			break;
+	}
+
+	if (!mesh) {
+		mesh = malloc(sizeof(*mesh));
+		if (!mesh)
+			return -ENOMEM;
+
+		memset(mesh, 0, sizeof(*mesh));
+		math_v3_copy(mesh->extents, extents);
+		math_v4_copy(mesh->color, col);
+		mesh->detail = detail;
+
+		ret = generate_cylinder(mesh->prims, extents, col, detail);
+		for (i = 0; !ret && i < MESH_PRIMS; ++i) {
+			ret = e3d_primitive_optimize(mesh->prims[i]);
+			if (!ret)
+				ret = e3d_primitive_pack(mesh->prims[i]);
+		}
+		if (ret) {
+			for (i = 0; i < MESH_PRIMS; ++i)
+				e3d_primitive_unref(mesh->prims[i]);
+			free(mesh);
+			return ret;
+		}
+
+		mesh->next = meshes;
+		meshes = mesh;
+	}
+
+	for (i = 0; i < MESH_PRIMS; ++i) {
+		prims[i] = mesh->prims[i];
+		e3d_primitive_ref(prims[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * This creates a new cylinder with the given extends and links one child shape
+ * for each of its primitives to \shape.
+ */
+static int create_cylinder(struct e3d_shape *shape, math_v3 extents,
+						math_v4 col, size_t detail)
+{
+	struct e3d_primitive *prims[MESH_PRIMS];
+	struct e3d_shape *child;
+	size_t i;
+	int ret;
+
+	ret = get_cylinder(prims, extents, col, detail);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < MESH_PRIMS; ++i) {
+		ret = e3d_shape_new(&child);
+		if (ret)
+			break;
+
+		e3d_shape_set_primitive(child, prims[i]);
+		e3d_shape_link(shape, child);
+		e3d_shape_unref(child);
+	}
+
+	for (i = 0; i < MESH_PRIMS; ++i)
+		e3d_primitive_unref(prims[i]);
+
+	return ret;
+}
+
+/*
+ * Largest length of a circle segment of a cylinder on the screen relative to
+ * half the viewport height before the next finer level of detail is used.
+ */
+static const float cylinder_lod_edge = 0.05;
+
+/*
+ * Creates \lods levels of detail of a cylinder and links them as one child to
+ * \shape. The first level has \detail vertices per circle and each further
+ * level halves the number of circle segments as long as \detail stays at
+ * least 5.
+ */
+static int create_cylinder_lods(struct e3d_shape *shape, math_v3 extents,
+				math_v4 col, size_t detail, size_t lods)
+{
+	static const GLfloat pi = 3.14159265358;
+	struct e3d_shape *head = NULL, *level;
+	size_t i;
+	int ret;
+
+	if (!lods)
+		return -EINVAL;
+
+	for (i = 0; i < lods && detail >= 5; ++i) {
+		ret = e3d_shape_new(&level);
+		if (ret)
+			goto err;
+
+		ret = create_cylinder(level, extents, col, detail);
+		if (ret) {
+			e3d_shape_unref(level);
+			goto err;
+		}
+
+		if (head) {
+			e3d_shape_add_lod(head, level, cylinder_lod_edge *
+						(detail - 1) / (2 * pi));
+			e3d_shape_unref(level);
+		} else {
+			head = level;
+		}
+
+		detail = (detail - 1) / 2 + 1;
+	}
+
+	if (!head)
+		return -EINVAL;
+
+	e3d_shape_link(shape, head);
+	ret = 0;
+
+err:
+	e3d_shape_unref(head);
+	return ret;
+}
+
 /*
  * This loads \e as cylinder parameter into \shape. It is added as child entries
- * to \shape.
+ * to \shape. The entry "lod" sets the number of levels of detail, 1 if it is
+ * not given, which disables them.
  * Returns 0 on success.
  */
 static int load_cylinder(const struct uconf_entry *e, struct e3d_shape *shape)
@@ -513,7 +734,7 @@ static int load_cylinder(const struct uconf_entry *e, struct e3d_shape *shape)
 	int ret = 0;
 	const struct uconf_entry *iter;
 	struct e3d_shape *new;
-	size_t detail = 0;
+	size_t detail = 0, lods = 1;
 	math_v3 extends = { 0.0, 0.0, 0.0 };
 	math_v4 color = { 1.0, 1.0, 1.0, 1.0 };
 
@@ -533,6 +754,8 @@ static int load_cylinder(const struct uconf_entry *e, struct e3d_shape *shape)
 			ret = config_load_v34(iter, color, 1);
 		else if (cstr_strcmp(iter->name, -1, "detail"))
 			ret = config_load_size(iter, &detail);
+		else if (cstr_strcmp(iter->name, -1, "lod"))
+			ret = config_load_size(iter, &lods);
 		else
 			ret = load_generic(iter, new);
 
@@ -540,7 +763,7 @@ static int load_cylinder(const struct uconf_entry *e, struct e3d_shape *shape)
 			goto err;
 	}
 
-	ret = create_cylinder(new, extends, color, detail);
+	ret = create_cylinder_lods(new, extends, color, detail, lods);
 	if (ret)
 		goto err;
 
@@ -570,7 +793,7 @@ static int load_generic(const struct uconf_entry *e, struct e3d_shape *shape)
 		ret = config_load_v3(e, v);
 		if (ret)
 			return ret;
-		math_m4_translatev(shape->alter, v);
+		math_trs_translatev(&shape->alter, v);
 	} else {
 		return -EINVAL;
 	}
@@ -580,12 +803,19 @@ static int load_generic(const struct uconf_entry *e, struct e3d_shape *shape)
 
 /*
  * Loads \e as shape into a fresh shape and stores the result into \shape.
+ * If the top level entry "optimize" is set to 1, the triangle and vertex order
+ * of all primitives is optimized for the GPU caches. Generated cylinders are
+ * always optimized.
+ * All primitives are converted to packed vertices, get their edge adjacency
+ * for silhouette outlines and are uploaded into static GL buffer objects so a
+ * GL context must be active.
  * Returns 0 on success.
  */
 int config_load_shape(struct e3d_shape **shape, const struct uconf_entry *e)
 {
 	const struct uconf_entry *iter;
 	struct e3d_shape *v;
+	size_t optimize = 0;
 	int ret;
 
 	if (!uconf_entry_is_list(e))
@@ -596,11 +826,28 @@ int config_load_shape(struct e3d_shape **shape, const struct uconf_entry *e)
 		return ret;
 
 	UCONF_ENTRY_FOR(e, iter) {
-		ret = load_generic(iter, v);
+		if (iter->name && cstr_strcmp(iter->name, -1, "optimize"))
+			ret = config_load_size(iter, &optimize);
+		else
+			ret = load_generic(iter, v);
 		if (ret)
 			break;
 	}
 
+	if (!ret && optimize)
+		ret = e3d_shape_optimize(v);
+
+	if (!ret) {
+		e3d_shape_update_bounds(v);
+		ret = e3d_shape_pack(v);
+	}
+
+	if (!ret)
+		ret = e3d_shape_build_edges(v);
+
+	if (!ret)
+		ret = e3d_shape_grab(v, E3D_VBO_STATIC_DRAW);
+
 	if (!ret) {
 		*shape = v;
 		return 0;
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include <libcstr.h>
 
@@ -28,8 +29,54 @@ struct game {
 
 	struct world *world;
 	struct e3d_transform trans;
+	struct e3d_capture *capture;
+
+	int64_t stats_time;
+	size_t stats_frames;
+	size_t stats_drawn;
+	size_t stats_culled;
 };
 
+/*
+ * Prints the average number of drawn primitives, culled subtrees and issued
+ * and elided GL state calls per frame and the average GPU time of each render
+ * pass once per second.
+ */
+static void game_stats(struct game *game)
+{
+	int64_t now;
+	size_t i;
+
+	game->stats_frames++;
+	game->stats_drawn += game->trans.drawn;
+	game->stats_culled += game->trans.culled;
+
+	now = misc_now();
+	if (now - game->stats_time < 1000000)
+		return;
+
+	ulog_flog(game->log, ULOG_DEBUG, "Render: drawn %lu culled %lu per "
+			"frame\n", game->stats_drawn / game->stats_frames,
+			game->stats_culled / game->stats_frames);
+	ulog_flog(game->log, ULOG_DEBUG, "Render: GL state calls issued %lu "
+		"elided %lu per frame\n",
+		e3d_state_stats.issued / game->stats_frames,
+		e3d_state_stats.elided / game->stats_frames);
+	ulog_flog(game->log, ULOG_DEBUG, "Render: GPU ms full %.3f silhouette "
+		"%.3f normals %.3f\n",
+		world_pass_ms(game->world, WORLD_PASS_FULL),
+		world_pass_ms(game->world, WORLD_PASS_SILHOUETTE),
+		world_pass_ms(game->world, WORLD_PASS_NORMALS));
+
+	game->stats_time = now;
+	game->stats_frames = 0;
+	game->stats_drawn = 0;
+	game->stats_culled = 0;
+	e3d_state_stats_reset();
+	for (i = 0; i < WORLD_PASS_NUM; ++i)
+		e3d_timer_reset(&game->world->timers[i]);
+}
+
 static inline int game_render(struct game *game)
 {
 	e3d_transform_reset(&game->trans);
@@ -38,7 +85,10 @@ static inline int game_render(struct game *game)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	world_draw(game->world, &game->trans, game->shaders);
+	game_stats(game);
 
+	if (game->capture)
+		e3d_capture_frame(game->capture);
 	e3d_window_frame(game->wnd);
 	e3d_etest();
 
@@ -64,7 +114,11 @@ static inline int game_step_world(struct game *game)
 		else if (ret < 0)
 			return ret;
 
-		/* handle events here */
+		/* O switches between the outline modes */
+		if (event.type == E3D_EV_KEY && event.v.key.value &&
+					event.v.key.code == E3D_KEY_O)
+			game->world->outline = (game->world->outline + 1) %
+						(WORLD_OUTLINE_SCREEN + 1);
 	}
 
 	if (e3d_window_get_key(game->wnd, E3D_KEY_A))
@@ -171,6 +225,7 @@ static int setup_obj(struct world_obj **out, const cstr *file)
 
 	e3d_shape_link(obj->shape, shape);
 	e3d_shape_unref(shape);
+	e3d_shape_update_bounds(obj->shape);
 
 	*out = obj;
 	return 0;
@@ -179,7 +234,7 @@ static int setup_obj(struct world_obj **out, const cstr *file)
 static int setup_world(struct world **world)
 {
 	struct world *w;
-	struct world_obj *obj;
+	struct world_obj *obj, *puk;
 	int ret;
 
 	ret = world_new(&w);
@@ -197,6 +252,7 @@ static int setup_world(struct world **world)
 		printf("Cannot open room.conf\n");
 		goto err;
 	}
+	obj->is_static = true;
 	world_add(w, obj);
 	world_obj_unref(obj);
 
@@ -206,6 +262,7 @@ static int setup_world(struct world **world)
 		goto err;
 	}
 	phys_body_set_shape_table(obj->body);
+	obj->is_static = true;
 	world_add(w, obj);
 	world_obj_unref(obj);
 
@@ -217,13 +274,18 @@ static int setup_world(struct world **world)
 	phys_body_set_shape_puk(obj->body);
 	world_add(w, obj);
 	phys_body_force(obj->body, (math_v3){ 0, 0, 0.0 });
-	world_obj_unref(obj);
+	puk = obj;
 
-	ret = setup_obj(&obj, &CSTR_CS("data/puk.conf"));
+	/* the mallet shares the mesh of the puck so both are drawn instanced */
+	ret = world_obj_new(&obj);
 	if (ret) {
-		printf("Cannot open puk.conf\n");
+		world_obj_unref(puk);
 		goto err;
 	}
+	world_obj_set_shape(obj, puk->shape);
+	/* the mallet is a darker shade of the puck */
+	world_obj_set_color(obj, (math_v4){ 0.5, 1.0, 1.0, 1.0 });
+	world_obj_unref(puk);
 	phys_body_set_shape_cylinder(obj->body);
 	world_add(w, obj);
 	p1 = obj;
@@ -241,20 +303,30 @@ int game_run(struct ulog_dev *log, struct e3d_window *wnd,
 {
 	int ret;
 	struct game game;
+	const char *path;
 
 	memset(&game, 0, sizeof(game));
 	game.log = log;
 	game.wnd = wnd;
 	game.shaders = shaders;
 	game.tick_time = 20000;
+	game.stats_time = misc_now();
 	e3d_transform_init(&game.trans);
 
 	ret = setup_world(&game.world);
 	if (ret)
 		goto err_math;
 
+	/* E3D_CAPTURE records the game at the tick rate */
+	path = getenv("E3D_CAPTURE");
+	if (path && e3d_capture_new(&game.capture, path,
+						1000000 / game.tick_time))
+		ulog_flog(log, ULOG_WARN, "Cannot capture into %s\n", path);
+
 	ret = game_loop(&game);
 
+	if (game.capture)
+		e3d_capture_free(game.capture);
 	world_free(game.world);
 
 err_math:
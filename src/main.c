@@ -109,16 +109,40 @@ static int init_shaders(struct shaders *shaders)
 		return ret;
 
 	ret = e3d_shader_new(&shaders->simple, E3D_SHADER_SIMPLE);
-	if (ret) {
-		e3d_shader_free(shaders->debug);
-		return ret;
-	}
+	if (ret)
+		goto err_debug;
+
+	ret = e3d_shader_new(&shaders->debug_inst, E3D_SHADER_DEBUG_INSTANCED);
+	if (ret)
+		goto err_simple;
+
+	ret = e3d_shader_new(&shaders->simple_inst,
+						E3D_SHADER_SIMPLE_INSTANCED);
+	if (ret)
+		goto err_debug_inst;
+
+	ret = e3d_shader_new(&shaders->outline, E3D_SHADER_OUTLINE);
+	if (ret)
+		goto err_simple_inst;
 
 	return 0;
+
+err_simple_inst:
+	e3d_shader_free(shaders->simple_inst);
+err_debug_inst:
+	e3d_shader_free(shaders->debug_inst);
+err_simple:
+	e3d_shader_free(shaders->simple);
+err_debug:
+	e3d_shader_free(shaders->debug);
+	return ret;
 }
 
 static void destroy_shaders(struct shaders *shaders)
 {
+	e3d_shader_free(shaders->outline);
+	e3d_shader_free(shaders->simple_inst);
+	e3d_shader_free(shaders->debug_inst);
 	e3d_shader_free(shaders->simple);
 	e3d_shader_free(shaders->debug);
 }
@@ -153,6 +177,7 @@ int main()
 	}
 
 	ret = game_run(log, wnd, &shaders);
+	config_flush_meshes();
 
 	ulog_unref(log);
 err_shader:
@@ -4,6 +4,8 @@
  * Dedicated to the Public Domain
  */
 
+#include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 
 #include <sg.h>
@@ -50,6 +52,11 @@ void math_destroy()
 	math_log = NULL;
 }
 
+const char *math_backend()
+{
+	return "plib";
+}
+
 void math_v3_copy(math_v3 dest, math_v3 src)
 {
 	sgCopyVec3(dest, src);
@@ -149,61 +156,230 @@ void math_m4_invert(math_m4 m)
 	sgInvertMat4(m);
 }
 
+/*
+ * Quaternions follow the plib convention. That is, the matrix that is built by
+ * math_q4_to_m4() rotates by the conjugate of the quaternion in the usual
+ * Hamilton notation. The helpers below respect this so the results always
+ * match the matrices of math_q4_to_m4().
+ */
+
+/*
+ * Stores the rotation into \dest that results from applying \b first and then
+ * \a, that is, the quaternion of the matrix product a * b.
+ */
+static void q4_mult_dest(math_q4 dest, const math_q4 a, const math_q4 b)
+{
+	math_q4 r;
+
+	r[0] = b[3] * a[0] + b[0] * a[3] + b[1] * a[2] - b[2] * a[1];
+	r[1] = b[3] * a[1] - b[0] * a[2] + b[1] * a[3] + b[2] * a[0];
+	r[2] = b[3] * a[2] + b[0] * a[1] - b[1] * a[0] + b[2] * a[3];
+	r[3] = b[3] * a[3] - b[0] * a[0] - b[1] * a[1] - b[2] * a[2];
+
+	sgCopyQuat(dest, r);
+}
+
+/* rotates \v by \q and stores the result in \dest */
+static void q4_rotate_v3(math_v3 dest, const math_q4 q, const math_v3 v)
+{
+	math_v3 u, t, c;
+
+	/* conjugate as explained above */
+	u[0] = -q[0];
+	u[1] = -q[1];
+	u[2] = -q[2];
+
+	sgVectorProductVec3(t, u, v);
+	sgScaleVec3(t, 2.0f);
+	sgVectorProductVec3(c, u, t);
+
+	dest[0] = v[0] + q[3] * t[0] + c[0];
+	dest[1] = v[1] + q[3] * t[1] + c[1];
+	dest[2] = v[2] + q[3] * t[2] + c[2];
+}
+
+void math_trs_identity(struct math_trs *trs)
+{
+	sgZeroVec3(trs->position);
+	sgMakeIdentQuat(trs->rotation);
+	sgSetVec3(trs->scale, 1.0f, 1.0f, 1.0f);
+	sgMakeIdentMat4(trs->matrix);
+	trs->dirty = false;
+}
+
+void math_trs_set_position(struct math_trs *trs, math_v3 v)
+{
+	sgCopyVec3(trs->position, v);
+	trs->dirty = true;
+}
+
+/*
+ * Moves \trs by \v in its local coordinate system. This is the same as
+ * multiplying the matrix with a translation matrix from the right.
+ */
+void math_trs_translatev(struct math_trs *trs, math_v3 v)
+{
+	math_v3 t;
+
+	t[0] = v[0] * trs->scale[0];
+	t[1] = v[1] * trs->scale[1];
+	t[2] = v[2] * trs->scale[2];
+	q4_rotate_v3(t, trs->rotation, t);
+	sgAddVec3(trs->position, t);
+	trs->dirty = true;
+}
+
+void math_trs_set_rotation(struct math_trs *trs, math_q4 q)
+{
+	sgCopyQuat(trs->rotation, q);
+	trs->dirty = true;
+}
+
+/*
+ * Rotates \trs on the given angle and axis. This is the same as multiplying the
+ * rotation matrix with the matrix of the new rotation from the right.
+ */
+void math_trs_rotate(struct math_trs *trs, float angle, math_v3 axis)
+{
+	math_q4 q;
+
+	sgAngleAxisToQuat(q, angle, axis);
+	q4_mult_dest(trs->rotation, trs->rotation, q);
+	sgNormalizeQuat(trs->rotation);
+	trs->dirty = true;
+}
+
+void math_trs_set_scale(struct math_trs *trs, math_v3 v)
+{
+	sgCopyVec3(trs->scale, v);
+	trs->dirty = true;
+}
+
+/*
+ * Stores the transformation \a * \b into \dest. \dest may be equal to \a or \b.
+ */
+void math_trs_compose_dest(struct math_trs *dest, struct math_trs *a,
+							struct math_trs *b)
+{
+	math_v3 p;
+
+	p[0] = b->position[0] * a->scale[0];
+	p[1] = b->position[1] * a->scale[1];
+	p[2] = b->position[2] * a->scale[2];
+	q4_rotate_v3(p, a->rotation, p);
+	sgAddVec3(p, a->position);
+
+	q4_mult_dest(dest->rotation, a->rotation, b->rotation);
+	dest->scale[0] = a->scale[0] * b->scale[0];
+	dest->scale[1] = a->scale[1] * b->scale[1];
+	dest->scale[2] = a->scale[2] * b->scale[2];
+	sgCopyVec3(dest->position, p);
+	dest->dirty = true;
+}
+
+/*
+ * Stores the inverse of \src into \dest. \dest may be equal to \src.
+ */
+void math_trs_invert_dest(struct math_trs *dest, struct math_trs *src)
+{
+	math_v3 p;
+
+	dest->rotation[0] = -src->rotation[0];
+	dest->rotation[1] = -src->rotation[1];
+	dest->rotation[2] = -src->rotation[2];
+	dest->rotation[3] = src->rotation[3];
+	dest->scale[0] = 1.0f / src->scale[0];
+	dest->scale[1] = 1.0f / src->scale[1];
+	dest->scale[2] = 1.0f / src->scale[2];
+
+	q4_rotate_v3(p, dest->rotation, src->position);
+	dest->position[0] = -p[0] * dest->scale[0];
+	dest->position[1] = -p[1] * dest->scale[1];
+	dest->position[2] = -p[2] * dest->scale[2];
+	dest->dirty = true;
+}
+
+/*
+ * Rebuilds the matrix of \trs. Use math_trs_matrix() to avoid rebuilding an
+ * unchanged matrix.
+ */
+void math_trs_update(struct math_trs *trs)
+{
+	size_t i;
+
+	sgQuatToMatrix(trs->matrix, trs->rotation);
+
+	for (i = 0; i < 3; ++i) {
+		trs->matrix[i][0] *= trs->scale[i];
+		trs->matrix[i][1] *= trs->scale[i];
+		trs->matrix[i][2] *= trs->scale[i];
+	}
+
+	trs->matrix[3][0] = trs->position[0];
+	trs->matrix[3][1] = trs->position[1];
+	trs->matrix[3][2] = trs->position[2];
+	trs->matrix[3][3] = 1.0f;
+	trs->dirty = false;
+}
+
 void math_stack_init(struct math_stack *stack)
 {
-	stack->stack.next = NULL;
-	math_m4_identity(stack->stack.matrix);
-	stack->cache = NULL;
+	stack->pos = 0;
+	stack->max = 0;
+	math_m4_identity(stack->stack[0]);
 }
 
 void math_stack_destroy(struct math_stack *stack)
 {
-	struct math_entry *tmp;
+}
 
-	while (stack->stack.next) {
-		tmp = stack->stack.next;
-		stack->stack.next = tmp->next;
-		free(tmp);
+static int stack_grow(struct math_stack *stack)
+{
+	if (stack->pos + 1 >= MATH_STACK_SIZE) {
+		ulog_flog(math_log, ULOG_ERROR, "matrix stack overflow\n");
+		return -ENOMEM;
 	}
 
-	while (stack->cache) {
-		tmp = stack->cache;
-		stack->cache = tmp->next;
-		free(tmp);
-	}
+	++stack->pos;
+	if (stack->pos > stack->max)
+		stack->max = stack->pos;
+
+	return 0;
 }
 
 int math_stack_push(struct math_stack *stack)
 {
-	struct math_entry *entry;
+	int ret;
 
-	if (stack->cache) {
-		entry = stack->cache;
-		stack->cache = entry->next;
-	} else {
-		entry = (math_entry*)malloc(sizeof(*entry));
-		if (!entry)
-			return -ENOMEM;
-	}
-
-	math_m4_copy(entry->matrix, stack->stack.matrix);
-	entry->next = stack->stack.next;
-	stack->stack.next = entry;
+	ret = stack_grow(stack);
+	if (ret)
+		return ret;
 
+	math_m4_copy(stack->stack[stack->pos], stack->stack[stack->pos - 1]);
 	return 0;
 }
 
-void math_stack_pop(struct math_stack *stack)
+/*
+ * Pushes a new entry on the stack and multiplies it with \m. This is the same
+ * as math_stack_push() followed by math_m4_mult() on the tip but writes the
+ * product directly into the new entry instead of copying the tip first.
+ */
+int math_stack_push_mult(struct math_stack *stack, math_m4 m)
 {
-	struct math_entry *entry;
+	int ret;
 
-	assert(stack->stack.next);
+	ret = stack_grow(stack);
+	if (ret)
+		return ret;
 
-	entry = stack->stack.next;
-	stack->stack.next = entry->next;
+	math_m4_mult_dest(stack->stack[stack->pos],
+					stack->stack[stack->pos - 1], m);
+	return 0;
+}
 
-	entry->next = stack->cache;
-	stack->cache = entry;
+void math_stack_pop(struct math_stack *stack)
+{
+	assert(stack->pos);
 
-	math_m4_copy(stack->stack.matrix, entry->matrix);
+	--stack->pos;
 }
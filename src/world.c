@@ -27,7 +27,10 @@ int world_obj_new(struct world_obj **obj)
 		return -ENOMEM;
 
 	memset(o, 0, sizeof(*o));
-	math_m4_identity(o->alter);
+	math_trs_identity(&o->alter);
+	math_m4_identity(o->matrix);
+	e3d_bounds_clear(&o->bounds);
+	math_v4_copy(o->color, (math_v4){ 1.0, 1.0, 1.0, 1.0 });
 
 	ret = e3d_shape_new(&o->shape);
 	if (ret) {
@@ -91,6 +94,36 @@ void world_obj_unref(struct world_obj *obj)
 	free(obj);
 }
 
+/*
+ * Sets the color that the vertex colors of \obj are multiplied with. Static
+ * objects are baked into the static batch with their color, so it is rebuilt.
+ */
+void world_obj_set_color(struct world_obj *obj, math_v4 color)
+{
+	math_v4_copy(obj->color, color);
+
+	if (obj->world && obj->is_static)
+		obj->world->batch_dirty = true;
+}
+
+/*
+ * Replaces the shape of \obj. Objects that share the same shape are drawn
+ * instanced.
+ */
+void world_obj_set_shape(struct world_obj *obj, struct e3d_shape *shape)
+{
+	e3d_shape_ref(shape);
+	e3d_shape_unref(obj->shape);
+	obj->shape = shape;
+
+	if (!obj->world)
+		return;
+
+	if (obj->is_static)
+		obj->world->batch_dirty = true;
+	obj->world->groups_dirty = true;
+}
+
 static void unlink_bodies(struct world_obj *obj)
 {
 	struct world_obj *iter;
@@ -98,6 +131,11 @@ static void unlink_bodies(struct world_obj *obj)
 	if (!obj->world)
 		return;
 
+	if (obj->is_static)
+		obj->world->batch_dirty = true;
+	obj->world->groups_dirty = true;
+	obj->batched = false;
+	obj->group = NULL;
 	obj->world = NULL;
 	phys_body_unlink(obj->body);
 
@@ -132,6 +170,9 @@ static void link_bodies(struct world_obj *obj)
 
 	assert(obj->world);
 	phys_world_add(obj->world->phys, obj->body);
+	if (obj->is_static)
+		obj->world->batch_dirty = true;
+	obj->world->groups_dirty = true;
 
 	for (iter = obj->first; iter; iter = iter->next) {
 		assert(!iter->world);
@@ -188,27 +229,501 @@ void world_obj_link_first(struct world_obj *parent, struct world_obj *obj)
 		link_bodies(obj);
 }
 
-static void draw_obj(struct world_obj *obj,
+/*
+ * Updates the transformation matrix and the bounding volume of \obj and all its
+ * childs. The bounding volume is in the coordinate system of \obj and covers
+ * its shape and all childs. This is called once per frame so all passes can
+ * share the physics transformation and cull whole subtrees.
+ */
+static void update_obj(struct world_obj *obj)
+{
+	struct world_obj *iter;
+	math_m4 phys;
+
+	math_m4_copy(obj->matrix, math_trs_matrix(&obj->alter));
+
+	if (obj->body) {
+		phys_body_get_transform(obj->body, phys);
+		math_m4_mult(obj->matrix, phys);
+	}
+
+	e3d_bounds_clear(&obj->bounds);
+	e3d_bounds_merge(&obj->bounds, &obj->shape->bounds,
+					math_trs_matrix(&obj->shape->alter));
+
+	for (iter = obj->first; iter; iter = iter->next) {
+		update_obj(iter);
+		e3d_bounds_merge(&obj->bounds, &iter->bounds, iter->matrix);
+	}
+}
+
+/*
+ * Adds the shapes of all static objects in the subtree of \obj to \batch. \m
+ * is the world transformation of the parent of \obj. Objects whose shapes
+ * cannot be batched are drawn separately.
+ */
+static int collect_static(struct world_obj *obj, struct e3d_batch *batch,
+								math_m4 m)
+{
+	struct world_obj *iter;
+	math_m4 local;
+	int ret;
+
+	math_m4_mult_dest(local, m, obj->matrix);
+	obj->batched = false;
+
+	if (obj->is_static && e3d_batch_can_add(obj->shape)) {
+		ret = e3d_batch_add_shape(batch, obj->shape, local,
+								obj->color);
+		if (ret)
+			return ret;
+		obj->batched = true;
+	}
+
+	for (iter = obj->first; iter; iter = iter->next) {
+		ret = collect_static(iter, batch, local);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void clear_batched(struct world_obj *obj)
+{
+	struct world_obj *iter;
+
+	obj->batched = false;
+	for (iter = obj->first; iter; iter = iter->next)
+		clear_batched(iter);
+}
+
+/*
+ * Rebuilds the static batch of \world. Object matrices must be up to date. If
+ * the batch cannot be built, all static objects are drawn separately.
+ */
+static void rebuild_batch(struct world *world)
+{
+	struct e3d_batch batch;
+	math_m4 m;
+	int ret;
+
+	world->batch_dirty = false;
+	world->groups_dirty = true;
+	e3d_silhouette_invalidate(&world->silhouette);
+	e3d_primitive_unref(world->batch);
+	world->batch = NULL;
+
+	e3d_batch_init(&batch);
+	math_m4_identity(m);
+
+	ret = collect_static(world->root, &batch, m);
+	if (!ret)
+		ret = e3d_batch_build(&batch, &world->batch);
+	if (ret)
+		clear_batched(world->root);
+	else if (e3d_primitive_build_edges(world->batch))
+		ulog_flog(NULL, ULOG_WARN,
+				"World: Cannot build edges of static batch\n");
+
+	e3d_batch_destroy(&batch);
+}
+
+static void draw_batch(struct world *world,
 	const struct e3d_shader_locations *loc, struct e3d_transform *trans,
 								int drawer)
+{
+	if (!world->batch)
+		return;
+
+	if (!e3d_transform_visible(trans, &world->batch->bounds))
+		return;
+
+	e3d_primitive_draw(world->batch, drawer, loc, trans);
+}
+
+static struct world_group *find_group(struct world *world,
+						struct e3d_shape *shape)
+{
+	size_t i;
+
+	for (i = 0; i < world->group_num; ++i)
+		if (world->groups[i].shape == shape)
+			return &world->groups[i];
+
+	return NULL;
+}
+
+/*
+ * Adds all objects in the subtree of \obj that are not batched to the group of
+ * their shape. \size is the number of allocated groups.
+ */
+static int count_shapes(struct world *world, struct world_obj *obj,
+								size_t *size)
+{
+	struct world_obj *iter;
+	struct world_group *g;
+	size_t nsize;
+	int ret;
+
+	obj->group = NULL;
+
+	if (obj != world->root && !obj->batched) {
+		g = find_group(world, obj->shape);
+		if (!g) {
+			if (world->group_num >= *size) {
+				nsize = *size ? *size * 2 : 8;
+				g = realloc(world->groups, nsize * sizeof(*g));
+				if (!g)
+					return -ENOMEM;
+				world->groups = g;
+				*size = nsize;
+			}
+
+			g = &world->groups[world->group_num++];
+			memset(g, 0, sizeof(*g));
+			g->shape = obj->shape;
+		}
+		++g->size;
+	}
+
+	for (iter = obj->first; iter; iter = iter->next) {
+		ret = count_shapes(world, iter, size);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void clear_groups(struct world_obj *obj)
+{
+	struct world_obj *iter;
+
+	obj->group = NULL;
+	for (iter = obj->first; iter; iter = iter->next)
+		clear_groups(iter);
+}
+
+static void assign_groups(struct world *world, struct world_obj *obj)
+{
+	struct world_obj *iter;
+
+	if (obj != world->root && !obj->batched)
+		obj->group = find_group(world, obj->shape);
+
+	for (iter = obj->first; iter; iter = iter->next)
+		assign_groups(world, iter);
+}
+
+/*
+ * Rebuilds the instance groups of \world. Only shapes that are used by at
+ * least two objects get a group. All other objects are drawn separately, which
+ * is also the fallback if the groups cannot be built.
+ */
+static void rebuild_groups(struct world *world)
+{
+	size_t i, num, size = 0;
+	int ret;
+
+	world->groups_dirty = false;
+	free(world->groups);
+	world->groups = NULL;
+	world->group_num = 0;
+
+	ret = count_shapes(world, world->root, &size);
+	if (ret)
+		goto err;
+
+	num = 0;
+	for (i = 0; i < world->group_num; ++i) {
+		if (world->groups[i].size < 2)
+			continue;
+
+		world->groups[num] = world->groups[i];
+		world->groups[num].first = num ? world->groups[num - 1].first +
+					world->groups[num - 1].size : 0;
+		++num;
+	}
+	world->group_num = num;
+
+	if (!num) {
+		e3d_vbo_unref(world->instances);
+		world->instances = NULL;
+		return;
+	}
+
+	size = world->groups[num - 1].first + world->groups[num - 1].size;
+	if (!world->instances || world->instances->num < size) {
+		e3d_vbo_unref(world->instances);
+		world->instances = NULL;
+		ret = e3d_vbo_new_instances(&world->instances, size);
+		if (ret)
+			goto err;
+	}
+
+	assign_groups(world, world->root);
+	return;
+
+err:
+	world->group_num = 0;
+	clear_groups(world->root);
+}
+
+/*
+ * Traverses the subtree of \obj once and culls it. Visible objects that belong
+ * to a group are written into the instance buffer of \world and the
+ * primitives of all other visible objects are added to the render queue.
+ */
+static int queue_obj(struct world *world, struct world_obj *obj,
+						struct e3d_transform *trans)
+{
+	struct world_obj *iter;
+	struct world_group *g;
+	float size;
+	int ret;
+
+	ret = math_stack_push_mult(&trans->mod_stack, obj->matrix);
+	if (ret)
+		return ret;
+
+	if (!e3d_transform_visible(trans, &obj->bounds))
+		goto out;
+
+	if (obj->group) {
+		g = obj->group;
+		assert(g->num < g->size);
+		e3d_instance_set(E3D_VBO_AT(world->instances,
+						g->first + g->num),
+				MATH_TIP(&trans->mod_stack), obj->color);
+		++g->num;
+
+		size = e3d_transform_size(trans, &obj->bounds);
+		if (size > g->lod_size)
+			g->lod_size = size;
+	} else if (!obj->batched) {
+		size = e3d_transform_size(trans, &obj->bounds);
+		trans->lod_size = e3d_lod_hysteresis(&obj->lod_size, size);
+		trans->color = obj->color;
+		ret = e3d_queue_add_shape(&world->queue, obj->shape, trans);
+		trans->color = NULL;
+		trans->lod_size = 0.0f;
+		if (ret)
+			goto out;
+	}
+
+	for (iter = obj->first; iter; iter = iter->next) {
+		ret = queue_obj(world, iter, trans);
+		if (ret)
+			goto out;
+	}
+
+out:
+	math_stack_pop(&trans->mod_stack);
+	return ret;
+}
+
+/* computes the position of the eye of \trans in world space */
+static void eye_position(struct e3d_transform *trans, math_v3 pos)
+{
+	math_m4 inv;
+
+	math_m4_invert_dest(inv, MATH_TIP(&trans->eye_stack));
+	math_v3_copy(pos, inv[3]);
+}
+
+/*
+ * Collects the silhouette edges of all items of the render queue except the
+ * static batch, which build_queue() adds first, and of all visible instances
+ * at the level of detail of their group.
+ */
+static int collect_edges(struct world *world, struct e3d_transform *trans,
+							const float *eye)
+{
+	struct e3d_draw_item *item;
+	struct e3d_instance *inst;
+	struct world_group *g;
+	size_t i, j;
+	int ret = 0;
+
+	for (i = 0; i < world->queue.num; ++i) {
+		item = &world->queue.items[i];
+		if (item->prim == world->batch)
+			continue;
+		ret = e3d_silhouette_add(&world->silhouette, item->prim,
+							item->matrix, eye);
+		if (ret)
+			return ret;
+	}
+
+	ret = math_stack_push(&trans->mod_stack);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < world->group_num && !ret; ++i) {
+		g = &world->groups[i];
+		trans->lod_size = g->lod_size;
+
+		for (j = 0; j < g->num && !ret; ++j) {
+			inst = E3D_VBO_AT(world->instances, g->first + j);
+			math_m4_copy(MATH_TIP(&trans->mod_stack), inst->model);
+			ret = e3d_silhouette_add_shape(&world->silhouette,
+							g->shape, trans, eye);
+		}
+	}
+
+	trans->lod_size = 0.0f;
+	math_stack_pop(&trans->mod_stack);
+	return ret;
+}
+
+/*
+ * Builds the render queue and the instances of the current frame. Object
+ * matrices must be up to date. If the queue cannot be built completely, only
+ * the objects that were added are drawn.
+ */
+static void build_queue(struct world *world, struct e3d_transform *trans)
+{
+	math_v3 pos;
+	const float *eye = NULL;
+	struct world_group *g;
+	size_t i;
+	int ret;
+
+	e3d_queue_reset(&world->queue);
+	e3d_silhouette_reset(&world->silhouette);
+	for (i = 0; i < world->group_num; ++i) {
+		world->groups[i].num = 0;
+		world->groups[i].lod_size = 0.0f;
+	}
+
+	if (world->outline == WORLD_OUTLINE_EDGES) {
+		eye_position(trans, pos);
+		eye = pos;
+	}
+
+	if (world->batch && e3d_transform_visible(trans,
+						&world->batch->bounds)) {
+		ret = e3d_queue_add(&world->queue, world->batch,
+					MATH_TIP(&trans->mod_stack), trans);
+		if (ret)
+			goto out;
+
+		/* the static edges only change if the eye moves */
+		if (eye) {
+			ret = e3d_silhouette_add_cached(&world->silhouette,
+				world->batch, MATH_TIP(&trans->mod_stack), eye);
+			if (ret)
+				goto out;
+		}
+	}
+
+	ret = queue_obj(world, world->root, trans);
+
+	for (i = 0; i < world->group_num; ++i) {
+		g = &world->groups[i];
+		if (g->num)
+			g->lod_size = e3d_lod_hysteresis(&g->lod_last,
+								g->lod_size);
+	}
+
+	if (!ret && eye)
+		ret = collect_edges(world, trans, eye);
+
+out:
+	if (ret)
+		ulog_flog(NULL, ULOG_WARN, "World: Cannot build render queue "
+							"%d\n", ret);
+
+	e3d_queue_sort(&world->queue);
+
+	/*
+	 * The groups are stored back to back, so the last one ends the used
+	 * instances. The client memory is used if the upload fails.
+	 */
+	if (world->group_num) {
+		g = &world->groups[world->group_num - 1];
+		e3d_vbo_grab_range(world->instances, g->first + g->num,
+							E3D_VBO_STREAM_DRAW);
+	}
+}
+
+/*
+ * Returns the variant of the lit shader \shader with \flags for the lights of
+ * the world. \shader itself has all features and is used if the variant cannot
+ * be built.
+ */
+static struct e3d_shader *lit_shader(struct e3d_shader *shader,
+							unsigned int flags)
+{
+	struct e3d_shader *variant;
+
+	/* only light0 is supplied */
+	if (e3d_shader_variant(shader, &variant, 1, flags))
+		return shader;
+
+	return variant;
+}
+
+static void draw_groups(struct world *world, struct e3d_shader *shader,
+				struct e3d_transform *trans, int drawer)
+{
+	const struct e3d_shader_locations *loc;
+	struct world_group *g;
+	size_t i;
+
+	if (!world->group_num)
+		return;
+
+	e3d_shader_use(shader);
+	loc = e3d_shader_locations(shader);
+
+	if (drawer == E3D_DRAW_FULL)
+		e3d_light_supply(&world->light0, 0, &world->eye, loc);
+
+	for (i = 0; i < world->group_num; ++i) {
+		g = &world->groups[i];
+		if (!g->num)
+			continue;
+
+		trans->lod_size = g->lod_size;
+		e3d_shape_draw_instanced(g->shape, drawer, loc, trans,
+					world->instances, g->first, g->num);
+	}
+
+	trans->lod_size = 0.0f;
+}
+
+/*
+ * The normals debug pass is not part of the render queue. It walks the tree and
+ * also draws the normals of instanced objects.
+ */
+static void draw_obj_normals(struct world_obj *obj,
+	const struct e3d_shader_locations *loc, struct e3d_transform *trans)
 {
 	struct world_obj *iter;
-	math_m4 phys;
 
 	assert(obj->world);
 
-	math_stack_push(&trans->mod_stack);
-	math_m4_mult(MATH_TIP(&trans->mod_stack), obj->alter);
+	if (math_stack_push_mult(&trans->mod_stack, obj->matrix))
+		return;
 
-	if (obj->body) {
-		phys_body_get_transform(obj->body, phys);
-		math_m4_mult(MATH_TIP(&trans->mod_stack), phys);
+	if (!e3d_transform_visible(trans, &obj->bounds)) {
+		math_stack_pop(&trans->mod_stack);
+		return;
 	}
 
-	e3d_shape_draw(obj->shape, drawer, loc, trans);
+	if (!obj->batched) {
+		if (obj->group)
+			trans->lod_size = obj->group->lod_size;
+		else
+			trans->lod_size = obj->lod_size;
+		e3d_shape_draw(obj->shape, E3D_DRAW_NORMALS, loc, trans);
+		trans->lod_size = 0.0f;
+	}
 
 	for (iter = obj->first; iter; iter = iter->next)
-		draw_obj(iter, loc, trans, drawer);
+		draw_obj_normals(iter, loc, trans);
 
 	math_stack_pop(&trans->mod_stack);
 }
@@ -217,6 +732,7 @@ int world_new(struct world **world)
 {
 	int ret;
 	struct world *w;
+	size_t i;
 
 	w = malloc(sizeof(*w));
 	if (!w)
@@ -237,6 +753,12 @@ int world_new(struct world **world)
 
 	e3d_eye_init(&w->eye);
 	e3d_light_init(&w->light0);
+	e3d_queue_init(&w->queue);
+	e3d_silhouette_init(&w->silhouette);
+	e3d_outline_init(&w->screen);
+	w->outline = WORLD_OUTLINE_EDGES;
+	for (i = 0; i < WORLD_PASS_NUM; ++i)
+		e3d_timer_init(&w->timers[i]);
 
 	*world = w;
 	return 0;
@@ -250,6 +772,16 @@ err:
 
 void world_free(struct world *world)
 {
+	size_t i;
+
+	for (i = 0; i < WORLD_PASS_NUM; ++i)
+		e3d_timer_destroy(&world->timers[i]);
+	e3d_outline_destroy(&world->screen);
+	e3d_silhouette_destroy(&world->silhouette);
+	e3d_queue_destroy(&world->queue);
+	e3d_vbo_unref(world->instances);
+	free(world->groups);
+	e3d_primitive_unref(world->batch);
 	e3d_light_destroy(&world->light0);
 	e3d_eye_destroy(&world->eye);
 	world->root->world = NULL;
@@ -262,48 +794,94 @@ void world_draw(struct world *world, struct e3d_transform *trans,
 							struct shaders *shaders)
 {
 	const struct e3d_shader_locations *loc;
+	struct e3d_shader *shader;
+	unsigned int flags;
 	bool draw_normals = false;
+	bool screen = false;
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	E3D(glEnable(GL_DEPTH_TEST));
+	E3D(glEnable(GL_CULL_FACE));
 
 	e3d_eye_apply(&world->eye, MATH_TIP(&trans->eye_stack));
+	e3d_transform_cull(trans);
+	update_obj(world->root);
+	if (world->batch_dirty)
+		rebuild_batch(world);
+	if (world->groups_dirty)
+		rebuild_groups(world);
+
+	/* falls back to silhouette edges if there is no offscreen target */
+	if (world->outline == WORLD_OUTLINE_SCREEN) {
+		screen = !e3d_outline_begin(&world->screen);
+		if (!screen) {
+			ulog_flog(NULL, ULOG_WARN, "World: Cannot draw "
+				"screen space outlines, using edges\n");
+			world->outline = WORLD_OUTLINE_EDGES;
+		}
+	}
 
-	/* draw normal scene */
-	glLineWidth(1.0);
-	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	glDepthFunc(GL_LESS);
-	glCullFace(GL_BACK);
-
-	e3d_shader_use(shaders->debug);
-	loc = e3d_shader_locations(shaders->debug);
-
-	e3d_eye_supply(&world->eye, loc);
-	e3d_light_supply(&world->light0, 0, loc);
+	build_queue(world, trans);
 
-	draw_obj(world->root, loc, trans, E3D_DRAW_FULL);
+	/* draw normal scene */
+	e3d_timer_begin(&world->timers[WORLD_PASS_FULL]);
+	E3D(glLineWidth(1.0));
+	E3D(glPolygonMode(GL_FRONT_AND_BACK, GL_FILL));
+	E3D(glDepthFunc(GL_LESS));
+	E3D(glCullFace(GL_BACK));
+
+	flags = screen ? E3D_SHADER_NORMALS : 0;
+	shader = lit_shader(shaders->debug, flags);
+	e3d_shader_use(shader);
+	loc = e3d_shader_locations(shader);
+
+	e3d_light_supply(&world->light0, 0, &world->eye, loc);
+
+	trans->light = &world->light0;
+	e3d_queue_draw(&world->queue, E3D_DRAW_FULL, loc, trans);
+	draw_groups(world, lit_shader(shaders->debug_inst, flags), trans,
+								E3D_DRAW_FULL);
+	trans->light = NULL;
+	e3d_timer_end(&world->timers[WORLD_PASS_FULL]);
 
 	/* draw silhouette edges */
-	glLineWidth(5.0);
-	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-	glDepthFunc(GL_LEQUAL);
-	glCullFace(GL_FRONT);
+	e3d_timer_begin(&world->timers[WORLD_PASS_SILHOUETTE]);
+	E3D(glDepthFunc(GL_LEQUAL));
+
+	if (screen) {
+		e3d_shader_use(shaders->outline);
+		loc = e3d_shader_locations(shaders->outline);
+		e3d_outline_end(&world->screen, loc, trans);
+	} else if (world->outline == WORLD_OUTLINE_EDGES) {
+		e3d_shader_use(shaders->simple);
+		loc = e3d_shader_locations(shaders->simple);
+		e3d_silhouette_draw(&world->silhouette, loc, trans);
+	} else {
+		e3d_shader_use(shaders->simple);
+		loc = e3d_shader_locations(shaders->simple);
 
-	e3d_shader_use(shaders->simple);
-	loc = e3d_shader_locations(shaders->simple);
+		E3D(glLineWidth(5.0));
+		E3D(glPolygonMode(GL_FRONT_AND_BACK, GL_LINE));
+		E3D(glCullFace(GL_FRONT));
 
-	draw_obj(world->root, loc, trans, E3D_DRAW_SILHOUETTE);
+		e3d_queue_draw(&world->queue, E3D_DRAW_SILHOUETTE, loc, trans);
+		draw_groups(world, shaders->simple_inst, trans,
+							E3D_DRAW_SILHOUETTE);
+	}
+	e3d_timer_end(&world->timers[WORLD_PASS_SILHOUETTE]);
 
 	/* draw normals */
 	if (draw_normals) {
-		glLineWidth(1.0);
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-		glDepthFunc(GL_LESS);
-		glCullFace(GL_BACK);
+		e3d_timer_begin(&world->timers[WORLD_PASS_NORMALS]);
+		E3D(glLineWidth(1.0));
+		E3D(glPolygonMode(GL_FRONT_AND_BACK, GL_FILL));
+		E3D(glDepthFunc(GL_LESS));
+		E3D(glCullFace(GL_BACK));
 
 		e3d_shader_use(shaders->simple);
 		loc = e3d_shader_locations(shaders->simple);
 
-		draw_obj(world->root, loc, trans, E3D_DRAW_NORMALS);
+		draw_batch(world, loc, trans, E3D_DRAW_NORMALS);
+		draw_obj_normals(world->root, loc, trans);
+		e3d_timer_end(&world->timers[WORLD_PASS_NORMALS]);
 	}
 }